@@ -0,0 +1,775 @@
+// Load generator and mock upstream for measuring http-dns.
+//
+// Load mode replays query names, drawn from a Zipf distribution or read from
+// a file, against a UDP listener at a fixed rate (open loop) or with a fixed
+// number of queries outstanding (closed loop), and reports throughput,
+// latency percentiles and loss.
+//
+// Mock mode (-m) serves DNSPod style "ip;ip,ttl" bodies over HTTP/1.1
+// after a configurable delay, so the proxy can be measured on its own:
+//
+//   dns-bench -m 8081 -D 5 &
+//   http-dns -p 5353 -r http://127.0.0.1:8081/d &
+//   dns-bench -p 5353 -r 5000 -d 10
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strcasestr
+#endif
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Queries in flight are tracked by transaction id.
+#define BENCH_SLOTS 65536
+
+// Seconds between send ticks in open loop mode.
+#define BENCH_TICK 0.001
+
+#define MOCK_MAX_REQUEST 8192
+
+typedef struct {
+  const char *name;
+  uint16_t type;
+} bench_query_t;
+
+typedef struct {
+  double sent_at; // 0 once answered or given up on.
+  uint64_t seq;
+} bench_slot_t;
+
+typedef struct {
+  struct ev_loop *loop;
+  int sock;
+  struct sockaddr_in server;
+
+  double rate;      // Queries per second, 0 for closed loop only.
+  int concurrency;  // Most queries outstanding, 0 for open loop only.
+  double duration;
+  double timeout;
+
+  bench_query_t *queries;
+  int num_queries;
+  double *zipf_cdf; // NULL to replay 'queries' in order.
+  uint64_t rng;
+
+  double start;
+  uint64_t sent;
+  uint64_t received;
+  uint64_t lost;
+  uint64_t late;    // Answers arriving after their timeout.
+  uint64_t oldest;  // Lowest sequence number that may be outstanding.
+  uint64_t rcodes[16];
+  bench_slot_t slots[BENCH_SLOTS];
+
+  double *latencies; // Milliseconds, one per answer.
+  size_t num_latencies;
+  size_t latencies_size;
+
+  uint64_t last_sent;
+  uint64_t last_received;
+
+  ev_io watcher;
+  ev_timer tick;
+  ev_timer report;
+  ev_timer stop;
+  int stopping;
+} bench_t;
+
+static uint64_t rng_next(uint64_t *s) {
+  // xorshift64*
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 2685821657736338717ULL;
+}
+
+static double rng_uniform(uint64_t *s) {
+  return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void *xmalloc(size_t n) {
+  void *p = malloc(n);
+  if (!p) {
+    fprintf(stderr, "Out of mem\n");
+    exit(1);
+  }
+  return p;
+}
+
+// Synthesizes 'n' names ranked by popularity, asked for with exponent 's'.
+static void zipf_init(bench_t *b, int n, double s) {
+  b->queries = (bench_query_t *)xmalloc(n * sizeof(bench_query_t));
+  b->zipf_cdf = (double *)xmalloc(n * sizeof(double));
+  double total = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "host%d.bench.test", i);
+    b->queries[i].name = strdup(name);
+    b->queries[i].type = 1;
+    total += 1.0 / pow(i + 1, s);
+    b->zipf_cdf[i] = total;
+  }
+  for (i = 0; i < n; i++) {
+    b->zipf_cdf[i] /= total;
+  }
+  b->num_queries = n;
+}
+
+// Reads one query per line: a name, optionally followed by a type given as
+// a number or A, AAAA, CNAME, MX, NS, TXT. Blank lines and '#' comments are
+// skipped.
+static void file_init(bench_t *b, const char *path) {
+  FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  if (!f) {
+    fprintf(stderr, "Cannot open '%s': %s\n", path, strerror(errno));
+    exit(1);
+  }
+  size_t size = 1024;
+  b->queries = (bench_query_t *)xmalloc(size * sizeof(bench_query_t));
+  b->num_queries = 0;
+  char line[512];
+  while (fgets(line, sizeof(line), f)) {
+    char name[256], type[16] = "A";
+    if (sscanf(line, "%255s %15s", name, type) < 1 || name[0] == '#') {
+      continue;
+    }
+    uint16_t t = atoi(type);
+    if (!t) {
+      static const struct { const char *s; uint16_t t; } types[] = {
+        { "A", 1 }, { "NS", 2 }, { "CNAME", 5 }, { "MX", 15 },
+        { "TXT", 16 }, { "AAAA", 28 },
+      };
+      size_t i;
+      for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (!strcasecmp(type, types[i].s)) {
+          t = types[i].t;
+        }
+      }
+      if (!t) {
+        fprintf(stderr, "Unknown query type '%s'.\n", type);
+        exit(1);
+      }
+    }
+    if ((size_t)b->num_queries == size) {
+      size *= 2;
+      b->queries =
+          (bench_query_t *)realloc(b->queries, size * sizeof(bench_query_t));
+      if (!b->queries) {
+        fprintf(stderr, "Out of mem\n");
+        exit(1);
+      }
+    }
+    b->queries[b->num_queries].name = strdup(name);
+    b->queries[b->num_queries].type = t;
+    b->num_queries++;
+  }
+  if (f != stdin) {
+    fclose(f);
+  }
+  if (!b->num_queries) {
+    fprintf(stderr, "No queries in '%s'.\n", path);
+    exit(1);
+  }
+}
+
+static const bench_query_t *next_query(bench_t *b) {
+  if (!b->zipf_cdf) {
+    return &b->queries[b->sent % b->num_queries];
+  }
+  double u = rng_uniform(&b->rng);
+  int lo = 0, hi = b->num_queries - 1;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (b->zipf_cdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return &b->queries[lo];
+}
+
+static int build_query(uint16_t id, const bench_query_t *q, uint8_t *out,
+                       int olen) {
+  uint8_t *p = out;
+  *p++ = id >> 8;
+  *p++ = id;
+  *p++ = 0x01; // RD
+  *p++ = 0;
+  *p++ = 0;
+  *p++ = 1; // QDCOUNT
+  memset(p, 0, 6);
+  p += 6;
+  const char *n = q->name;
+  while (*n) {
+    const char *dot = strchr(n, '.');
+    int len = dot ? dot - n : (int)strlen(n);
+    if (len == 0 || len > 63 || p + len + 6 > out + olen) {
+      return -1;
+    }
+    *p++ = len;
+    memcpy(p, n, len);
+    p += len;
+    n += len;
+    if (*n == '.') {
+      n++;
+    }
+  }
+  *p++ = 0;
+  *p++ = q->type >> 8;
+  *p++ = q->type;
+  *p++ = 0;
+  *p++ = 1; // IN
+  return p - out;
+}
+
+static void bench_record(bench_t *b, double ms) {
+  if (b->num_latencies == b->latencies_size) {
+    b->latencies_size = b->latencies_size ? b->latencies_size * 2 : 65536;
+    b->latencies =
+        (double *)realloc(b->latencies, b->latencies_size * sizeof(double));
+    if (!b->latencies) {
+      fprintf(stderr, "Out of mem\n");
+      exit(1);
+    }
+  }
+  b->latencies[b->num_latencies++] = ms;
+}
+
+// Gives up on queries past their timeout, and on the oldest one if its
+// slot is needed again.
+static void bench_expire(bench_t *b, double now, int need_slot) {
+  while (b->oldest < b->sent) {
+    bench_slot_t *s = &b->slots[b->oldest % BENCH_SLOTS];
+    if (s->seq == b->oldest && s->sent_at > 0) {
+      if (now - s->sent_at < b->timeout &&
+          !(need_slot && b->sent - b->oldest >= BENCH_SLOTS)) {
+        break;
+      }
+      s->sent_at = 0;
+      b->lost++;
+    }
+    b->oldest++;
+  }
+}
+
+static int bench_outstanding(bench_t *b) {
+  return b->sent - b->received - b->lost;
+}
+
+static void bench_send(bench_t *b) {
+  uint8_t pkt[512];
+  double now = ev_time();
+  bench_expire(b, now, 1);
+  const bench_query_t *q = next_query(b);
+  uint64_t seq = b->sent++;
+  int len = build_query(seq % BENCH_SLOTS, q, pkt, sizeof(pkt));
+  bench_slot_t *s = &b->slots[seq % BENCH_SLOTS];
+  s->seq = seq;
+  s->sent_at = now;
+  if (len < 0 || sendto(b->sock, pkt, len, 0, (struct sockaddr *)&b->server,
+                        sizeof(b->server)) < 0) {
+    // Counted as lost once it times out, like a drop on the wire.
+    if (len < 0) {
+      fprintf(stderr, "Cannot encode '%s'.\n", q->name);
+    }
+  }
+}
+
+// Sends what the rate and concurrency limits allow right now.
+static void bench_fill(bench_t *b) {
+  if (b->stopping) {
+    return;
+  }
+  uint64_t target = UINT64_MAX;
+  if (b->rate > 0) {
+    target = (uint64_t)((ev_time() - b->start) * b->rate) + 1;
+  }
+  while (b->sent < target &&
+         (!b->concurrency || bench_outstanding(b) < b->concurrency)) {
+    bench_send(b);
+  }
+}
+
+static void bench_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  bench_t *b = (bench_t *)w->data;
+  uint8_t buf[4096];
+  for (;;) {
+    ssize_t len = recv(b->sock, buf, sizeof(buf), 0);
+    if (len < 0) {
+      break;
+    }
+    if (len < 12) {
+      continue;
+    }
+    double now = ev_time();
+    uint16_t id = buf[0] << 8 | buf[1];
+    bench_slot_t *s = &b->slots[id];
+    if (s->sent_at == 0) {
+      b->late++;
+      continue;
+    }
+    b->received++;
+    b->rcodes[buf[3] & 0xf]++;
+    bench_record(b, (now - s->sent_at) * 1000);
+    s->sent_at = 0;
+  }
+  if (b->stopping && bench_outstanding(b) == 0) {
+    ev_break(loop, EVBREAK_ALL);
+  } else if (b->concurrency) {
+    bench_fill(b);
+  }
+}
+
+static void bench_tick_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  bench_t *b = (bench_t *)w->data;
+  bench_expire(b, ev_time(), 0);
+  bench_fill(b);
+}
+
+static void bench_report_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  bench_t *b = (bench_t *)w->data;
+  fprintf(stderr, "%6.1fs sent %8llu/s answered %8llu/s outstanding %d\n",
+          ev_time() - b->start,
+          (unsigned long long)((b->sent - b->last_sent) / w->repeat),
+          (unsigned long long)((b->received - b->last_received) / w->repeat),
+          bench_outstanding(b));
+  b->last_sent = b->sent;
+  b->last_received = b->received;
+}
+
+// Stops sending, then waits out the timeout for the last answers.
+static void bench_stop_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  bench_t *b = (bench_t *)w->data;
+  if (!b->stopping) {
+    b->stopping = 1;
+    ev_timer_stop(loop, &b->tick);
+    ev_timer_stop(loop, &b->report);
+    if (bench_outstanding(b) > 0) {
+      ev_timer_set(w, b->timeout, 0);
+      ev_timer_start(loop, w);
+      return;
+    }
+  }
+  ev_break(loop, EVBREAK_ALL);
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(const double *v, size_t n, double p) {
+  if (!n) {
+    return 0;
+  }
+  size_t i = (size_t)ceil(p * n);
+  return v[i ? i - 1 : 0];
+}
+
+// Rates are over the time spent sending, 'elapsed'.
+static void bench_print(bench_t *b, double elapsed) {
+  bench_expire(b, ev_time() + b->timeout, 0);
+  qsort(b->latencies, b->num_latencies, sizeof(double), cmp_double);
+  const double *v = b->latencies;
+  size_t n = b->num_latencies;
+  printf("duration   %.2fs\n", elapsed);
+  printf("sent       %llu (%.1f qps)\n", (unsigned long long)b->sent,
+         b->sent / elapsed);
+  printf("answered   %llu (%.1f qps)\n", (unsigned long long)b->received,
+         b->received / elapsed);
+  printf("lost       %llu (%.3f%%), %llu answered late\n",
+         (unsigned long long)b->lost,
+         b->sent ? 100.0 * b->lost / b->sent : 0.0,
+         (unsigned long long)b->late);
+  printf("latency ms min %.3f p50 %.3f p99 %.3f p999 %.3f max %.3f\n",
+         n ? v[0] : 0, percentile(v, n, 0.5), percentile(v, n, 0.99),
+         percentile(v, n, 0.999), n ? v[n - 1] : 0);
+  static const char *rcodes[] = { "NOERROR", "FORMERR", "SERVFAIL",
+                                  "NXDOMAIN", "NOTIMP", "REFUSED" };
+  printf("rcodes    ");
+  int i;
+  for (i = 0; i < 16; i++) {
+    if (b->rcodes[i]) {
+      if (i < 6) {
+        printf(" %s %llu", rcodes[i], (unsigned long long)b->rcodes[i]);
+      } else {
+        printf(" %d %llu", i, (unsigned long long)b->rcodes[i]);
+      }
+    }
+  }
+  printf("\n");
+}
+
+static void bench_run(bench_t *b, const char *addr, int port) {
+  b->sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (b->sock < 0) {
+    fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+    exit(1);
+  }
+  int size = 4 * 1024 * 1024;
+  setsockopt(b->sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(b->sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  fcntl(b->sock, F_SETFL, fcntl(b->sock, F_GETFL) | O_NONBLOCK);
+  memset(&b->server, 0, sizeof(b->server));
+  b->server.sin_family = AF_INET;
+  b->server.sin_port = htons(port);
+  if (inet_pton(AF_INET, addr, &b->server.sin_addr) != 1) {
+    fprintf(stderr, "Bad server address '%s'.\n", addr);
+    exit(1);
+  }
+
+  b->loop = EV_DEFAULT;
+  ev_io_init(&b->watcher, bench_read_cb, b->sock, EV_READ);
+  b->watcher.data = b;
+  ev_io_start(b->loop, &b->watcher);
+  ev_timer_init(&b->tick, bench_tick_cb, BENCH_TICK, BENCH_TICK);
+  b->tick.data = b;
+  ev_timer_start(b->loop, &b->tick);
+  ev_timer_init(&b->report, bench_report_cb, 1, 1);
+  b->report.data = b;
+  ev_timer_start(b->loop, &b->report);
+  ev_timer_init(&b->stop, bench_stop_cb, b->duration, 0);
+  b->stop.data = b;
+  ev_timer_start(b->loop, &b->stop);
+
+  b->start = ev_time();
+  bench_fill(b);
+  ev_run(b->loop, 0);
+  bench_print(b, b->duration);
+}
+
+// An HTTP/1.1 client of the mock upstream. Requests are answered in order,
+// each after the configured delay.
+typedef struct {
+  int fd;
+  ev_io read_watcher;
+  ev_io write_watcher;
+  ev_timer delay_timer;
+  char req[MOCK_MAX_REQUEST];
+  int rlen;
+  int waiting; // A request is parsed and its delay running.
+  char *out;
+  size_t olen;
+  size_t osize;
+} mock_conn_t;
+
+typedef struct {
+  struct ev_loop *loop;
+  double delay;
+  int ttl;
+  uint64_t requests;
+} mock_t;
+
+static mock_t mock;
+
+static void mock_close(mock_conn_t *c) {
+  ev_io_stop(mock.loop, &c->read_watcher);
+  ev_io_stop(mock.loop, &c->write_watcher);
+  ev_timer_stop(mock.loop, &c->delay_timer);
+  close(c->fd);
+  free(c->out);
+  free(c);
+}
+
+static void mock_flush(mock_conn_t *c) {
+  while (c->olen > 0) {
+    ssize_t r = write(c->fd, c->out, c->olen);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ev_io_start(mock.loop, &c->write_watcher);
+      return;
+    }
+    if (r <= 0) {
+      mock_close(c);
+      return;
+    }
+    memmove(c->out, c->out + r, c->olen - r);
+    c->olen -= r;
+  }
+  ev_io_stop(mock.loop, &c->write_watcher);
+}
+
+static void mock_append(mock_conn_t *c, const char *buf, size_t len) {
+  if (c->olen + len > c->osize) {
+    c->osize = (c->olen + len) * 2;
+    c->out = (char *)realloc(c->out, c->osize);
+    if (!c->out) {
+      fprintf(stderr, "Out of mem\n");
+      exit(1);
+    }
+  }
+  memcpy(c->out + c->olen, buf, len);
+  c->olen += len;
+}
+
+// Length of the first complete request in the buffer, 0 if there is none
+// yet and -1 if it cannot be parsed.
+static int mock_request_length(mock_conn_t *c) {
+  c->req[c->rlen] = '\0';
+  char *end = strstr(c->req, "\r\n\r\n");
+  if (!end) {
+    return c->rlen >= MOCK_MAX_REQUEST - 1 ? -1 : 0;
+  }
+  int len = end + 4 - c->req;
+  const char *cl = strcasestr(c->req, "\r\nContent-Length:");
+  if (cl && cl < end) {
+    len += atoi(cl + 17);
+  }
+  if (len >= MOCK_MAX_REQUEST) {
+    return -1;
+  }
+  return len <= c->rlen ? len : 0;
+}
+
+static void mock_answer(mock_conn_t *c, int len) {
+  char body[64];
+  int blen = snprintf(body, sizeof(body), "1.2.3.4;5.6.7.8,%d", mock.ttl);
+  int head = !strncmp(c->req, "HEAD ", 5);
+  char resp[256];
+  int rlen;
+  if (strncmp(c->req, "GET ", 4) && !head) {
+    rlen = snprintf(resp, sizeof(resp), "HTTP/1.1 405 Method Not Allowed\r\n"
+                    "Content-Length: 0\r\n\r\n");
+  } else {
+    rlen = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/html\r\n"
+                    "Content-Length: %d\r\n\r\n%s", blen, head ? "" : body);
+  }
+  mock.requests++;
+  mock_append(c, resp, rlen);
+  memmove(c->req, c->req + len, c->rlen - len);
+  c->rlen -= len;
+}
+
+static void mock_process(mock_conn_t *c);
+
+static void mock_delay_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  mock_conn_t *c = (mock_conn_t *)w->data;
+  c->waiting = 0;
+  mock_answer(c, mock_request_length(c));
+  mock_process(c);
+}
+
+// Answers buffered requests, or starts the delay of the next one. Closes
+// the connection on a bad request.
+static void mock_process(mock_conn_t *c) {
+  int len;
+  while (!c->waiting && (len = mock_request_length(c)) != 0) {
+    if (len < 0) {
+      mock_close(c);
+      return;
+    }
+    if (mock.delay > 0) {
+      c->waiting = 1;
+      ev_timer_set(&c->delay_timer, mock.delay, 0);
+      ev_timer_start(mock.loop, &c->delay_timer);
+      break;
+    }
+    mock_answer(c, len);
+  }
+  mock_flush(c);
+}
+
+static void mock_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  mock_conn_t *c = (mock_conn_t *)w->data;
+  ssize_t r = read(c->fd, c->req + c->rlen, MOCK_MAX_REQUEST - 1 - c->rlen);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (r <= 0) {
+    mock_close(c);
+    return;
+  }
+  c->rlen += r;
+  mock_process(c);
+}
+
+static void mock_write_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  mock_flush((mock_conn_t *)w->data);
+}
+
+static void mock_accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  for (;;) {
+    int fd = accept(w->fd, NULL, NULL);
+    if (fd < 0) {
+      return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    mock_conn_t *c = (mock_conn_t *)calloc(1, sizeof(mock_conn_t));
+    if (!c) {
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    ev_io_init(&c->read_watcher, mock_read_cb, fd, EV_READ);
+    c->read_watcher.data = c;
+    ev_io_start(loop, &c->read_watcher);
+    ev_io_init(&c->write_watcher, mock_write_cb, fd, EV_WRITE);
+    c->write_watcher.data = c;
+    ev_init(&c->delay_timer, mock_delay_cb);
+    c->delay_timer.data = c;
+  }
+}
+
+static void mock_sigint_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+  ev_break(loop, EVBREAK_ALL);
+}
+
+static void mock_run(int port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+    exit(1);
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in laddr;
+  memset(&laddr, 0, sizeof(laddr));
+  laddr.sin_family = AF_INET;
+  laddr.sin_port = htons(port);
+  laddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(sock, (struct sockaddr *)&laddr, sizeof(laddr)) < 0 ||
+      listen(sock, SOMAXCONN) < 0) {
+    fprintf(stderr, "Error listening on port %d: %s\n", port,
+            strerror(errno));
+    exit(1);
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  fprintf(stderr, "Mock upstream on http://127.0.0.1:%d/d, %.1fms delay\n",
+          port, mock.delay * 1000);
+
+  mock.loop = EV_DEFAULT;
+  ev_io accept_watcher;
+  ev_io_init(&accept_watcher, mock_accept_cb, sock, EV_READ);
+  ev_io_start(mock.loop, &accept_watcher);
+  ev_signal sigint;
+  ev_signal_init(&sigint, mock_sigint_cb, SIGINT);
+  ev_signal_start(mock.loop, &sigint);
+  ev_run(mock.loop, 0);
+  fprintf(stderr, "Served %llu requests.\n",
+          (unsigned long long)mock.requests);
+  close(sock);
+}
+
+static void usage(const char *argv0) {
+  printf("Usage: %s [-s <server>] [-p <port>] [-r <rate>] [-c <concurrency>]\n"
+         "        [-d <seconds>] [-t <timeout>] [-n <names>] [-z <exponent>]\n"
+         "        [-f <file>] [-S <seed>]\n"
+         "       %s -m <port> [-D <delay_ms>] [-L <ttl>]\n", argv0, argv0);
+  printf("  -s server         Address of the DNS server. (127.0.0.1)\n");
+  printf("  -p port           Port of the DNS server. (5353)\n");
+  printf("  -r rate           Queries per second, sent whether or not earlier\n"
+         "                    ones were answered. (1000)\n");
+  printf("  -c concurrency    Most queries outstanding. With -r 0 each answer\n"
+         "                    sends the next query. (0, unlimited)\n");
+  printf("  -d seconds        How long to send queries. (10)\n");
+  printf("  -t timeout        Seconds before a query counts as lost. (2)\n");
+  printf("  -n names          Distinct names asked for. (10000)\n");
+  printf("  -z exponent       Zipf exponent of name popularity. (1.0)\n");
+  printf("  -f file           Replay names, one per line with an optional\n"
+         "                    type, instead. '-' reads stdin.\n");
+  printf("  -S seed           Seed of the name distribution. (1)\n");
+  printf("  -m port           Serve as a mock HTTPDNS upstream on this port.\n");
+  printf("  -D delay_ms       Delay of every mock answer. (0)\n");
+  printf("  -L ttl            TTL of mock answers. (300)\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *server = "127.0.0.1";
+  const char *file = NULL;
+  int port = 5353;
+  int names = 10000;
+  double exponent = 1.0;
+  int mock_port = 0;
+  static bench_t b;
+  b.rate = 1000;
+  b.duration = 10;
+  b.timeout = 2;
+  b.rng = 1;
+  mock.ttl = 300;
+
+  int c;
+  while ((c = getopt(argc, argv, "s:p:r:c:d:t:n:z:f:S:m:D:L:h")) != -1) {
+    switch (c) {
+    case 's':
+      server = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'r':
+      b.rate = atof(optarg);
+      break;
+    case 'c':
+      b.concurrency = atoi(optarg);
+      break;
+    case 'd':
+      b.duration = atof(optarg);
+      break;
+    case 't':
+      b.timeout = atof(optarg);
+      break;
+    case 'n':
+      names = atoi(optarg);
+      break;
+    case 'z':
+      exponent = atof(optarg);
+      break;
+    case 'f':
+      file = optarg;
+      break;
+    case 'S':
+      b.rng = strtoull(optarg, NULL, 10) | 1;
+      break;
+    case 'm':
+      mock_port = atoi(optarg);
+      break;
+    case 'D':
+      mock.delay = atof(optarg) / 1000;
+      break;
+    case 'L':
+      mock.ttl = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (mock_port) {
+    mock_run(mock_port);
+    return 0;
+  }
+  if (b.rate <= 0 && b.concurrency <= 0) {
+    fprintf(stderr, "Need a rate (-r) or a concurrency (-c).\n");
+    return 1;
+  }
+  if (names < 1 || b.duration <= 0 || b.timeout <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (file) {
+    file_init(&b, file);
+  } else {
+    zipf_init(&b, names, exponent);
+  }
+  bench_run(&b, server, port);
+  return 0;
+}
@@ -0,0 +1,391 @@
+// Microbenchmarks of the wire encoders, on payloads shaped like real
+// answers. Every packet is first decoded with libresolv and checked
+// against its input, so a faster encoder cannot silently go wrong.
+//
+//   encode-bench [-t seconds_per_case] [filter]
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <resolv.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dns_packet.h"
+#include "json_to_dns.h"
+#include "logging.h"
+#include "text_to_dns.h"
+
+static double case_seconds = 0.2;
+static const char *filter = NULL;
+static int failures = 0;
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *name, const char *what) {
+  printf("FAIL  %s: %s\n", name, what);
+  failures++;
+}
+
+// Runs 'fn' until 'case_seconds' have passed and prints the time per call.
+#define BENCH(label, bytes, body)                                           \
+  do {                                                                      \
+    if (filter && !strstr(label, filter)) {                                 \
+      break;                                                                \
+    }                                                                       \
+    long iters = 0, batch = 16;                                             \
+    double start = now(), elapsed;                                          \
+    do {                                                                    \
+      long k;                                                               \
+      for (k = 0; k < batch; k++) {                                         \
+        body;                                                               \
+      }                                                                     \
+      iters += batch;                                                       \
+      batch *= 2;                                                           \
+    } while ((elapsed = now() - start) < case_seconds);                     \
+    printf("%-36s %10.1f ns/op %6d bytes\n", label, elapsed * 1e9 / iters,  \
+           (int)(bytes));                                                   \
+  } while (0)
+
+// A dotted name with any trailing dot removed.
+static void strip_dot(char *dst, const char *src) {
+  size_t n = strlen(src);
+  if (n && src[n - 1] == '.') {
+    n--;
+  }
+  memcpy(dst, src, n);
+  dst[n] = '\0';
+}
+
+// Checks that 'pkt' decodes and that the 'n' records of its answer section
+// carry 'names' and, for name typed RDATA, 'targets'.
+static void check_packet(const char *label, const uint8_t *pkt, int len,
+                         int n, const char **names, const char **targets) {
+  ns_msg msg;
+  if (len <= 0 || ns_initparse(pkt, len, &msg) < 0) {
+    fail(label, "does not parse");
+    return;
+  }
+  if (ns_msg_count(msg, ns_s_an) != n) {
+    fail(label, "wrong answer count");
+    return;
+  }
+  int i;
+  for (i = 0; i < n; i++) {
+    ns_rr rr;
+    char want[NS_MAXDNAME], got[NS_MAXDNAME];
+    if (ns_parserr(&msg, ns_s_an, i, &rr) < 0) {
+      fail(label, "record does not parse");
+      return;
+    }
+    strip_dot(want, names[i]);
+    if (strcmp(ns_rr_name(rr), want)) {
+      fail(label, "wrong owner name");
+      return;
+    }
+    if (!targets || !targets[i]) {
+      continue;
+    }
+    const uint8_t *rdata = ns_rr_rdata(rr);
+    if (ns_rr_type(rr) == ns_t_mx) {
+      rdata += 2;
+    }
+    if (ns_name_uncompress(pkt, pkt + len, rdata, got, sizeof(got)) < 0) {
+      fail(label, "RDATA name does not decompress");
+      return;
+    }
+    strip_dot(want, targets[i]);
+    if (strcmp(got, want)) {
+      fail(label, "wrong RDATA name");
+      return;
+    }
+  }
+}
+
+// Compresses 'n' names one after the other, as the records of an answer.
+static int compress_names(const char **names, int n, uint8_t *out, int olen) {
+  dn_compress_t comp;
+  memset(out, 0, DNS_HEADER_LENGTH);
+  dn_compress_init(&comp, out);
+  uint8_t *pos = out + DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < n; i++) {
+    int r = dn_name_compress(names[i], pos, out + olen - pos, &comp);
+    if (r < 0) {
+      return -1;
+    }
+    pos += r;
+  }
+  return pos - out;
+}
+
+// The same names through libresolv's dn_comp, as a reference for size.
+static int compress_names_resolv(const char **names, int n, uint8_t *out,
+                                 int olen) {
+  const uint8_t *dnptrs[256] = { out, NULL };
+  uint8_t *pos = out + DNS_HEADER_LENGTH;
+  int i;
+  memset(out, 0, DNS_HEADER_LENGTH);
+  for (i = 0; i < n; i++) {
+    int r = dn_comp(names[i], pos, out + olen - pos, (u_char **)dnptrs,
+                    (u_char **)&dnptrs[256]);
+    if (r < 0) {
+      return -1;
+    }
+    pos += r;
+  }
+  return pos - out;
+}
+
+static void bench_compress(const char *label, const char **names, int n) {
+  uint8_t out[DNS_MAX_MSG], ref[DNS_MAX_MSG];
+  int len = compress_names(names, n, out, sizeof(out));
+  int ref_len = compress_names_resolv(names, n, ref, sizeof(ref));
+  if (len < 0) {
+    fail(label, "does not compress");
+    return;
+  }
+  if (len > ref_len) {
+    fail(label, "compresses worse than dn_comp");
+  }
+  const uint8_t *p = out + DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < n; i++) {
+    char got[NS_MAXDNAME], want[NS_MAXDNAME];
+    int r = dn_expand(out, out + len, p, got, sizeof(got));
+    strip_dot(want, names[i]);
+    if (r < 0 || strcmp(got, want)) {
+      fail(label, "does not round trip");
+      return;
+    }
+    p += r;
+  }
+  BENCH(label, len, compress_names(names, n, out, sizeof(out)));
+}
+
+// Records of a JSON answer, with the name their RDATA holds if any.
+typedef struct {
+  const char *name;
+  int type;
+  const char *data;
+  const char *target;
+} json_rr_t;
+
+static char *json_answer(const char *qname, int qtype, const json_rr_t *rrs,
+                         int n) {
+  size_t size = 4096 + n * 256;
+  char *s = (char *)malloc(size);
+  int len = snprintf(s, size, "{\"Status\": 0, \"TC\": false, \"RD\": true, "
+                     "\"RA\": true, \"AD\": false, \"CD\": false, "
+                     "\"Question\": [{\"name\": \"%s\", \"type\": %d}], "
+                     "\"Answer\": [", qname, qtype);
+  int i;
+  for (i = 0; i < n; i++) {
+    len += snprintf(s + len, size - len, "%s{\"name\": \"%s\", \"type\": %d, "
+                    "\"TTL\": 300, \"data\": \"%s\"}", i ? ", " : "",
+                    rrs[i].name, rrs[i].type, rrs[i].data);
+  }
+  snprintf(s + len, size - len, "]}");
+  return s;
+}
+
+static void bench_json_to_dns(const char *label, const char *qname,
+                              int qtype, const json_rr_t *rrs, int n) {
+  char *json = json_answer(qname, qtype, rrs, n);
+  size_t jlen = strlen(json) + 1;
+  char *copy = (char *)malloc(jlen);
+  const char *names[n], *targets[n];
+  int i;
+  for (i = 0; i < n; i++) {
+    names[i] = rrs[i].name;
+    targets[i] = rrs[i].target;
+  }
+  uint8_t out[DNS_MAX_MSG];
+  memcpy(copy, json, jlen);
+  int len = json_to_dns(0x1234, copy, out, sizeof(out));
+  check_packet(label, out, len, n, names, targets);
+  // The parser works in place, so every run starts from a fresh copy.
+  BENCH(label, len, (memcpy(copy, json, jlen),
+                     json_to_dns(0x1234, copy, out, sizeof(out))));
+  free(copy);
+  free(json);
+}
+
+static void bench_json_to_rdata(const char *label, int type,
+                                const char *data) {
+  uint8_t out[DNS_MAX_MSG];
+  size_t dlen = strlen(data) + 1;
+  char copy[1024];
+  memcpy(copy, data, dlen);
+  dn_compress_t comp;
+  memset(out, 0, DNS_HEADER_LENGTH);
+  dn_compress_init(&comp, out);
+  int len = json_to_rdata(type, copy, out + DNS_HEADER_LENGTH,
+                          out + sizeof(out), &comp);
+  if (len < 0) {
+    fail(label, "does not encode");
+    return;
+  }
+  BENCH(label, len, (memcpy(copy, data, dlen), dn_compress_init(&comp, out),
+                     json_to_rdata(type, copy, out + DNS_HEADER_LENGTH,
+                                   out + sizeof(out), &comp)));
+}
+
+static void bench_text_to_dns(const char *label, int naddrs) {
+  char body[8192];
+  int len = 0, i;
+  for (i = 0; i < naddrs; i++) {
+    len += snprintf(body + len, sizeof(body) - len, "%s10.%d.%d.%d",
+                    i ? ";" : "", i / 65536, i / 256 % 256, i % 256);
+  }
+  len += snprintf(body + len, sizeof(body) - len, ",300");
+  const char *qname = "www.example.com";
+  const char *names[naddrs];
+  for (i = 0; i < naddrs; i++) {
+    names[i] = qname;
+  }
+  uint8_t out[DNS_MAX_MSG];
+  int r = text_to_dns(0x1234, qname, body, len, 0, 0, out, sizeof(out));
+  check_packet(label, out, r, naddrs, names, NULL);
+  BENCH(label, r,
+        text_to_dns(0x1234, qname, body, len, 0, 0, out, sizeof(out)));
+}
+
+// The body fed in pieces of 'piece' bytes, as curl may hand it over.
+static int text_parse_pieces(const char *qname, const char *body, int len,
+                             int piece, uint8_t *out, int olen) {
+  text_parser_t p;
+  if (text_parser_init(&p, 0x1234, qname, out, olen)) {
+    return -1;
+  }
+  int off;
+  for (off = 0; off < len; off += piece) {
+    text_parser_feed(&p, body + off, len - off < piece ? len - off : piece);
+  }
+  return text_parser_finish(&p, 0, 0);
+}
+
+static void bench_text_parser(const char *label, int naddrs, int piece) {
+  char body[8192];
+  int len = 0, i;
+  for (i = 0; i < naddrs; i++) {
+    len += snprintf(body + len, sizeof(body) - len, "%s10.%d.%d.%d",
+                    i ? ";" : "", i / 65536, i / 256 % 256, i % 256);
+  }
+  len += snprintf(body + len, sizeof(body) - len, ",300");
+  const char *qname = "www.example.com";
+  const char *names[naddrs];
+  for (i = 0; i < naddrs; i++) {
+    names[i] = qname;
+  }
+  uint8_t out[DNS_MAX_MSG];
+  int r = text_parse_pieces(qname, body, len, piece, out, sizeof(out));
+  check_packet(label, out, r, naddrs, names, NULL);
+  BENCH(label, r, text_parse_pieces(qname, body, len, piece, out,
+                                    sizeof(out)));
+}
+
+int main(int argc, char *argv[]) {
+  int c;
+  while ((c = getopt(argc, argv, "t:h")) != -1) {
+    switch (c) {
+    case 't':
+      case_seconds = atof(optarg);
+      break;
+    default:
+      printf("Usage: %s [-t seconds_per_case] [filter]\n", argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind < argc) {
+    filter = argv[optind];
+  }
+  logging_init(STDERR_FILENO, LOG_FATAL);
+
+  // Names of a CDN answer: a CNAME chain through several zones.
+  static const char *chain[] = {
+    "www.example.com", "www.example.com.cdn.provider.net",
+    "edge.cdn.provider.net", "edge.region1.cdn.provider.net",
+    "a1.region1.cdn.provider.net", "a1.region1.cdn.provider.net",
+    "a1.region1.cdn.provider.net", "a1.region1.cdn.provider.net",
+  };
+  bench_compress("dn_name_compress/1", chain, 1);
+  bench_compress("dn_name_compress/cname_chain", chain, 8);
+  // A delegation: many NS names under a few suffixes, each repeated as the
+  // owner of its glue.
+  const char *delegation[64];
+  char nsnames[32][64];
+  int i;
+  for (i = 0; i < 32; i++) {
+    snprintf(nsnames[i], sizeof(nsnames[i]), "ns%d.%s", i,
+             i % 2 ? "dns.example.net" : "nameserver.example.org");
+    delegation[i] = nsnames[i];
+    delegation[32 + i] = nsnames[i];
+  }
+  bench_compress("dn_name_compress/delegation", delegation, 64);
+
+  bench_json_to_rdata("json_to_rdata/A", ns_t_a, "93.184.216.34");
+  bench_json_to_rdata("json_to_rdata/AAAA", ns_t_aaaa,
+                      "2606:2800:220:1:248:1893:25c8:1946");
+  bench_json_to_rdata("json_to_rdata/CNAME", ns_t_cname,
+                      "www.example.com.cdn.provider.net.");
+  bench_json_to_rdata("json_to_rdata/NS", ns_t_ns, "ns1.example.net.");
+  bench_json_to_rdata("json_to_rdata/MX", ns_t_mx, "10 mail.example.com.");
+  bench_json_to_rdata("json_to_rdata/TXT", ns_t_txt,
+                      "v=spf1 include:_spf.example.com ~all");
+  bench_json_to_rdata("json_to_rdata/SOA", ns_t_soa,
+                      "ns1.example.com. hostmaster.example.com. 2024010101 "
+                      "7200 3600 1209600 300");
+  bench_json_to_rdata("json_to_rdata/SRV", ns_t_srv,
+                      "10 60 5060 sip.example.com.");
+
+  static const json_rr_t single[] = {
+    { "www.example.com.", ns_t_a, "93.184.216.34", NULL },
+  };
+  bench_json_to_dns("json_to_dns/A", "www.example.com.", ns_t_a, single, 1);
+  static const json_rr_t cdn[] = {
+    { "www.example.com.", ns_t_cname, "www.example.com.cdn.provider.net.",
+      "www.example.com.cdn.provider.net." },
+    { "www.example.com.cdn.provider.net.", ns_t_cname,
+      "edge.cdn.provider.net.", "edge.cdn.provider.net." },
+    { "edge.cdn.provider.net.", ns_t_cname, "a1.region1.cdn.provider.net.",
+      "a1.region1.cdn.provider.net." },
+    { "a1.region1.cdn.provider.net.", ns_t_a, "10.0.0.1", NULL },
+    { "a1.region1.cdn.provider.net.", ns_t_a, "10.0.0.2", NULL },
+    { "a1.region1.cdn.provider.net.", ns_t_a, "10.0.0.3", NULL },
+    { "a1.region1.cdn.provider.net.", ns_t_a, "10.0.0.4", NULL },
+  };
+  bench_json_to_dns("json_to_dns/cname_chain", "www.example.com.", ns_t_a,
+                    cdn, 7);
+  json_rr_t ns[32];
+  char targets[32][sizeof(nsnames[0]) + 1];
+  for (i = 0; i < 32; i++) {
+    strcpy(targets[i], nsnames[i]);
+    strcat(targets[i], ".");
+    ns[i].name = "example.org.";
+    ns[i].type = ns_t_ns;
+    ns[i].data = targets[i];
+    ns[i].target = targets[i];
+  }
+  bench_json_to_dns("json_to_dns/ns_set", "example.org.", ns_t_ns, ns, 32);
+
+  bench_text_to_dns("text_to_dns/1", 1);
+  bench_text_to_dns("text_to_dns/8", 8);
+  bench_text_to_dns("text_to_dns/60", 60);
+  bench_text_parser("text_parser/60_in_16_byte_pieces", 60, 16);
+
+  if (failures) {
+    printf("%d checks failed.\n", failures);
+    return 1;
+  }
+  return 0;
+}
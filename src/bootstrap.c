@@ -0,0 +1,373 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <ares.h>
+#include <curl/curl.h>
+#include <ev.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bootstrap.h"
+#include "logging.h"
+#include "options.h"
+
+// Gives up on a server quickly, the next one is likely to answer.
+#define BOOTSTRAP_TIMEOUT_MS 1000
+#define BOOTSTRAP_TRIES 2
+
+static void bootstrap_lookup(bootstrap_t *b, struct bootstrap_host *h);
+
+// Rearms the timer for the next c-ares timeout, if any.
+static void bootstrap_update_timeout(bootstrap_t *b) {
+  struct timeval tv;
+  ev_timer_stop(b->loop, &b->timeout_timer);
+  if (ares_timeout(b->channel, NULL, &tv)) {
+    ev_timer_set(&b->timeout_timer, tv.tv_sec + tv.tv_usec / 1e6, 0);
+    ev_timer_start(b->loop, &b->timeout_timer);
+  }
+}
+
+static void timeout_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  bootstrap_t *b = (bootstrap_t *)w->data;
+  ares_process_fd(b->channel, ARES_SOCKET_BAD, ARES_SOCKET_BAD);
+  bootstrap_update_timeout(b);
+}
+
+static void fd_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  bootstrap_t *b = (bootstrap_t *)w->data;
+  ares_process_fd(b->channel, revents & EV_READ ? w->fd : ARES_SOCKET_BAD,
+                  revents & EV_WRITE ? w->fd : ARES_SOCKET_BAD);
+  bootstrap_update_timeout(b);
+}
+
+// Watches the sockets c-ares opens, as it asks for them.
+static void sock_state_cb(void *data, ares_socket_t fd, int readable,
+                          int writable) {
+  bootstrap_t *b = (bootstrap_t *)data;
+  struct bootstrap_fd *slot = NULL;
+  int i;
+  for (i = 0; i < BOOTSTRAP_MAX_FDS; i++) {
+    if (b->fds[i].fd == fd) {
+      slot = &b->fds[i];
+      break;
+    }
+    if (!slot && b->fds[i].fd < 0) {
+      slot = &b->fds[i];
+    }
+  }
+  if (slot && slot->fd == fd) {
+    ev_io_stop(b->loop, &slot->watcher);
+    slot->fd = -1;
+  }
+  if (!readable && !writable) {
+    return;
+  }
+  if (!slot) {
+    ELOG("Too many bootstrap sockets, lookups will time out.");
+    return;
+  }
+  slot->fd = fd;
+  ev_io_init(&slot->watcher, fd_cb, fd,
+             (readable ? EV_READ : 0) | (writable ? EV_WRITE : 0));
+  slot->watcher.data = b;
+  ev_io_start(b->loop, &slot->watcher);
+}
+
+// Rebuilds the lines for CURLOPT_RESOLVE, e.g. "doh.pub:443:1.2.3.4".
+static void bootstrap_publish(bootstrap_t *b) {
+  struct curl_slist *resolv = NULL;
+  int i;
+  for (i = 0; i < b->num_hosts; i++) {
+    struct bootstrap_host *h = &b->hosts[i];
+    if (!h->addrs[0]) {
+      continue;
+    }
+    char line[sizeof(h->name) + sizeof(h->addrs) + 16];
+    snprintf(line, sizeof(line), "%s:%d:%s", h->name, h->port, h->addrs);
+    struct curl_slist *next = curl_slist_append(resolv, line);
+    if (!next) {
+      ELOG("Out of mem");
+      curl_slist_free_all(resolv);
+      return;
+    }
+    resolv = next;
+  }
+  struct https_resolv *shared = NULL;
+  if (resolv && !(shared = https_resolv_new(resolv))) {
+    ELOG("Out of mem");
+    return;
+  }
+  https_resolv_release(b->resolv);
+  b->resolv = shared;
+  b->cb(b, b->cb_data);
+}
+
+// Arms the refresh timer for the earliest lookup due.
+static void bootstrap_schedule(bootstrap_t *b) {
+  ev_tstamp next = 0;
+  int i;
+  for (i = 0; i < b->num_hosts; i++) {
+    if (!b->hosts[i].pending && (!next || b->hosts[i].expiry < next)) {
+      next = b->hosts[i].expiry;
+    }
+  }
+  if (!b->ready) {
+    ev_tstamp wait = ev_now(b->loop) + BOOTSTRAP_WAIT;
+    if (!next || wait < next) {
+      next = wait;
+    }
+  }
+  ev_timer_stop(b->loop, &b->refresh_timer);
+  if (next) {
+    ev_tstamp after = next - ev_now(b->loop);
+    ev_timer_set(&b->refresh_timer, after > 0 ? after : 0, 0);
+    ev_timer_start(b->loop, &b->refresh_timer);
+  }
+}
+
+static void bootstrap_set_ready(bootstrap_t *b) {
+  if (!b->ready) {
+    b->ready = 1;
+    b->cb(b, b->cb_data);
+  }
+}
+
+static void addrinfo_cb(void *arg, int status, int timeouts,
+                        struct ares_addrinfo *res) {
+  struct bootstrap_host *h = (struct bootstrap_host *)arg;
+  bootstrap_t *b = h->b;
+  if (status == ARES_ECANCELLED || status == ARES_EDESTRUCTION) {
+    ares_freeaddrinfo(res);
+    return;
+  }
+  h->pending = 0;
+  ev_tstamp now = ev_now(b->loop);
+  char addrs[sizeof(h->addrs)];
+  size_t len = 0;
+  int n = 0;
+  int ttl = BOOTSTRAP_MAX_TTL;
+  struct ares_addrinfo_node *node;
+  for (node = res && status == ARES_SUCCESS ? res->nodes : NULL;
+       node && n < BOOTSTRAP_MAX_ADDRS; node = node->ai_next) {
+    char text[INET6_ADDRSTRLEN];
+    const void *addr = node->ai_family == AF_INET6 ?
+        (const void *)&((struct sockaddr_in6 *)node->ai_addr)->sin6_addr :
+        (const void *)&((struct sockaddr_in *)node->ai_addr)->sin_addr;
+    if (!inet_ntop(node->ai_family, addr, text, sizeof(text))) {
+      continue;
+    }
+    // IPv6 addresses go in brackets, the list is separated by commas.
+    len += snprintf(addrs + len, sizeof(addrs) - len,
+                    node->ai_family == AF_INET6 ? "%s[%s]" : "%s%s",
+                    n ? "," : "", text);
+    n++;
+    if (node->ai_ttl < ttl) {
+      ttl = node->ai_ttl;
+    }
+  }
+  ares_freeaddrinfo(res);
+
+  if (b->waiting > 0 && !h->expiry) {
+    b->waiting--;
+  }
+  if (n == 0) {
+    // Addresses from before are better than none, so they stay.
+    WLOG("Failed to look up upstream '%s': %s", h->name,
+         status == ARES_SUCCESS ? "no addresses" : ares_strerror(status));
+    h->expiry = now + BOOTSTRAP_RETRY;
+  } else {
+    if (ttl < BOOTSTRAP_MIN_TTL) {
+      ttl = BOOTSTRAP_MIN_TTL;
+    }
+    DLOG("Upstream '%s' is at %s for %ds.", h->name, addrs, ttl);
+    h->expiry = now + ttl;
+    if (strcmp(addrs, h->addrs)) {
+      memcpy(h->addrs, addrs, len + 1);
+      bootstrap_publish(b);
+    }
+  }
+  if (b->waiting == 0) {
+    bootstrap_set_ready(b);
+  }
+  bootstrap_schedule(b);
+}
+
+static void bootstrap_lookup(bootstrap_t *b, struct bootstrap_host *h) {
+  struct ares_addrinfo_hints hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  // curl races the families itself, no need to probe routes for sorting.
+  hints.ai_flags = ARES_AI_NOSORT;
+  h->pending = 1;
+  ares_getaddrinfo(b->channel, h->name, NULL, &hints, addrinfo_cb, h);
+  bootstrap_update_timeout(b);
+}
+
+static void refresh_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  bootstrap_t *b = (bootstrap_t *)w->data;
+  ev_tstamp now = ev_now(loop);
+  int i;
+  for (i = 0; i < b->num_hosts; i++) {
+    if (!b->hosts[i].pending && b->hosts[i].expiry <= now) {
+      bootstrap_lookup(b, &b->hosts[i]);
+    }
+  }
+  if (!b->ready) {
+    WLOG("Bootstrap servers are slow, leaving unresolved upstreams to curl.");
+    bootstrap_set_ready(b);
+  }
+  bootstrap_schedule(b);
+}
+
+// Gets the host and port of 'url' into 'h'. Returns 0 if it is a name,
+// -1 if it is an address or cannot be parsed.
+static int upstream_host(const char *url, struct bootstrap_host *h) {
+  CURLU *u = curl_url();
+  char *host = NULL;
+  char *port = NULL;
+  int ret = -1;
+  if (u && curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+      curl_url_get(u, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+      curl_url_get(u, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) ==
+          CURLUE_OK) {
+    struct in_addr in;
+    if (host[0] != '[' && inet_pton(AF_INET, host, &in) != 1 &&
+        strlen(host) < sizeof(h->name)) {
+      strcpy(h->name, host);
+      h->port = atoi(port);
+      ret = 0;
+    }
+  }
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(u);
+  return ret;
+}
+
+static void bootstrap_set_hosts(bootstrap_t *b, options_t *opt) {
+  struct bootstrap_host hosts[MAX_UPSTREAMS];
+  int num = 0;
+  int i, j;
+  for (i = 0; i < opt->num_upstreams; i++) {
+    struct bootstrap_host *h = &hosts[num];
+    if (upstream_host(opt->upstreams[i], h)) {
+      continue;
+    }
+    for (j = 0; j < num; j++) {
+      if (hosts[j].port == h->port && !strcasecmp(hosts[j].name, h->name)) {
+        break;
+      }
+    }
+    if (j < num) {
+      continue;
+    }
+    h->b = b;
+    h->addrs[0] = '\0';
+    h->expiry = 0;
+    h->pending = 0;
+    // Hosts kept keep their addresses and lookup in flight.
+    for (j = 0; j < b->num_hosts; j++) {
+      if (b->hosts[j].port == h->port &&
+          !strcasecmp(b->hosts[j].name, h->name)) {
+        memcpy(h->addrs, b->hosts[j].addrs, sizeof(h->addrs));
+        h->expiry = b->hosts[j].expiry;
+        h->pending = b->hosts[j].pending;
+      }
+    }
+    num++;
+  }
+
+  int same = num == b->num_hosts;
+  for (i = 0; same && i < num; i++) {
+    same = hosts[i].port == b->hosts[i].port &&
+           !strcmp(hosts[i].name, b->hosts[i].name);
+  }
+  if (same) {
+    if (num == 0) {
+      bootstrap_set_ready(b); // Every upstream is an address.
+    }
+    return;
+  }
+  // Lookups in flight point at the old slots, so they are started again.
+  ares_cancel(b->channel);
+  memcpy(b->hosts, hosts, sizeof(hosts));
+  b->num_hosts = num;
+  b->waiting = 0;
+  for (i = 0; i < num; i++) {
+    if (!b->hosts[i].addrs[0] ||
+        b->hosts[i].expiry <= ev_now(b->loop) || b->hosts[i].pending) {
+      if (!b->hosts[i].expiry) {
+        b->waiting++;
+      }
+      bootstrap_lookup(b, &b->hosts[i]);
+    }
+  }
+  bootstrap_publish(b);
+  if (b->waiting == 0) {
+    bootstrap_set_ready(b);
+  }
+  bootstrap_schedule(b);
+}
+
+static void bootstrap_set_servers(bootstrap_t *b, options_t *opt) {
+  int r = ares_set_servers_ports_csv(b->channel, opt->bootstrap_dns);
+  if (r != ARES_SUCCESS) {
+    ELOG("Bad bootstrap servers '%s': %s", opt->bootstrap_dns,
+         ares_strerror(r));
+  }
+}
+
+void bootstrap_init(bootstrap_t *b, struct ev_loop *loop, options_t *opt,
+                    bootstrap_cb cb, void *data) {
+  memset(b, 0, sizeof(*b));
+  b->loop = loop;
+  b->cb = cb;
+  b->cb_data = data;
+  int i;
+  for (i = 0; i < BOOTSTRAP_MAX_FDS; i++) {
+    b->fds[i].fd = -1;
+  }
+  ev_timer_init(&b->timeout_timer, timeout_cb, 0, 0);
+  b->timeout_timer.data = b;
+  ev_timer_init(&b->refresh_timer, refresh_cb, 0, 0);
+  b->refresh_timer.data = b;
+
+  struct ares_options options;
+  memset(&options, 0, sizeof(options));
+  options.sock_state_cb = sock_state_cb;
+  options.sock_state_cb_data = b;
+  options.timeout = BOOTSTRAP_TIMEOUT_MS;
+  options.tries = BOOTSTRAP_TRIES;
+  int r = ares_init_options(&b->channel, &options,
+                            ARES_OPT_SOCK_STATE_CB | ARES_OPT_TIMEOUTMS |
+                            ARES_OPT_TRIES);
+  if (r != ARES_SUCCESS) {
+    FLOG("ares_init_options error: %s", ares_strerror(r));
+  }
+  bootstrap_set_servers(b, opt);
+  bootstrap_set_hosts(b, opt);
+}
+
+void bootstrap_reconfigure(bootstrap_t *b, options_t *opt) {
+  bootstrap_set_servers(b, opt);
+  bootstrap_set_hosts(b, opt);
+}
+
+void bootstrap_cleanup(bootstrap_t *b) {
+  ev_timer_stop(b->loop, &b->refresh_timer);
+  ares_destroy(b->channel);
+  ev_timer_stop(b->loop, &b->timeout_timer);
+  int i;
+  for (i = 0; i < BOOTSTRAP_MAX_FDS; i++) {
+    if (b->fds[i].fd >= 0) {
+      ev_io_stop(b->loop, &b->fds[i].watcher);
+    }
+  }
+  https_resolv_release(b->resolv);
+  b->resolv = NULL;
+}
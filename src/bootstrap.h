@@ -0,0 +1,84 @@
+// Resolves the host names of upstreams with c-ares on the event loop,
+// asking the bootstrap servers only, and keeps the addresses current by
+// their TTL. curl is handed them through CURLOPT_RESOLVE, so opening a
+// connection never waits on the system resolver, which may well be us.
+#ifndef _BOOTSTRAP_H_
+#define _BOOTSTRAP_H_
+
+#include <ares.h>
+#include <curl/curl.h>
+#include <ev.h>
+
+#include "https_client.h"
+#include "options.h"
+
+// Bounds on how long addresses are used before they are looked up again.
+#define BOOTSTRAP_MIN_TTL 30
+#define BOOTSTRAP_MAX_TTL 3600
+
+// Seconds before a failed lookup is retried.
+#define BOOTSTRAP_RETRY 10
+
+// Seconds queries wait for the first addresses at startup, after which
+// curl resolves hosts still without any itself.
+#define BOOTSTRAP_WAIT 5
+
+// Addresses kept per host.
+#define BOOTSTRAP_MAX_ADDRS 8
+
+// Sockets the channel may have open at once.
+#define BOOTSTRAP_MAX_FDS 32
+
+struct bootstrap_s;
+
+// Called whenever 'resolv' changes or the bootstrap becomes ready.
+typedef void (*bootstrap_cb)(struct bootstrap_s *b, void *data);
+
+typedef struct bootstrap_s {
+  struct ev_loop *loop;
+  ares_channel channel;
+  bootstrap_cb cb;
+  void *cb_data;
+
+  // Host and port of each upstream named by host.
+  struct bootstrap_host {
+    struct bootstrap_s *b;
+    char name[256];
+    int port;
+    char addrs[BOOTSTRAP_MAX_ADDRS * 48]; // e.g. "1.2.3.4,[::1]", or empty.
+    ev_tstamp expiry; // When to look it up again.
+    int pending;      // A lookup is in flight.
+  } hosts[MAX_UPSTREAMS];
+  int num_hosts;
+  int waiting; // Hosts not looked up once yet.
+  int ready;   // All were, or BOOTSTRAP_WAIT passed.
+
+  // The lines for CURLOPT_RESOLVE, NULL while no host has addresses.
+  // Transfers still holding an older list keep it until they end.
+  struct https_resolv *resolv;
+
+  ev_timer timeout_timer; // c-ares timeouts.
+  ev_timer refresh_timer; // The next lookup due.
+  struct bootstrap_fd {
+    ev_io watcher;
+    int fd; // -1 while unused.
+  } fds[BOOTSTRAP_MAX_FDS];
+} bootstrap_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Starts looking up the upstream hosts of 'opt'.
+void bootstrap_init(bootstrap_t *b, struct ev_loop *loop, options_t *opt,
+                    bootstrap_cb cb, void *data);
+
+// Switches to the bootstrap servers and upstreams of reloaded 'opt',
+// keeping the addresses of hosts that remain.
+void bootstrap_reconfigure(bootstrap_t *b, options_t *opt);
+
+void bootstrap_cleanup(bootstrap_t *b);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _BOOTSTRAP_H_
@@ -0,0 +1,352 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dns_cache.h"
+#include "dns_packet.h"
+#include "logging.h"
+
+// Snapshot layout: a header, then one record per entry, each followed by
+// its name, subnet (both NUL terminated) and packet, padded to 8 bytes so
+// records can be read in place from a mapping. Host byte order, since a
+// snapshot only ever moves between restarts on the same machine.
+#define SNAPSHOT_MAGIC "HDNSCACH"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+};
+
+struct snapshot_record {
+  double expiry; // Wall clock, like ev_now.
+  uint32_t ttl;
+  uint32_t pktlen;
+  uint16_t type;
+  uint16_t namelen; // Both including the NUL.
+  uint16_t subnetlen;
+  uint16_t reserved;
+};
+
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+uint32_t dns_cache_key_hash(const char *name, uint16_t type,
+                            const char *subnet) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h = (h ^ (uint8_t)*name) * 16777619u;
+  }
+  h = (h ^ (type >> 8)) * 16777619u;
+  h = (h ^ (type & 0xff)) * 16777619u;
+  for (; *subnet; subnet++) {
+    h = (h ^ (uint8_t)*subnet) * 16777619u;
+  }
+  return h;
+}
+
+static void lru_unlink(dns_cache_entry_t *e) {
+  e->prev->next = e->next;
+  e->next->prev = e->prev;
+}
+
+static void lru_push_front(dns_cache_t *c, dns_cache_entry_t *e) {
+  e->next = c->lru.next;
+  e->prev = &c->lru;
+  c->lru.next->prev = e;
+  c->lru.next = e;
+}
+
+static void dns_cache_remove(dns_cache_t *c, dns_cache_entry_t *e) {
+  dns_cache_entry_t **pp = &c->buckets[e->hash & (c->nbuckets - 1)];
+  while (*pp != e) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = e->hnext;
+  lru_unlink(e);
+  c->entries--;
+  c->bytes -= e->size;
+  free(e);
+}
+
+static dns_cache_entry_t *dns_cache_find(dns_cache_t *c, uint32_t hash,
+                                         const char *name, uint16_t type,
+                                         const char *subnet) {
+  dns_cache_entry_t *e = c->buckets[hash & (c->nbuckets - 1)];
+  for (; e; e = e->hnext) {
+    if (e->hash == hash && e->type == type && !strcmp(e->name, name) &&
+        !strcmp(e->subnet, subnet)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+void dns_cache_init(dns_cache_t *c, size_t max_entries, size_t max_bytes,
+                    uint32_t max_stale) {
+  memset(c, 0, sizeof(*c));
+  c->lru.next = c->lru.prev = &c->lru;
+  c->max_entries = max_bytes ? max_entries : 0;
+  c->max_bytes = max_bytes;
+  c->max_stale = max_stale;
+  if (c->max_entries == 0) {
+    return;
+  }
+  // Aim for a load factor of at most one.
+  c->nbuckets = 1;
+  while (c->nbuckets < c->max_entries && c->nbuckets < (1u << 30)) {
+    c->nbuckets <<= 1;
+  }
+  c->buckets =
+      (dns_cache_entry_t **)calloc(c->nbuckets, sizeof(dns_cache_entry_t *));
+  if (!c->buckets) {
+    FLOG("Out of mem");
+  }
+}
+
+// Returns the entry if it expires after 'deadline', dropping it once it is
+// past the stale window.
+static dns_cache_entry_t *dns_cache_get(dns_cache_t *c, const char *name,
+                                        uint16_t type, const char *subnet,
+                                        ev_tstamp now, ev_tstamp deadline) {
+  if (c->max_entries == 0) {
+    return NULL;
+  }
+  uint32_t hash = dns_cache_key_hash(name, type, subnet);
+  dns_cache_entry_t *e = dns_cache_find(c, hash, name, type, subnet);
+  if (!e) {
+    return NULL;
+  }
+  if (e->expiry + c->max_stale <= now) {
+    dns_cache_remove(c, e);
+    return NULL;
+  }
+  if (e->expiry <= deadline) {
+    return NULL;
+  }
+  lru_unlink(e);
+  lru_push_front(c, e);
+  return e;
+}
+
+const dns_cache_entry_t *dns_cache_lookup(dns_cache_t *c, const char *name,
+                                          uint16_t type, const char *subnet,
+                                          ev_tstamp now) {
+  return dns_cache_get(c, name, type, subnet, now, now);
+}
+
+const dns_cache_entry_t *dns_cache_lookup_stale(dns_cache_t *c,
+                                                const char *name,
+                                                uint16_t type,
+                                                const char *subnet,
+                                                ev_tstamp now) {
+  return dns_cache_get(c, name, type, subnet, now, now - c->max_stale);
+}
+
+// Stores 'pkt' with lifetime 'ttl', expiring at 'expiry'.
+static void dns_cache_store(dns_cache_t *c, const char *name, uint16_t type,
+                            const char *subnet, const uint8_t *pkt,
+                            uint32_t pktlen, uint32_t ttl, ev_tstamp expiry) {
+  size_t namelen = strlen(name) + 1;
+  size_t subnetlen = strlen(subnet) + 1;
+  size_t size = sizeof(dns_cache_entry_t) + namelen + subnetlen + pktlen;
+  if (size > c->max_bytes) {
+    return;
+  }
+
+  uint32_t hash = dns_cache_key_hash(name, type, subnet);
+  dns_cache_entry_t *e = dns_cache_find(c, hash, name, type, subnet);
+  if (e) {
+    dns_cache_remove(c, e);
+  }
+  while (c->entries > 0 &&
+         (c->entries >= c->max_entries || c->bytes + size > c->max_bytes)) {
+    dns_cache_remove(c, c->lru.prev);
+  }
+
+  if (!(e = (dns_cache_entry_t *)malloc(size))) {
+    ELOG("Out of mem");
+    return;
+  }
+  e->hash = hash;
+  e->type = type;
+  e->ttl = ttl;
+  e->expiry = expiry;
+  e->size = size;
+  e->name = (const char *)e->data;
+  memcpy(e->data, name, namelen);
+  e->subnet = (const char *)e->data + namelen;
+  memcpy(e->data + namelen, subnet, subnetlen);
+  e->pkt = e->data + namelen + subnetlen;
+  memcpy(e->pkt, pkt, pktlen);
+  e->pktlen = pktlen;
+
+  uint32_t b = hash & (c->nbuckets - 1);
+  e->hnext = c->buckets[b];
+  c->buckets[b] = e;
+  lru_push_front(c, e);
+  c->entries++;
+  c->bytes += size;
+}
+
+void dns_cache_insert(dns_cache_t *c, const char *name, uint16_t type,
+                      const char *subnet, const uint8_t *pkt, uint32_t pktlen,
+                      ev_tstamp now) {
+  if (c->max_entries == 0) {
+    return;
+  }
+  uint32_t ttl = DNS_CACHE_NEGATIVE_TTL;
+  int num_rr = dns_packet_min_ttl(pkt, pktlen, &ttl);
+  if (num_rr < 0) {
+    DLOG("Not caching malformed response for '%s'.", name);
+    return;
+  }
+  if (ttl == 0) {
+    return;
+  }
+  dns_cache_store(c, name, type, subnet, pkt, pktlen, ttl, now + ttl);
+}
+
+int dns_cache_save(const dns_cache_t *c, const char *path) {
+  size_t size = sizeof(struct snapshot_header);
+  const dns_cache_entry_t *e;
+  for (e = c->lru.prev; e != &c->lru; e = e->prev) {
+    size += SNAPSHOT_ALIGN(sizeof(struct snapshot_record) + strlen(e->name) +
+                           strlen(e->subnet) + 2 + e->pktlen);
+  }
+  uint8_t *buf = (uint8_t *)calloc(1, size);
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+  struct snapshot_header *h = (struct snapshot_header *)buf;
+  memcpy(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic));
+  h->version = SNAPSHOT_VERSION;
+  h->count = c->entries;
+  uint8_t *p = buf + sizeof(*h);
+  // Least recently used first, so loading rebuilds the same order.
+  for (e = c->lru.prev; e != &c->lru; e = e->prev) {
+    struct snapshot_record *r = (struct snapshot_record *)p;
+    r->expiry = e->expiry;
+    r->ttl = e->ttl;
+    r->pktlen = e->pktlen;
+    r->type = e->type;
+    r->namelen = strlen(e->name) + 1;
+    r->subnetlen = strlen(e->subnet) + 1;
+    uint8_t *d = p + sizeof(*r);
+    memcpy(d, e->name, r->namelen);
+    memcpy(d + r->namelen, e->subnet, r->subnetlen);
+    memcpy(d + r->namelen + r->subnetlen, e->pkt, e->pktlen);
+    p += SNAPSHOT_ALIGN(sizeof(*r) + r->namelen + r->subnetlen + r->pktlen);
+  }
+
+  // Written aside and renamed over the old one, so a crash midway never
+  // leaves a torn snapshot behind.
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    free(buf);
+    return -1;
+  }
+  size_t off = 0;
+  while (off < size) {
+    ssize_t r = write(fd, buf + off, size - off);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      int err = errno;
+      close(fd);
+      unlink(tmp);
+      free(buf);
+      errno = err;
+      return -1;
+    }
+    off += r;
+  }
+  free(buf);
+  if (close(fd) < 0 || rename(tmp, path) < 0) {
+    int err = errno;
+    unlink(tmp);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+int dns_cache_load(dns_cache_t *c, const char *path, ev_tstamp now) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snapshot_header)) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  size_t size = st.st_size;
+  uint8_t *buf = (uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    return -1;
+  }
+  const struct snapshot_header *h = (const struct snapshot_header *)buf;
+  if (memcmp(h->magic, SNAPSHOT_MAGIC, sizeof(h->magic)) ||
+      h->version != SNAPSHOT_VERSION) {
+    munmap(buf, size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  int loaded = 0;
+  size_t off = sizeof(*h);
+  uint32_t i;
+  for (i = 0; i < h->count && c->max_entries; i++) {
+    if (size - off < sizeof(struct snapshot_record)) {
+      break;
+    }
+    const struct snapshot_record *r =
+        (const struct snapshot_record *)(buf + off);
+    const char *name = (const char *)(r + 1);
+    const char *subnet = name + r->namelen;
+    const uint8_t *pkt = (const uint8_t *)subnet + r->subnetlen;
+    size_t len = sizeof(*r) + r->namelen + r->subnetlen + r->pktlen;
+    if (size - off < len || !r->namelen || !r->subnetlen ||
+        name[r->namelen - 1] || subnet[r->subnetlen - 1] ||
+        r->namelen > DNS_MAX_NAME + 1 || r->pktlen > DNS_MAX_MSG) {
+      WLOG("Snapshot '%s' is corrupt after %u entries.", path, i);
+      break;
+    }
+    off += SNAPSHOT_ALIGN(len);
+    if (off > size) {
+      off = size;
+    }
+    // Wall clock expiry carries over as is, entries age while we are down.
+    if (r->expiry + c->max_stale <= now) {
+      continue;
+    }
+    dns_cache_store(c, name, r->type, subnet, pkt, r->pktlen, r->ttl,
+                    r->expiry);
+    loaded++;
+  }
+  munmap(buf, size);
+  return loaded;
+}
+
+void dns_cache_cleanup(dns_cache_t *c) {
+  while (c->lru.next != &c->lru) {
+    dns_cache_remove(c, c->lru.next);
+  }
+  free(c->buckets);
+  c->buckets = NULL;
+}
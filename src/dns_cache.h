@@ -0,0 +1,97 @@
+// A bounded, TTL-aware cache of wire-format DNS responses.
+#ifndef _DNS_CACHE_H_
+#define _DNS_CACHE_H_
+
+#include <ev.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// TTL used for responses that carry no answer records.
+#define DNS_CACHE_NEGATIVE_TTL 60
+
+// Internal: A single cached response. Key and packet live in 'data'.
+typedef struct dns_cache_entry_s {
+  struct dns_cache_entry_s *hnext; // Hash bucket chain.
+  struct dns_cache_entry_s *prev;  // LRU list, most recently used first.
+  struct dns_cache_entry_s *next;
+
+  uint32_t hash;
+  uint16_t type;
+  uint32_t ttl; // Lifetime granted when the entry was stored.
+  ev_tstamp expiry;
+
+  const char *name;
+  const char *subnet;
+  uint8_t *pkt;
+  uint32_t pktlen;
+  size_t size; // Bytes charged against the cache limit.
+
+  uint8_t data[];
+} dns_cache_entry_t;
+
+typedef struct {
+  dns_cache_entry_t **buckets;
+  uint32_t nbuckets; // Always a power of two.
+  dns_cache_entry_t lru; // List sentinel.
+
+  size_t entries;
+  size_t max_entries;
+  size_t bytes;
+  size_t max_bytes;
+  // Seconds an entry is kept past its expiry to be served stale.
+  uint32_t max_stale;
+} dns_cache_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// FNV-1a over the name, the type and the subnet. Names are expected in
+// lowercase, as dns_packet_read_qname produces them, and are compared
+// exactly throughout. Exposed so other
+// tables keyed like the cache (e.g. pending lookups) hash the same way.
+uint32_t dns_cache_key_hash(const char *name, uint16_t type,
+                            const char *subnet);
+
+// Initializes a cache holding at most 'max_entries' responses and
+// 'max_bytes' bytes. A limit of zero disables the cache. Expired entries
+// stay available to dns_cache_lookup_stale for 'max_stale' seconds.
+void dns_cache_init(dns_cache_t *c, size_t max_entries, size_t max_bytes,
+                    uint32_t max_stale);
+
+// Returns the unexpired entry for (name, type, subnet) or NULL.
+// The entry becomes most recently used.
+const dns_cache_entry_t *dns_cache_lookup(dns_cache_t *c, const char *name,
+                                          uint16_t type, const char *subnet,
+                                          ev_tstamp now);
+
+// Like dns_cache_lookup, but also returns entries that expired less than
+// 'max_stale' seconds ago (RFC 8767). For use when the upstream fails.
+const dns_cache_entry_t *dns_cache_lookup_stale(dns_cache_t *c,
+                                                const char *name,
+                                                uint16_t type,
+                                                const char *subnet,
+                                                ev_tstamp now);
+
+// Stores response 'pkt' for (name, type, subnet). The lifetime is the lowest
+// TTL in the answer section, or DNS_CACHE_NEGATIVE_TTL if there is none.
+// Least recently used entries are evicted to stay within the limits.
+void dns_cache_insert(dns_cache_t *c, const char *name, uint16_t type,
+                      const char *subnet, const uint8_t *pkt, uint32_t pktlen,
+                      ev_tstamp now);
+
+// Writes every entry to a snapshot file at 'path', replacing it atomically.
+// Returns 0 on success, -1 with errno set on failure.
+int dns_cache_save(const dns_cache_t *c, const char *path);
+
+// Adds the entries of the snapshot at 'path' that are still within their
+// stale window at 'now'. The file is mapped and read in place.
+// Returns the number of entries loaded, -1 with errno set if there is no
+// readable snapshot.
+int dns_cache_load(dns_cache_t *c, const char *path, ev_tstamp now);
+
+void dns_cache_cleanup(dns_cache_t *c);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DNS_CACHE_H_
@@ -0,0 +1,392 @@
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "dns_packet.h"
+
+// Returns the offset just past the (possibly compressed) name at 'ofs',
+// or -1 if it runs past the end of the packet.
+static int dn_skip_name(const uint8_t *pkt, size_t len, size_t ofs) {
+  while (ofs < len) {
+    uint8_t l = pkt[ofs];
+    if ((l & 0xc0) == 0xc0) {
+      return (ofs + 2 <= len) ? (int)(ofs + 2) : -1;
+    }
+    if (l == 0) {
+      return ofs + 1;
+    }
+    ofs += l + 1;
+  }
+  return -1;
+}
+
+int dns_packet_read_qname(const uint8_t *pkt, size_t len, size_t ofs,
+                          char *name) {
+  char *out = name;
+  while (ofs < len) {
+    uint8_t l = pkt[ofs++];
+    if (l == 0) {
+      if (out > name) {
+        out--; // The last dot.
+      }
+      *out = '\0';
+      return ofs;
+    }
+    if (l > 63 || ofs + l > len || (out - name) + l + 1 > DNS_MAX_NAME + 1) {
+      return -1;
+    }
+    const uint8_t *label = pkt + ofs;
+    int i;
+    for (i = 0; i < l; i++) {
+      uint8_t c = label[i];
+      if (c == '.' || c == '\0') {
+        return -1;
+      }
+      *out++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    *out++ = '.';
+    ofs += l;
+  }
+  return -1;
+}
+
+int dns_packet_write_name(const char *name, uint8_t *out, int olen) {
+  uint8_t *pos = out;
+  uint8_t *end = out + olen;
+  while (*name) {
+    const char *dot = strchr(name, '.');
+    int l = dot ? dot - name : (int)strlen(name);
+    if (l == 0 || l > 63 || end - pos < l + 1) { return -1; }
+    *pos++ = l;
+    memcpy(pos, name, l);
+    pos += l;
+    name += l;
+    if (*name) { name++; }
+  }
+  if (pos >= end) { return -1; }
+  *pos++ = 0;
+  return pos - out;
+}
+
+// Writes a header with 'flags' and a single question for ('name', 'type').
+static int dns_packet_question(uint16_t tx_id, uint16_t flags, const char *name,
+                               uint16_t type, uint8_t *out, int olen) {
+  uint8_t *pos = out;
+  uint8_t *end = out + olen;
+  if (olen < DNS_HEADER_LENGTH) {
+    return -1;
+  }
+  NS_PUT16(tx_id, pos);
+  NS_PUT16(flags, pos);
+  NS_PUT16(1, pos); // Question
+  NS_PUT16(0, pos); // Answer
+  NS_PUT16(0, pos); // Authority
+  NS_PUT16(0, pos); // Additional
+  int r = dns_packet_write_name(name, pos, end - pos);
+  if (r < 0 || end - pos < r + 4) {
+    return -1;
+  }
+  pos += r;
+  NS_PUT16(type, pos);
+  NS_PUT16(ns_c_in, pos);
+  return pos - out;
+}
+
+int dns_packet_query(uint16_t tx_id, const char *name, uint16_t type,
+                     uint8_t *out, int olen) {
+  return dns_packet_question(tx_id, 1 << 8, name, type, out, olen); // RD
+}
+
+int dns_packet_empty_reply(uint16_t tx_id, int rd, int rcode, const char *name,
+                           uint16_t type, uint8_t *out, int olen) {
+  uint16_t flags = 1 << 15 | 1 << 7 | (rcode & 0xf); // Response, RA
+  if (rd) {
+    flags |= 1 << 8;
+  }
+  return dns_packet_question(tx_id, flags, name, type, out, olen);
+}
+
+int dns_packet_min_ttl(const uint8_t *pkt, size_t len, uint32_t *ttl) {
+  if (len < DNS_HEADER_LENGTH) {
+    return -1;
+  }
+  const uint8_t *p = pkt + 4;
+  uint16_t num_q, num_rr;
+  NS_GET16(num_q, p);
+  NS_GET16(num_rr, p);
+
+  int ofs = DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < num_q; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 4 > len) {
+      return -1;
+    }
+    ofs += 4;
+  }
+  for (i = 0; i < num_rr; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 10 > len) {
+      return -1;
+    }
+    uint32_t rr_ttl;
+    uint16_t rdlen;
+    p = pkt + ofs + 4;
+    NS_GET32(rr_ttl, p);
+    NS_GET16(rdlen, p);
+    if (i == 0 || rr_ttl < *ttl) {
+      *ttl = rr_ttl;
+    }
+    ofs += 10 + rdlen;
+    if (ofs > len) {
+      return -1;
+    }
+  }
+  return num_rr;
+}
+
+// Returns the offset of the EDNS0 OPT record of 'pkt', just past its owner
+// name, 0 if there is none, or -1 on a malformed packet.
+static int dns_packet_find_opt(const uint8_t *pkt, size_t len) {
+  if (len < DNS_HEADER_LENGTH) {
+    return -1;
+  }
+  const uint8_t *p = pkt + 4;
+  uint16_t num_q, num_rr, num_ns, num_ar;
+  NS_GET16(num_q, p);
+  NS_GET16(num_rr, p);
+  NS_GET16(num_ns, p);
+  NS_GET16(num_ar, p);
+
+  int ofs = DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < num_q; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 4 > len) {
+      return -1;
+    }
+    ofs += 4;
+  }
+  for (i = 0; i < num_rr + num_ns + num_ar; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 10 > len) {
+      return -1;
+    }
+    uint16_t type, rdlen;
+    p = pkt + ofs;
+    NS_GET16(type, p);
+    if (i >= num_rr + num_ns && type == ns_t_opt) {
+      return ofs;
+    }
+    p += 6;
+    NS_GET16(rdlen, p);
+    ofs += 10 + rdlen;
+    if (ofs > len) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int dns_packet_edns(const uint8_t *pkt, size_t len, uint16_t *udp_size) {
+  int ofs = dns_packet_find_opt(pkt, len);
+  if (ofs <= 0) {
+    return ofs;
+  }
+  const uint8_t *p = pkt + ofs + 2;
+  NS_GET16(*udp_size, p);
+  return 1;
+}
+
+int dns_packet_ecs(const uint8_t *pkt, size_t len, uint8_t addr[4],
+                   int *prefix) {
+  int ofs = dns_packet_find_opt(pkt, len);
+  if (ofs <= 0) {
+    return ofs;
+  }
+  const uint8_t *p = pkt + ofs + 8;
+  uint16_t rdlen;
+  NS_GET16(rdlen, p);
+  const uint8_t *end = p + rdlen;
+  if (end > pkt + len) {
+    return -1;
+  }
+  while (end - p >= 4) {
+    uint16_t code, olen;
+    NS_GET16(code, p);
+    NS_GET16(olen, p);
+    if (olen > end - p) {
+      return -1;
+    }
+    if (code == DNS_OPT_ECS) {
+      // Family, source and scope prefix, then the significant bytes only.
+      if (olen < 4) {
+        return -1;
+      }
+      uint16_t family;
+      NS_GET16(family, p);
+      int source = *p;
+      int n = olen - 4;
+      if (family != 1 || source > 32 || n != (source + 7) / 8) {
+        return 0; // Not IPv4, or not a well-formed option.
+      }
+      memset(addr, 0, 4);
+      memcpy(addr, p + 2, n);
+      *prefix = source;
+      return 1;
+    }
+    p += olen;
+  }
+  return 0;
+}
+
+int dns_packet_query_ecs(uint16_t tx_id, const char *name, uint16_t type,
+                         const uint8_t addr[4], int prefix, uint8_t *out,
+                         int olen) {
+  int r = dns_packet_query(tx_id, name, type, out, olen);
+  int n = (prefix + 7) / 8;
+  if (r < 0 || prefix < 0 || prefix > 32 || olen - r < 11 + 8 + n) {
+    return -1;
+  }
+  out[11] = 1; // Additional
+  uint8_t *pos = out + r;
+  *pos++ = 0; // Root
+  NS_PUT16(ns_t_opt, pos);
+  NS_PUT16(DNS_MAX_UDP_PAYLOAD, pos);
+  NS_PUT32(0, pos); // Extended RCODE and flags
+  NS_PUT16(8 + n, pos);
+  NS_PUT16(DNS_OPT_ECS, pos);
+  NS_PUT16(4 + n, pos);
+  NS_PUT16(1, pos); // IPv4
+  *pos++ = prefix;
+  *pos++ = 0; // Scope
+  memcpy(pos, addr, n);
+  if (n > 0 && prefix % 8) {
+    pos[n - 1] &= 0xff << (8 - prefix % 8);
+  }
+  pos += n;
+  return pos - out;
+}
+
+int dns_packet_truncate(const uint8_t *pkt, size_t len, uint16_t edns_size,
+                        uint8_t *out, int olen) {
+  if (len < DNS_HEADER_LENGTH) {
+    return -1;
+  }
+  const uint8_t *p = pkt + 4;
+  uint16_t num_q;
+  NS_GET16(num_q, p);
+
+  int ofs = DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < num_q; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 4 > len) {
+      return -1;
+    }
+    ofs += 4;
+  }
+  if (ofs + (edns_size ? DNS_OPT_LENGTH : 0) > olen) {
+    return -1;
+  }
+  memcpy(out, pkt, ofs);
+  out[2] |= 0x02; // TC
+  uint8_t *pos = out + 6;
+  NS_PUT16(0, pos); // Answer
+  NS_PUT16(0, pos); // Authority
+  NS_PUT16(edns_size ? 1 : 0, pos); // Additional
+  if (edns_size) {
+    ofs += dns_packet_write_opt(edns_size, out + ofs);
+  }
+  return ofs;
+}
+
+int dns_packet_write_opt(uint16_t udp_size, uint8_t *out) {
+  uint8_t *pos = out;
+  *pos++ = 0; // Root
+  NS_PUT16(ns_t_opt, pos);
+  NS_PUT16(udp_size, pos);
+  NS_PUT32(0, pos); // Extended rcode and flags
+  NS_PUT16(0, pos); // No options
+  return pos - out;
+}
+
+void dns_packet_set_id(uint8_t *pkt, uint16_t tx_id, int rd) {
+  NS_PUT16(tx_id, pkt);
+  // 'pkt' now points at the flags, RD being the low bit of their first byte.
+  pkt[0] = rd ? pkt[0] | 0x01 : pkt[0] & ~0x01;
+}
+
+int dns_packet_set_qname(uint8_t *pkt, size_t len, const uint8_t *qname,
+                         size_t qnamelen) {
+  if (len < DNS_HEADER_LENGTH || (pkt[4] == 0 && pkt[5] == 0)) {
+    return -1;
+  }
+  int end = dn_skip_name(pkt, len, DNS_HEADER_LENGTH);
+  if (end < 0 || (size_t)end - DNS_HEADER_LENGTH != qnamelen) {
+    return -1;
+  }
+  memcpy(pkt + DNS_HEADER_LENGTH, qname, qnamelen);
+  return 0;
+}
+
+// Lowers the TTL of every resource record in 'pkt' except EDNS0 OPT by
+// 'age', to no less than zero, then bounds it to ['lo', 'hi'].
+// Returns 0 on success, -1 on a malformed packet.
+static int dns_packet_adjust_ttl(uint8_t *pkt, size_t len, uint32_t age,
+                                 uint32_t lo, uint32_t hi) {
+  if (len < DNS_HEADER_LENGTH) {
+    return -1;
+  }
+  const uint8_t *p = pkt + 4;
+  uint16_t num_q, num_rr, num_ns, num_ar;
+  NS_GET16(num_q, p);
+  NS_GET16(num_rr, p);
+  NS_GET16(num_ns, p);
+  NS_GET16(num_ar, p);
+
+  int ofs = DNS_HEADER_LENGTH;
+  int i;
+  for (i = 0; i < num_q; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 4 > len) {
+      return -1;
+    }
+    ofs += 4;
+  }
+  for (i = 0; i < num_rr + num_ns + num_ar; i++) {
+    if ((ofs = dn_skip_name(pkt, len, ofs)) < 0 || ofs + 10 > len) {
+      return -1;
+    }
+    uint16_t type, rdlen;
+    p = pkt + ofs;
+    NS_GET16(type, p);
+    if (type != ns_t_opt) {
+      uint32_t ttl;
+      p = pkt + ofs + 4;
+      NS_GET32(ttl, p);
+      ttl = ttl > age ? ttl - age : 0;
+      ttl = ttl < lo ? lo : ttl > hi ? hi : ttl;
+      uint8_t *t = pkt + ofs + 4;
+      NS_PUT32(ttl, t);
+    }
+    p = pkt + ofs + 8;
+    NS_GET16(rdlen, p);
+    ofs += 10 + rdlen;
+    if (ofs > len) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int dns_packet_set_ttl(uint8_t *pkt, size_t len, uint32_t ttl) {
+  return dns_packet_adjust_ttl(pkt, len, 0, ttl, ttl);
+}
+
+int dns_packet_clamp_ttl(uint8_t *pkt, size_t len, uint32_t min_ttl,
+                         uint32_t max_ttl) {
+  return dns_packet_adjust_ttl(pkt, len, 0, min_ttl,
+                               max_ttl ? max_ttl : UINT32_MAX);
+}
+
+int dns_packet_age_ttl(uint8_t *pkt, size_t len, uint32_t age) {
+  return dns_packet_adjust_ttl(pkt, len, age, 0, UINT32_MAX);
+}
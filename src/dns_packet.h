@@ -0,0 +1,115 @@
+// Small helpers for inspecting wire-format DNS packets.
+#ifndef _DNS_PACKET_H_
+#define _DNS_PACKET_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define DNS_HEADER_LENGTH 12
+
+// Largest message, limited by the TCP length prefix.
+#define DNS_MAX_MSG 65535
+
+// Longest domain name in dotted form, without the trailing dot.
+#define DNS_MAX_NAME 253
+
+// EDNS0 option code of Client Subnet (RFC 7871).
+#define DNS_OPT_ECS 8
+
+// UDP payload size advertised in queries built here.
+#define DNS_MAX_UDP_PAYLOAD 4096
+
+// Size of an OPT record without options.
+#define DNS_OPT_LENGTH 11
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Reads the uncompressed name at 'ofs' of 'pkt' into 'name' as lowercase
+// dotted text without the trailing dot, "" for the root. 'name' must hold
+// DNS_MAX_NAME + 1 bytes. Compression pointers and labels containing dots
+// or NULs, neither of which belong in a question, are rejected.
+// Returns the offset just past the name, or -1 if it is malformed.
+int dns_packet_read_qname(const uint8_t *pkt, size_t len, size_t ofs,
+                          char *name);
+
+// Writes dotted 'name' as uncompressed labels to 'out' of 'olen' bytes.
+// Returns the bytes written, or -1 if it does not fit or is not a name.
+int dns_packet_write_name(const char *name, uint8_t *out, int olen);
+
+// Builds a recursive query for ('name', 'type').
+// Returns size of packet on success, -1 on failure.
+int dns_packet_query(uint16_t tx_id, const char *name, uint16_t type,
+                     uint8_t *out, int olen);
+
+// Builds a reply without records to a query for ('name', 'type'), headed by
+// the original question. 'rd' is copied from the query, 'rcode' is e.g.
+// ns_r_servfail or ns_r_noerror for NODATA.
+// Returns size of packet on success, -1 on failure.
+int dns_packet_empty_reply(uint16_t tx_id, int rd, int rcode, const char *name,
+                           uint16_t type, uint8_t *out, int olen);
+
+// Returns the smallest TTL of the answer section of 'pkt' in '*ttl'.
+// '*ttl' is left untouched when the packet carries no answers.
+// Returns the number of answers on success, -1 on a malformed packet.
+int dns_packet_min_ttl(const uint8_t *pkt, size_t len, uint32_t *ttl);
+
+// Finds the EDNS0 OPT record (RFC 6891) of 'pkt' and returns the UDP
+// payload size it advertises in '*udp_size'.
+// Returns 1 if there is one, 0 if not, -1 on a malformed packet.
+int dns_packet_edns(const uint8_t *pkt, size_t len, uint16_t *udp_size);
+
+// Finds an IPv4 EDNS Client Subnet option (RFC 7871) in 'pkt' and returns
+// its address in 'addr' and source prefix length in '*prefix'.
+// Returns 1 if there is one, 0 if not, -1 on a malformed packet.
+int dns_packet_ecs(const uint8_t *pkt, size_t len, uint8_t addr[4],
+                   int *prefix);
+
+// Like dns_packet_query, with an OPT record carrying a Client Subnet
+// option for the first 'prefix' bits of 'addr'.
+int dns_packet_query_ecs(uint16_t tx_id, const char *name, uint16_t type,
+                         const uint8_t addr[4], int prefix, uint8_t *out,
+                         int olen);
+
+// Writes an EDNS0 OPT record without options advertising 'udp_size' to
+// 'out', which must hold DNS_OPT_LENGTH bytes. Returns DNS_OPT_LENGTH.
+int dns_packet_write_opt(uint16_t udp_size, uint8_t *out);
+
+// Writes the header and question of 'pkt' to 'out' with the TC bit set and
+// no records, telling the client to retry over TCP. A non-zero 'edns_size'
+// adds an OPT record advertising it.
+// Returns size of packet on success, -1 on failure.
+int dns_packet_truncate(const uint8_t *pkt, size_t len, uint16_t edns_size,
+                        uint8_t *out, int olen);
+
+// Sets the transaction id and RD bit of the reply 'pkt', which must hold
+// a header, to those of the query it answers.
+void dns_packet_set_id(uint8_t *pkt, uint16_t tx_id, int rd);
+
+// Overwrites the question name of 'pkt' with the 'qnamelen' bytes of
+// 'qname', the same name in wire format as spelled by a client, whose case
+// it may have randomized (draft-vixie-dnsext-dns0x20).
+// Returns 0 on success, -1 if the packet has no question of that length.
+int dns_packet_set_qname(uint8_t *pkt, size_t len, const uint8_t *qname,
+                         size_t qnamelen);
+
+// Overwrites the TTL of every resource record in 'pkt' except EDNS0 OPT.
+// Returns 0 on success, -1 on a malformed packet.
+int dns_packet_set_ttl(uint8_t *pkt, size_t len, uint32_t ttl);
+
+// Bounds the TTL of every resource record in 'pkt' except EDNS0 OPT to
+// ['min_ttl', 'max_ttl'], each on its own. A 'max_ttl' of zero means no
+// upper bound.
+// Returns 0 on success, -1 on a malformed packet.
+int dns_packet_clamp_ttl(uint8_t *pkt, size_t len, uint32_t min_ttl,
+                         uint32_t max_ttl);
+
+// Lowers the TTL of every resource record in 'pkt' except EDNS0 OPT by the
+// 'age' seconds it has been kept, to no less than zero.
+// Returns 0 on success, -1 on a malformed packet.
+int dns_packet_age_ttl(uint8_t *pkt, size_t len, uint32_t age);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DNS_PACKET_H_
@@ -1,14 +1,19 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
-#include <ares.h>
 #include <arpa/inet.h>
 #include <curl/curl.h>
 #include <errno.h>
 #include <ev.h>
+#include <fcntl.h>
 #include <grp.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
@@ -18,42 +23,166 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "dns_packet.h"
 #include "dns_server.h"
 #include "logging.h"
 
-// Creates and bind a listening UDP socket for incoming requests.
-static int get_listen_sock(const char *listen_addr, int listen_port) {
-  struct sockaddr_in laddr;
-  memset(&laddr, 0, sizeof(laddr));
-  laddr.sin_family = AF_INET;
-  laddr.sin_port = htons(listen_port);
-  laddr.sin_addr.s_addr = inet_addr(listen_addr);
-  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+// Room for the packet info of either family.
+union dns_cmsg {
+  char buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  struct cmsghdr align;
+};
+
+int dns_server_parse_addr(const char *text, int port, dns_addr_t *addr) {
+  memset(addr, 0, sizeof(*addr));
+  if (inet_pton(AF_INET, text, &addr->in.sin_addr) == 1) {
+    addr->in.sin_family = AF_INET;
+    addr->in.sin_port = htons(port);
+    return 0;
+  }
+  if (inet_pton(AF_INET6, text, &addr->in6.sin6_addr) == 1) {
+    addr->in6.sin6_family = AF_INET6;
+    addr->in6.sin6_port = htons(port);
+    return 0;
+  }
+  return -1;
+}
+
+socklen_t dns_server_addr_len(const dns_addr_t *addr) {
+  return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6)
+                                        : sizeof(addr->in);
+}
+
+// Creates a socket of 'type' bound to 'listen_addr' and 'listen_port'.
+// 'what' prefixes the address in log lines.
+static int dns_server_socket(const char *listen_addr, int listen_port,
+                             int type, int reuse_port, const char *what) {
+  dns_addr_t laddr;
+  if (dns_server_parse_addr(listen_addr, listen_port, &laddr) < 0) {
+    FLOG("Bad listen address '%s'", listen_addr);
+  }
+  int v6 = laddr.sa.sa_family == AF_INET6;
+  char name[INET6_ADDRSTRLEN + 16];
+  snprintf(name, sizeof(name), "%s%s%s%s:%d", what, v6 ? "[" : "",
+           listen_addr, v6 ? "]" : "", listen_port);
+  int sock = socket(laddr.sa.sa_family, type, 0);
   if (sock < 0) {
-    FLOG("Error creating socket");
+    FLOG("Error creating %ssocket", what);
   }
-  if (bind(sock, (struct sockaddr *)&laddr, sizeof(laddr)) < 0) {
-    FLOG("Error binding %s:%d", listen_addr, listen_port);
+  int one = 1;
+  if (type == SOCK_STREAM) {
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+  if (v6) {
+    // Leaves the IPv4 wildcard to a socket of its own.
+    setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+  }
+  if (reuse_port) {
+#ifdef SO_REUSEPORT
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+      FLOG("Error setting SO_REUSEPORT: %s", strerror(errno));
+    }
+#else
+    FLOG("SO_REUSEPORT is not supported on this platform.");
+#endif
+  }
+  if (bind(sock, &laddr.sa, dns_server_addr_len(&laddr)) < 0) {
+    FLOG("Error binding %s", name);
+  }
+  if (type == SOCK_STREAM) {
+    if (listen(sock, SOMAXCONN) < 0) {
+      FLOG("Error listening on %s", name);
+    }
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
   }
 
-  ILOG("Listening on %s:%d", listen_addr, listen_port);
+  ILOG("Listening on %s", name);
   return sock;
 }
 
-static void watcher_cb(struct ev_loop *loop, ev_io *w, int revents) {
-  dns_server_t *d = (dns_server_t *)w->data;
+int dns_server_listen(const char *listen_addr, int listen_port,
+                      int reuse_port) {
+  return dns_server_socket(listen_addr, listen_port, SOCK_DGRAM, reuse_port,
+                           "");
+}
 
-  // A default MTU. We don't do TCP so any bigger is likely a waste.
-  unsigned char buf[1500];
-  struct sockaddr_in raddr;
-  socklen_t raddr_size = sizeof(raddr);
-  int len = recvfrom(w->fd, buf, sizeof(buf), 0, (struct sockaddr *)&raddr,
-                     &raddr_size);
-  if (len < 0) {
-    WLOG("recvfrom failed: %s", strerror(errno));
+int dns_server_listen_tcp(const char *listen_addr, int listen_port,
+                          int reuse_port) {
+  return dns_server_socket(listen_addr, listen_port, SOCK_STREAM, reuse_port,
+                           "TCP ");
+}
+
+// Takes the address a datagram arrived on from the control messages of
+// 'mh', if it has any.
+static void dns_server_read_local(struct msghdr *mh,
+                                  struct dns_local_addr *local) {
+  local->family = 0;
+  struct cmsghdr *cm;
+  for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+    if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_PKTINFO) {
+      struct in_pktinfo pi;
+      memcpy(&pi, CMSG_DATA(cm), sizeof(pi));
+      local->family = AF_INET;
+      local->ifindex = 0;
+      local->addr.in = pi.ipi_addr;
+    } else if (cm->cmsg_level == IPPROTO_IPV6 &&
+               cm->cmsg_type == IPV6_PKTINFO) {
+      struct in6_pktinfo pi;
+      memcpy(&pi, CMSG_DATA(cm), sizeof(pi));
+      local->family = AF_INET6;
+      local->ifindex = pi.ipi6_ifindex;
+      local->addr.in6 = pi.ipi6_addr;
+    }
+  }
+}
+
+// Has the datagram of 'mh' sent from 'local', using 'control' for the
+// control message.
+static void dns_server_write_local(const struct dns_local_addr *local,
+                                   struct msghdr *mh,
+                                   union dns_cmsg *control) {
+  if (!local->family) {
     return;
   }
+  memset(control, 0, sizeof(*control));
+  mh->msg_control = control->buf;
+  struct cmsghdr *cm = (struct cmsghdr *)control->buf;
+  if (local->family == AF_INET) {
+    struct in_pktinfo pi;
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi_spec_dst = local->addr.in;
+    cm->cmsg_level = IPPROTO_IP;
+    cm->cmsg_type = IP_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cm), &pi, sizeof(pi));
+    mh->msg_controllen = CMSG_SPACE(sizeof(pi));
+  } else {
+    struct in6_pktinfo pi;
+    memset(&pi, 0, sizeof(pi));
+    pi.ipi6_addr = local->addr.in6;
+    pi.ipi6_ifindex = local->ifindex;
+    cm->cmsg_level = IPPROTO_IPV6;
+    cm->cmsg_type = IPV6_PKTINFO;
+    cm->cmsg_len = CMSG_LEN(sizeof(pi));
+    memcpy(CMSG_DATA(cm), &pi, sizeof(pi));
+    mh->msg_controllen = CMSG_SPACE(sizeof(pi));
+  }
+}
 
+// Parses a single query and hands it to the callback. 'peer' arrives with
+// its address and connection filled in.
+static void dns_server_handle(dns_server_t *d, unsigned char *buf, int len,
+                              dns_peer_t *peer) {
+  if (peer->tcp >= 0) {
+    METRIC_INC(d->metrics, queries_tcp);
+  } else {
+    METRIC_INC(d->metrics, queries_udp);
+  }
+  if (len < 12) {
+    DLOG("Malformed request received.");
+    METRIC_INC(d->metrics, malformed);
+    return;
+  }
   unsigned char *p = buf;
   uint16_t tx_id = ntohs(*(uint16_t *)p);
   p += 2;
@@ -69,42 +198,528 @@ static void watcher_cb(struct ev_loop *loop, ev_io *w, int revents) {
   p += 2;
   if (num_q != 1) {
     DLOG("Malformed request received.");
+    METRIC_INC(d->metrics, malformed);
     return;
   };
-  char *domain_name;
-  long enc_len;
-  if (ares_expand_name(p, buf, len, &domain_name, &enc_len) != ARES_SUCCESS) {
+  // Decoded straight from the datagram, nothing is allocated per query.
+  char domain_name[DNS_MAX_NAME + 1];
+  int ofs = dns_packet_read_qname(buf, len, p - buf, domain_name);
+  if (ofs < 0 || ofs + 2 > len) {
     DLOG("Malformed request received.");
+    METRIC_INC(d->metrics, malformed);
     return;
   }
-  p += enc_len;
+  peer->qnamelen = ofs - (p - buf);
+  memcpy(peer->qname, p, peer->qnamelen);
+  p = buf + ofs;
   uint16_t type = ntohs(*(uint16_t *)p);
   p += 2;
 
-  d->cb(d, d->cb_data, raddr, tx_id, flags, domain_name, type);
+  uint16_t udp_size = 0;
+  peer->edns = dns_packet_edns(buf, len, &udp_size) > 0;
+  if (peer->tcp >= 0) {
+    peer->max_size = DNS_MAX_MSG;
+    d->tcp_conns[peer->tcp].outstanding++;
+  } else if (!peer->edns || udp_size < DNS_SERVER_UDP_SIZE) {
+    peer->max_size = DNS_SERVER_UDP_SIZE;
+  } else {
+    peer->max_size =
+        udp_size > DNS_SERVER_MAX_MSG ? DNS_SERVER_MAX_MSG : udp_size;
+  }
 
-  ares_free_string(domain_name);
+  d->cb(d, d->cb_data, peer, tx_id, flags, domain_name, type, buf, len);
 }
 
-void dns_server_init(dns_server_t *d, struct ev_loop *loop,
-                     const char *listen_addr, int listen_port,
+#ifdef HAVE_RECVMMSG
+static void watcher_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  dns_server_t *d = (dns_server_t *)w->data;
+
+  struct mmsghdr msgs[DNS_SERVER_BATCH];
+  struct iovec iovs[DNS_SERVER_BATCH];
+  union dns_cmsg control[DNS_SERVER_BATCH];
+  int i;
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < DNS_SERVER_BATCH; i++) {
+    iovs[i].iov_base = d->in[i].buf;
+    iovs[i].iov_len = sizeof(d->in[i].buf);
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &d->in[i].addr;
+    msgs[i].msg_hdr.msg_namelen = sizeof(d->in[i].addr);
+    if (d->pktinfo) {
+      msgs[i].msg_hdr.msg_control = control[i].buf;
+      msgs[i].msg_hdr.msg_controllen = sizeof(control[i].buf);
+    }
+  }
+  int n = recvmmsg(w->fd, msgs, DNS_SERVER_BATCH, MSG_DONTWAIT, NULL);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      WLOG("recvmmsg failed: %s", strerror(errno));
+    }
+    return;
+  }
+  dns_peer_t peer;
+  memset(&peer, 0, sizeof(peer));
+  peer.tcp = -1;
+  for (i = 0; i < n; i++) {
+    peer.addr = d->in[i].addr;
+    dns_server_read_local(&msgs[i].msg_hdr, &peer.local);
+    dns_server_handle(d, d->in[i].buf, msgs[i].msg_len, &peer);
+  }
+}
+#else
+static void watcher_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  dns_server_t *d = (dns_server_t *)w->data;
+
+  unsigned char buf[DNS_SERVER_MAX_MSG];
+  dns_peer_t peer;
+  memset(&peer, 0, sizeof(peer));
+  union dns_cmsg control;
+  struct iovec iov = { buf, sizeof(buf) };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = &peer.addr;
+  mh.msg_namelen = sizeof(peer.addr);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  if (d->pktinfo) {
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+  }
+  int len = recvmsg(w->fd, &mh, 0);
+  if (len < 0) {
+    WLOG("recvmsg failed: %s", strerror(errno));
+    return;
+  }
+  dns_server_read_local(&mh, &peer.local);
+  peer.tcp = -1;
+  dns_server_handle(d, buf, len, &peer);
+}
+#endif
+
+static void dns_tcp_close(struct dns_tcp_conn *c) {
+  dns_server_t *d = c->d;
+  ev_io_stop(d->loop, &c->read_watcher);
+  ev_io_stop(d->loop, &c->write_watcher);
+  ev_timer_stop(d->loop, &c->idle_timer);
+  close(c->fd);
+  free(c->wbuf);
+  c->wbuf = NULL;
+  c->wlen = c->wsize = 0;
+  c->fd = -1;
+  c->gen++;
+}
+
+// Closes a connection whose client has stopped sending once nothing is
+// left to answer. Returns 1 if it did.
+static int dns_tcp_close_if_done(struct dns_tcp_conn *c) {
+  if (c->eof && c->outstanding <= 0 && c->wlen == 0) {
+    dns_tcp_close(c);
+    return 1;
+  }
+  return 0;
+}
+
+// Queues 'n' bytes the socket did not take. Returns -1 once the client has
+// fallen too far behind.
+static int dns_tcp_queue(struct dns_tcp_conn *c, const uint8_t *p, size_t n) {
+  if (c->wlen + n > DNS_SERVER_TCP_MAX_BUFFERED) {
+    return -1;
+  }
+  if (c->wlen + n > c->wsize) {
+    size_t new_size = c->wsize * 2 > c->wlen + n ? c->wsize * 2 : c->wlen + n;
+    uint8_t *new_buf = (uint8_t *)realloc(c->wbuf, new_size);
+    if (!new_buf) {
+      return -1;
+    }
+    c->wbuf = new_buf;
+    c->wsize = new_size;
+  }
+  memcpy(c->wbuf + c->wlen, p, n);
+  c->wlen += n;
+  return 0;
+}
+
+// Sends the reply made of 'n' (at most 3) parts with its length prefix.
+static void dns_tcp_respond(dns_server_t *d, const dns_peer_t *peer,
+                            const struct iovec *parts, int n) {
+  struct dns_tcp_conn *c = &d->tcp_conns[peer->tcp];
+  if (c->fd < 0 || c->gen != peer->gen) {
+    DLOG("Dropping reply for a closed TCP connection.");
+    return;
+  }
+  c->outstanding--;
+  size_t blen = 0;
+  for (int i = 0; i < n; i++) {
+    blen += parts[i].iov_len;
+  }
+  if (blen > DNS_MAX_MSG) {
+    WLOG("Dropping oversized response of %zu bytes.", blen);
+    dns_tcp_close_if_done(c);
+    return;
+  }
+  uint8_t prefix[2] = { blen >> 8, blen & 0xff };
+  struct iovec iov[4] = { { prefix, 2 } };
+  memcpy(iov + 1, parts, n * sizeof(*parts));
+  size_t done = 0;
+  if (c->wlen == 0) {
+    ssize_t r = writev(c->fd, iov, n + 1);
+    if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+      DLOG("TCP write failed: %s", strerror(errno));
+      dns_tcp_close(c);
+      return;
+    }
+    done = r > 0 ? r : 0;
+  }
+  for (int i = 0; i <= n; i++) {
+    size_t len = iov[i].iov_len;
+    if (done >= len) {
+      done -= len;
+      continue;
+    }
+    if (dns_tcp_queue(c, (const uint8_t *)iov[i].iov_base + done,
+                      len - done) < 0) {
+      WLOG("TCP client is not reading its replies, closing.");
+      dns_tcp_close(c);
+      return;
+    }
+    done = 0;
+  }
+  if (c->wlen > 0) {
+    ev_io_start(d->loop, &c->write_watcher);
+  }
+  ev_timer_again(d->loop, &c->idle_timer);
+  dns_tcp_close_if_done(c);
+}
+
+static void tcp_write_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  struct dns_tcp_conn *c = (struct dns_tcp_conn *)w->data;
+  ssize_t r = write(c->fd, c->wbuf, c->wlen);
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      DLOG("TCP write failed: %s", strerror(errno));
+      dns_tcp_close(c);
+    }
+    return;
+  }
+  memmove(c->wbuf, c->wbuf + r, c->wlen - r);
+  c->wlen -= r;
+  if (c->wlen == 0) {
+    ev_io_stop(loop, w);
+    dns_tcp_close_if_done(c);
+  }
+}
+
+static void tcp_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  struct dns_tcp_conn *c = (struct dns_tcp_conn *)w->data;
+  dns_server_t *d = c->d;
+  ssize_t r = read(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+  if (r == 0) {
+    // Replies to queries still in flight may follow (RFC 7766).
+    c->eof = 1;
+    ev_io_stop(loop, w);
+    dns_tcp_close_if_done(c);
+    return;
+  }
+  if (r < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      DLOG("TCP read failed: %s", strerror(errno));
+      dns_tcp_close(c);
+    }
+    return;
+  }
+  c->rlen += r;
+  ev_timer_again(loop, &c->idle_timer);
+
+  dns_peer_t peer;
+  memset(&peer, 0, sizeof(peer));
+  peer.addr = c->addr;
+  peer.tcp = c - d->tcp_conns;
+  peer.gen = c->gen;
+  int ofs = 0;
+  while (c->rlen - ofs >= 2) {
+    int qlen = c->rbuf[ofs] << 8 | c->rbuf[ofs + 1];
+    if (qlen > DNS_SERVER_TCP_MAX_QUERY) {
+      DLOG("Oversized TCP query, closing.");
+      dns_tcp_close(c);
+      return;
+    }
+    if (c->rlen - ofs < 2 + qlen) {
+      break;
+    }
+    dns_server_handle(d, c->rbuf + ofs + 2, qlen, &peer);
+    if (c->fd < 0 || c->gen != peer.gen) {
+      return; // Closed while answering.
+    }
+    ofs += 2 + qlen;
+  }
+  memmove(c->rbuf, c->rbuf + ofs, c->rlen - ofs);
+  c->rlen -= ofs;
+}
+
+static void tcp_idle_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  struct dns_tcp_conn *c = (struct dns_tcp_conn *)w->data;
+  if (c->outstanding > 0) {
+    return; // Waiting on lookups, not on the client. The timer repeats.
+  }
+  DLOG("Closing idle TCP connection.");
+  dns_tcp_close(c);
+}
+
+static void accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  dns_server_t *d = (dns_server_t *)w->data;
+  for (;;) {
+    dns_addr_t raddr;
+    socklen_t raddr_size = sizeof(raddr);
+    int fd = accept(w->fd, &raddr.sa, &raddr_size);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        WLOG("accept failed: %s", strerror(errno));
+      }
+      return;
+    }
+    struct dns_tcp_conn *c = NULL;
+    int i;
+    for (i = 0; i < d->max_tcp; i++) {
+      if (d->tcp_conns[i].fd < 0) {
+        c = &d->tcp_conns[i];
+        break;
+      }
+    }
+    if (!c) {
+      DLOG("Too many TCP clients, refusing one.");
+      METRIC_INC(d->metrics, tcp_refused);
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    int one = 1;
+    // Pipelined replies are small and must not wait for each other's ACKs.
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->d = d;
+    c->fd = fd;
+    c->eof = 0;
+    c->outstanding = 0;
+    c->addr = raddr;
+    c->rlen = 0;
+    ev_io_init(&c->read_watcher, tcp_read_cb, fd, EV_READ);
+    c->read_watcher.data = c;
+    ev_io_start(loop, &c->read_watcher);
+    ev_io_init(&c->write_watcher, tcp_write_cb, fd, EV_WRITE);
+    c->write_watcher.data = c;
+    ev_init(&c->idle_timer, tcp_idle_cb);
+    c->idle_timer.repeat = DNS_SERVER_TCP_IDLE_TIMEOUT;
+    c->idle_timer.data = c;
+    ev_timer_again(loop, &c->idle_timer);
+  }
+}
+
+// Sends every queued reply.
+static void dns_server_flush(dns_server_t *d) {
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[DNS_SERVER_BATCH];
+  struct iovec iovs[DNS_SERVER_BATCH];
+  union dns_cmsg control[DNS_SERVER_BATCH];
+  int i;
+  memset(msgs, 0, sizeof(msgs));
+  for (i = 0; i < d->num_out; i++) {
+    iovs[i].iov_base = d->out[i].buf;
+    iovs[i].iov_len = d->out[i].len;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_name = &d->out[i].addr;
+    msgs[i].msg_hdr.msg_namelen = dns_server_addr_len(&d->out[i].addr);
+    dns_server_write_local(&d->out[i].local, &msgs[i].msg_hdr, &control[i]);
+  }
+  int sent = 0;
+  while (sent < d->num_out) {
+    int r = sendmmsg(d->sock, msgs + sent, d->num_out - sent, 0);
+    if (r <= 0) {
+      // Drop the rest, as sendto would, rather than spin on a full buffer.
+      WLOG("sendmmsg failed: %s", r < 0 ? strerror(errno) : "no progress");
+      break;
+    }
+    sent += r;
+  }
+#endif
+  d->num_out = 0;
+}
+
+static void flush_cb(struct ev_loop *loop, ev_prepare *w, int revents) {
+  dns_server_t *d = (dns_server_t *)w->data;
+  if (d->num_out > 0) {
+    dns_server_flush(d);
+  }
+}
+
+void dns_server_init(dns_server_t *d, struct ev_loop *loop, int sock,
+                     int tcp_sock, int max_tcp, metrics_t *metrics,
                      dns_req_received_cb cb, void *data) {
   d->loop = loop;
-  d->sock = get_listen_sock(listen_addr, listen_port);
+  d->sock = sock;
+  // Sockets handed over by another process get the option here too.
+  d->pktinfo = 0;
+  dns_addr_t laddr;
+  socklen_t laddr_size = sizeof(laddr);
+  int one = 1;
+  if (getsockname(sock, &laddr.sa, &laddr_size) == 0) {
+    if (laddr.sa.sa_family == AF_INET6) {
+      d->pktinfo = IN6_IS_ADDR_UNSPECIFIED(&laddr.in6.sin6_addr) &&
+                   setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one,
+                              sizeof(one)) == 0;
+    } else {
+      d->pktinfo = laddr.in.sin_addr.s_addr == htonl(INADDR_ANY) &&
+                   setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one,
+                              sizeof(one)) == 0;
+    }
+  }
   d->cb = cb;
   d->cb_data = data;
+  d->metrics = metrics;
+
+  d->num_out = 0;
 
   ev_io_init(&d->watcher, watcher_cb, d->sock, EV_READ);
   d->watcher.data = d;
   ev_io_start(d->loop, &d->watcher);
+
+  ev_prepare_init(&d->flush_watcher, flush_cb);
+  d->flush_watcher.data = d;
+  ev_prepare_start(d->loop, &d->flush_watcher);
+
+  d->tcp_sock = tcp_sock;
+  d->max_tcp = tcp_sock < 0 ? 0 : max_tcp;
+  d->tcp_conns = NULL;
+  if (d->tcp_sock >= 0) {
+    d->tcp_conns =
+        (struct dns_tcp_conn *)calloc(d->max_tcp, sizeof(struct dns_tcp_conn));
+    if (!d->tcp_conns) {
+      FLOG("Out of mem");
+    }
+    int i;
+    for (i = 0; i < d->max_tcp; i++) {
+      d->tcp_conns[i].fd = -1;
+    }
+    ev_io_init(&d->accept_watcher, accept_cb, d->tcp_sock, EV_READ);
+    d->accept_watcher.data = d;
+    ev_io_start(d->loop, &d->accept_watcher);
+  }
 }
 
-void dns_server_respond(dns_server_t *d, struct sockaddr_in raddr, char *buf,
+void dns_server_respond(dns_server_t *d, const dns_peer_t *peer, char *buf,
                         int blen) {
-  sendto(d->sock, buf, blen, 0, (struct sockaddr *)&raddr, sizeof(raddr));
+  // Answers are built and cached for the lowercase name.
+  dns_packet_set_qname((uint8_t *)buf, blen, peer->qname, peer->qnamelen);
+  // An EDNS query gets an OPT back (RFC 6891 7) even if the answer came
+  // without one.
+  uint16_t udp_size;
+  int olen = peer->edns &&
+      dns_packet_edns((uint8_t *)buf, blen, &udp_size) == 0 ?
+      DNS_OPT_LENGTH : 0;
+  uint8_t tbuf[DNS_SERVER_UDP_SIZE];
+  if (peer->tcp < 0 && blen + olen > peer->max_size) {
+    int r = dns_packet_truncate((uint8_t *)buf, blen,
+                                peer->edns ? DNS_SERVER_MAX_MSG : 0, tbuf,
+                                sizeof(tbuf));
+    if (r < 0) {
+      WLOG("Dropping response of %d bytes which cannot be truncated.", blen);
+      return;
+    }
+    DLOG("Truncated response of %d bytes for UDP.", blen);
+    METRIC_INC(d->metrics, truncated);
+    buf = (char *)tbuf;
+    blen = r;
+    olen = 0;
+  }
+  // 'buf' may be sent to other waiters too, so the OPT goes only into what
+  // is sent here.
+  uint8_t hdr[DNS_HEADER_LENGTH];
+  uint8_t opt[DNS_OPT_LENGTH];
+  struct iovec iov[3] = { { buf, blen } };
+  int n = 1;
+  if (olen) {
+    memcpy(hdr, buf, DNS_HEADER_LENGTH);
+    uint16_t arcount = (hdr[10] << 8 | hdr[11]) + 1;
+    hdr[10] = arcount >> 8;
+    hdr[11] = arcount & 0xff;
+    dns_packet_write_opt(DNS_SERVER_MAX_MSG, opt);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = DNS_HEADER_LENGTH;
+    iov[1].iov_base = buf + DNS_HEADER_LENGTH;
+    iov[1].iov_len = blen - DNS_HEADER_LENGTH;
+    iov[2].iov_base = opt;
+    iov[2].iov_len = olen;
+    n = 3;
+  }
+  if (peer->tcp >= 0) {
+    dns_tcp_respond(d, peer, iov, n);
+    return;
+  }
+#ifdef HAVE_SENDMMSG
+  if (blen + olen > DNS_SERVER_MAX_MSG) {
+    WLOG("Dropping oversized response of %d bytes.", blen + olen);
+    return;
+  }
+  struct dns_server_msg *m = &d->out[d->num_out++];
+  m->addr = peer->addr;
+  m->local = peer->local;
+  m->len = 0;
+  for (int i = 0; i < n; i++) {
+    memcpy(m->buf + m->len, iov[i].iov_base, iov[i].iov_len);
+    m->len += iov[i].iov_len;
+  }
+  if (d->num_out == DNS_SERVER_BATCH) {
+    dns_server_flush(d);
+  }
+#else
+  dns_addr_t raddr = peer->addr;
+  union dns_cmsg control;
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = &raddr;
+  mh.msg_namelen = dns_server_addr_len(&raddr);
+  mh.msg_iov = iov;
+  mh.msg_iovlen = n;
+  dns_server_write_local(&peer->local, &mh, &control);
+  sendmsg(d->sock, &mh, 0);
+#endif
+}
+
+void dns_server_release(dns_server_t *d, const dns_peer_t *peer) {
+  if (peer->tcp < 0) {
+    return;
+  }
+  struct dns_tcp_conn *c = &d->tcp_conns[peer->tcp];
+  if (c->fd < 0 || c->gen != peer->gen) {
+    return;
+  }
+  c->outstanding--;
+  dns_tcp_close_if_done(c);
+}
+
+void dns_server_stop(dns_server_t *d) {
+  ev_io_stop(d->loop, &d->watcher);
+  if (d->tcp_sock >= 0) {
+    ev_io_stop(d->loop, &d->accept_watcher);
+  }
 }
 
 void dns_server_cleanup(dns_server_t *d) {
+  if (d->num_out > 0) {
+    dns_server_flush(d);
+  }
+  ev_prepare_stop(d->loop, &d->flush_watcher);
   ev_io_stop(d->loop, &d->watcher);
   close(d->sock);
+  if (d->tcp_sock >= 0) {
+    int i;
+    for (i = 0; i < d->max_tcp; i++) {
+      if (d->tcp_conns[i].fd >= 0) {
+        dns_tcp_close(&d->tcp_conns[i]);
+      }
+    }
+    free(d->tcp_conns);
+    ev_io_stop(d->loop, &d->accept_watcher);
+    close(d->tcp_sock);
+  }
 }
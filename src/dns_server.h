@@ -1,33 +1,170 @@
 #ifndef _DNS_SERVER_H_
 #define _DNS_SERVER_H_
 
+#include <sys/socket.h>
+
 #include <arpa/inet.h>
+#include <netinet/in.h>
 #include <stdint.h>
 #include <ev.h>
 
+#include "dns_packet.h"
+#include "metrics.h"
+
+// Datagrams read or written per system call when batching is available.
+#define DNS_SERVER_BATCH 32
+
+// A default MTU. Larger answers are truncated and go over TCP.
+#define DNS_SERVER_MAX_MSG 1500
+
+// UDP reply size for clients that do not advertise one with EDNS0.
+#define DNS_SERVER_UDP_SIZE 512
+
+// Largest query accepted over TCP.
+#define DNS_SERVER_TCP_MAX_QUERY 4096
+
+// Seconds a TCP connection may sit idle before it is closed (RFC 7766).
+#define DNS_SERVER_TCP_IDLE_TIMEOUT 10
+
+// Most reply bytes queued on a TCP connection that is not reading them.
+#define DNS_SERVER_TCP_MAX_BUFFERED (256 * 1024)
+
 struct dns_server_s;
 
+// An IPv4 or IPv6 socket address. Smaller than a sockaddr_storage, as one
+// is kept for every client waiting on a lookup.
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} dns_addr_t;
+
+// The address a datagram arrived on, which its reply is sent from. A
+// 'family' of 0 leaves the choice to the kernel.
+struct dns_local_addr {
+  int family;
+  int ifindex; // IPv6 only, for link local addresses.
+  union {
+    struct in_addr in;
+    struct in6_addr in6;
+  } addr;
+};
+
+// Internal: A datagram waiting in a receive or send batch.
+struct dns_server_msg {
+  dns_addr_t addr;
+  struct dns_local_addr local;
+  int len;
+  unsigned char buf[DNS_SERVER_MAX_MSG];
+};
+
+// Internal: A client TCP connection. Queries on it are pipelined, each
+// framed by a two byte length, and answered in completion order.
+struct dns_tcp_conn {
+  struct dns_server_s *d;
+  int fd; // -1 while the slot is free.
+  uint32_t gen; // Bumped on close, so late replies are dropped.
+  int eof; // The client has stopped sending.
+  int outstanding; // Queries handed out and not yet answered.
+  dns_addr_t addr;
+  ev_io read_watcher;
+  ev_io write_watcher;
+  ev_timer idle_timer;
+
+  uint8_t rbuf[2 + DNS_SERVER_TCP_MAX_QUERY];
+  int rlen;
+  uint8_t *wbuf; // Replies the socket did not take yet.
+  size_t wlen;
+  size_t wsize;
+};
+
+// Where a reply goes, copied by callers until they answer.
+typedef struct {
+  dns_addr_t addr;
+  struct dns_local_addr local; // UDP only.
+  int tcp;      // Slot of the TCP connection, -1 for UDP.
+  uint32_t gen; // Generation of that connection.
+  int edns;     // Whether the query carried an OPT record.
+  int max_size; // Largest reply the client accepts.
+  // The question name as sent, whose case replies keep.
+  uint8_t qname[DNS_MAX_NAME + 2];
+  int qnamelen;
+} dns_peer_t;
+
+// Called for every well-formed query. 'name' is lowercase dotted text, and
+// 'pkt' of 'len' bytes the query as received. All three are only valid
+// during the call.
 typedef void (*dns_req_received_cb)(struct dns_server_s *dns_server, void *data,
-                                    struct sockaddr_in addr, uint16_t tx_id,
-                                    uint16_t flags, const char *name, int type);
+                                    const dns_peer_t *peer, uint16_t tx_id,
+                                    uint16_t flags, const char *name, int type,
+                                    const uint8_t *pkt, int len);
 
 typedef struct dns_server_s {
   struct ev_loop *loop;
   int sock;
+  // Whether the socket is bound to a wildcard address, so replies must
+  // name the address their query arrived on (IP_PKTINFO).
+  int pktinfo;
   dns_req_received_cb cb;
   void *cb_data;
+  metrics_t *metrics;
 
   ev_io watcher;
+
+  // Replies queued during this loop iteration, flushed before the loop
+  // blocks again.
+  ev_prepare flush_watcher;
+  struct dns_server_msg out[DNS_SERVER_BATCH];
+  int num_out;
+  struct dns_server_msg in[DNS_SERVER_BATCH];
+
+  // TCP listener, -1 if disabled, and one slot per allowed connection.
+  int tcp_sock;
+  ev_io accept_watcher;
+  struct dns_tcp_conn *tcp_conns;
+  int max_tcp;
 } dns_server_t;
 
-void dns_server_init(dns_server_t *d, struct ev_loop *loop,
-                     const char *listen_addr, int listen_port,
+// Parses IPv4 or IPv6 'text' into 'addr' with 'port'. Returns 0 on success.
+int dns_server_parse_addr(const char *text, int port, dns_addr_t *addr);
+
+// Returns the length of 'addr' as passed to bind or sendto.
+socklen_t dns_server_addr_len(const dns_addr_t *addr);
+
+// Creates and binds a listening UDP socket for incoming requests.
+// 'reuse_port' lets several sockets share the address (SO_REUSEPORT).
+// IPv6 sockets are IPv6 only, so "::" and "0.0.0.0" may both be bound.
+int dns_server_listen(const char *listen_addr, int listen_port,
+                      int reuse_port);
+
+// Like dns_server_listen, for a non-blocking TCP socket.
+int dns_server_listen_tcp(const char *listen_addr, int listen_port,
+                          int reuse_port);
+
+// Serves requests arriving on 'sock', IPv4 or IPv6, and on connections
+// accepted from 'tcp_sock' unless it is -1, at most 'max_tcp' at a time.
+// The server takes ownership of both sockets. Queries received and dropped
+// are counted in 'metrics'.
+void dns_server_init(dns_server_t *d, struct ev_loop *loop, int sock,
+                     int tcp_sock, int max_tcp, metrics_t *metrics,
                      dns_req_received_cb cb, void *data);
 
-// Sends a DNS response 'buf' of length 'blen' to 'raddr'.
-void dns_server_respond(dns_server_t *d, struct sockaddr_in raddr, char *buf,
+// Sends a DNS response 'buf' of length 'blen' to 'peer', with its question
+// name spelled as in the query, patched in 'buf'. UDP responses
+// larger than the client accepts are truncated with the TC bit set.
+// Where sendmmsg is available UDP responses are queued and sent together
+// with the others produced in the same loop iteration.
+void dns_server_respond(dns_server_t *d, const dns_peer_t *peer, char *buf,
                         int blen);
 
+// Tells the server 'peer' gets no reply to its query, which is dropped.
+// A TCP connection then stops waiting for it before closing.
+void dns_server_release(dns_server_t *d, const dns_peer_t *peer);
+
+// Stops reading queries and accepting connections, leaving the sockets open
+// to another process sharing them. Replies can still be sent.
+void dns_server_stop(dns_server_t *d);
+
 void dns_server_cleanup(dns_server_t *d);
 
 #endif // _DNS_SERVER_H_
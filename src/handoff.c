@@ -0,0 +1,314 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handoff.h"
+#include "logging.h"
+
+// Seconds a new process waits for the old one to send its sockets.
+#define HANDOFF_TIMEOUT 5
+
+#define HANDOFF_MAGIC "HDNSHOFF"
+#define HANDOFF_VERSION 2
+
+// Sent along with the sockets.
+struct handoff_msg {
+  char magic[8];
+  uint32_t version;
+  int32_t count;
+};
+
+// What version 1 sent: the sockets were told apart by their position.
+struct handoff_msg_v1 {
+  char magic[8];
+  uint32_t version;
+  int32_t workers;
+  int32_t tcp;
+  int32_t stats;
+};
+
+static int handoff_addr(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int handoff_receive(const char *path, int *fds, int max, int *conn) {
+  *conn = -1;
+  struct sockaddr_un addr;
+  if (handoff_addr(path, &addr) < 0) {
+    ELOG("Handoff socket path '%s' is too long.", path);
+    return -1;
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    ELOG("Error creating handoff socket: %s", strerror(errno));
+    return -1;
+  }
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    int err = errno;
+    close(sock);
+    if (err == ENOENT || err == ECONNREFUSED) {
+      return 0; // Nobody to take over from.
+    }
+    ELOG("Error connecting to '%s': %s", path, strerror(err));
+    return -1;
+  }
+  struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // Big enough for either version.
+  union {
+    struct handoff_msg v2;
+    struct handoff_msg_v1 v1;
+  } msg;
+  memset(&msg, 0, sizeof(msg));
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { &msg, sizeof(msg) };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = sizeof(control.buf);
+  ssize_t r;
+  while ((r = recvmsg(sock, &mh, 0)) < 0 && errno == EINTR) {
+  }
+
+  int n = 0;
+  struct cmsghdr *cm;
+  for (cm = CMSG_FIRSTHDR(&mh); r > 0 && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+    if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+      n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cm), (n < max ? n : max) * sizeof(int));
+      break;
+    }
+  }
+  while (n > max) {
+    int extra;
+    memcpy(&extra, CMSG_DATA(cm) + --n * sizeof(int), sizeof(int));
+    close(extra);
+  }
+  int ok = 0;
+  if (r >= (ssize_t)sizeof(msg.v2) && !(mh.msg_flags & MSG_CTRUNC) &&
+      !memcmp(msg.v2.magic, HANDOFF_MAGIC, sizeof(msg.v2.magic))) {
+    if (msg.v2.version == HANDOFF_VERSION) {
+      ok = r == sizeof(msg.v2) && n == msg.v2.count;
+    } else if (msg.v1.version == 1) {
+      const struct handoff_msg_v1 *v1 = &msg.v1;
+      ok = r == sizeof(*v1) && v1->workers >= 0 &&
+           n == v1->workers * (v1->tcp ? 2 : 1) + (v1->stats ? 1 : 0);
+    }
+  }
+  if (!ok) {
+    ELOG("Bad handoff from '%s'.", path);
+    while (n > 0) {
+      close(fds[--n]);
+    }
+    close(sock);
+    return -1;
+  }
+  ILOG("Took over %d sockets from '%s'.", n, path);
+  *conn = sock;
+  return n;
+}
+
+// Whether 'a' and 'b' are the same IPv4 or IPv6 address and port.
+static int handoff_addr_equal(const struct sockaddr *a,
+                              const struct sockaddr *b) {
+  if (a->sa_family != b->sa_family) {
+    return 0;
+  }
+  if (a->sa_family == AF_INET) {
+    const struct sockaddr_in *x = (const struct sockaddr_in *)a;
+    const struct sockaddr_in *y = (const struct sockaddr_in *)b;
+    return x->sin_port == y->sin_port &&
+           x->sin_addr.s_addr == y->sin_addr.s_addr;
+  }
+  if (a->sa_family == AF_INET6) {
+    const struct sockaddr_in6 *x = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 *y = (const struct sockaddr_in6 *)b;
+    return x->sin6_port == y->sin6_port &&
+           !memcmp(&x->sin6_addr, &y->sin6_addr, sizeof(x->sin6_addr));
+  }
+  return 0;
+}
+
+int handoff_take(int *fds, int *n, int type, const struct sockaddr *addr) {
+  int i;
+  for (i = 0; i < *n; i++) {
+    struct sockaddr_storage bound;
+    socklen_t len = sizeof(bound);
+    int t;
+    socklen_t tlen = sizeof(t);
+    if (getsockopt(fds[i], SOL_SOCKET, SO_TYPE, &t, &tlen) == 0 &&
+        t == type &&
+        getsockname(fds[i], (struct sockaddr *)&bound, &len) == 0 &&
+        handoff_addr_equal((struct sockaddr *)&bound, addr)) {
+      int fd = fds[i];
+      fds[i] = fds[--*n];
+      return fd;
+    }
+  }
+  return -1;
+}
+
+void handoff_ready(int conn) {
+  char ready = 'R';
+  while (write(conn, &ready, 1) < 0 && errno == EINTR) {
+  }
+  close(conn);
+}
+
+int handoff_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (handoff_addr(path, &addr) < 0) {
+    FLOG("Handoff socket path '%s' is too long.", path);
+  }
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    FLOG("Error creating handoff socket");
+  }
+  // A process still bound there has served its handoff or is gone.
+  unlink(path);
+  if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    FLOG("Error binding handoff socket '%s'", path);
+  }
+  // Whoever connects gets the listening sockets.
+  chmod(path, S_IRUSR | S_IWUSR);
+  if (listen(sock, 4) < 0) {
+    FLOG("Error listening on handoff socket '%s'", path);
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  ILOG("Serving handoffs on '%s'", path);
+  return sock;
+}
+
+static void handoff_conn_close(handoff_server_t *s) {
+  ev_io_stop(s->loop, &s->conn_watcher);
+  close(s->conn);
+  s->conn = -1;
+}
+
+static void conn_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  handoff_server_t *s = (handoff_server_t *)w->data;
+  char ready;
+  ssize_t r = read(s->conn, &ready, 1);
+  if (r < 0 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+  handoff_conn_close(s);
+  if (r != 1) {
+    WLOG("The new process went away before taking over.");
+    return;
+  }
+  ILOG("Handed the listening sockets over.");
+  s->done = 1;
+  ev_io_stop(loop, &s->accept_watcher);
+  s->cb(s->cb_data);
+}
+
+static void accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  handoff_server_t *s = (handoff_server_t *)w->data;
+  int fd = accept(s->sock, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+  if (s->conn >= 0) {
+    WLOG("A handoff is already in progress, refusing another.");
+    close(fd);
+    return;
+  }
+  struct handoff_msg msg;
+  memset(&msg, 0, sizeof(msg));
+  memcpy(msg.magic, HANDOFF_MAGIC, sizeof(msg.magic));
+  msg.version = HANDOFF_VERSION;
+  msg.count = s->nfds;
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov = { &msg, sizeof(msg) };
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = control.buf;
+  mh.msg_controllen = CMSG_SPACE(sizeof(int) * s->nfds);
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int) * s->nfds);
+  memcpy(CMSG_DATA(cm), s->fds, sizeof(int) * s->nfds);
+  // The message is small and the socket local, so it goes out at once.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  ssize_t r;
+  while ((r = sendmsg(fd, &mh, 0)) < 0 && errno == EINTR) {
+  }
+  if (r != sizeof(msg)) {
+    WLOG("Failed to hand over the listening sockets: %s", strerror(errno));
+    close(fd);
+    return;
+  }
+  DLOG("Sent %d sockets, waiting for the new process to take over.",
+       s->nfds);
+  s->conn = fd;
+  ev_io_init(&s->conn_watcher, conn_cb, fd, EV_READ);
+  s->conn_watcher.data = s;
+  ev_io_start(loop, &s->conn_watcher);
+}
+
+void handoff_server_init(handoff_server_t *s, struct ev_loop *loop, int sock,
+                         const char *path, const int *fds, int nfds,
+                         handoff_done_cb cb, void *data) {
+  memset(s, 0, sizeof(*s));
+  s->loop = loop;
+  s->sock = sock;
+  snprintf(s->path, sizeof(s->path), "%s", path);
+  s->conn = -1;
+  s->nfds = nfds;
+  if (s->nfds > HANDOFF_MAX_FDS) {
+    WLOG("Too many sockets to hand over, handoffs are disabled.");
+    s->nfds = 0;
+    return;
+  }
+  memcpy(s->fds, fds, sizeof(int) * s->nfds);
+  s->cb = cb;
+  s->cb_data = data;
+  ev_io_init(&s->accept_watcher, accept_cb, sock, EV_READ);
+  s->accept_watcher.data = s;
+  ev_io_start(loop, &s->accept_watcher);
+}
+
+void handoff_server_cleanup(handoff_server_t *s) {
+  ev_io_stop(s->loop, &s->accept_watcher);
+  if (s->conn >= 0) {
+    handoff_conn_close(s);
+  }
+  close(s->sock);
+  // After a handoff the path belongs to the new process.
+  if (!s->done) {
+    unlink(s->path);
+  }
+}
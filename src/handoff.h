@@ -0,0 +1,67 @@
+// Hands the listening sockets of a running proxy to a newer one over a UNIX
+// socket (SCM_RIGHTS), so a binary upgrade loses no queries. Both processes
+// read the same sockets until the new one is serving; the old one then
+// stops reading, finishes its lookups and exits. The new process tells the
+// sockets apart by what they are bound to, so it may listen on more or
+// fewer addresses, or run more or fewer workers, than the old one.
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include <sys/socket.h>
+
+#include <ev.h>
+
+// Most sockets passed in one handoff, within the kernel's SCM_MAX_FD.
+#define HANDOFF_MAX_FDS 128
+
+typedef void (*handoff_done_cb)(void *data);
+
+typedef struct {
+  struct ev_loop *loop;
+  int sock;
+  char path[108]; // sizeof(sockaddr_un.sun_path)
+  ev_io accept_watcher;
+  // The process taking over, -1 if none. Writes a byte once it serves.
+  int conn;
+  ev_io conn_watcher;
+  int fds[HANDOFF_MAX_FDS];
+  int nfds;
+  handoff_done_cb cb;
+  void *cb_data;
+  int done;
+} handoff_server_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Connects to a process serving handoffs on 'path' and receives its
+// sockets into 'fds'. Returns their number, 0 if no process is listening
+// there, or -1 on failure. '*conn' is left open for handoff_ready.
+int handoff_receive(const char *path, int *fds, int max, int *conn);
+
+// Returns one of the '*n' sockets in 'fds' of 'type' (e.g. SOCK_DGRAM)
+// bound to 'addr' and removes it from them, or returns -1 if none is.
+int handoff_take(int *fds, int *n, int type, const struct sockaddr *addr);
+
+// Tells the old process the sockets are in use, so it may stop.
+void handoff_ready(int conn);
+
+// Creates the UNIX socket at 'path', replacing any earlier one, and
+// listens on it.
+int handoff_listen(const char *path);
+
+// Passes the 'nfds' sockets in 'fds' to each process connecting to 'sock',
+// and calls 'cb' once one of them has taken over. The server takes
+// ownership of 'sock', not of the sockets passed.
+void handoff_server_init(handoff_server_t *s, struct ev_loop *loop, int sock,
+                         const char *path, const int *fds, int nfds,
+                         handoff_done_cb cb, void *data);
+
+// Closes the socket, and removes it from the file system unless a newer
+// process has taken it over.
+void handoff_server_cleanup(handoff_server_t *s);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HANDOFF_H_
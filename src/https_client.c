@@ -22,13 +22,30 @@
 
 static size_t write_buffer(void *buf, size_t size, size_t nmemb, void *userp) {
   struct https_fetch_ctx *ctx = (struct https_fetch_ctx *)userp;
-  unsigned char *new_buf = (unsigned char *)realloc(
-      ctx->buf, ctx->buflen + size * nmemb + 1);
-  if (new_buf == NULL) {
-    ELOG("Out of memory!");
-    return 0;
+  if (ctx->body_cb) {
+    // Error pages are skipped, the transfer fails on its status anyway.
+    long http_code = 0;
+    curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (http_code == 200 && ctx->body_cb(ctx->cb_data, buf, size * nmemb)) {
+      return 0;
+    }
+    return size * nmemb;
+  }
+  size_t need = ctx->buflen + size * nmemb + 1;
+  if (need > ctx->bufsize) {
+    size_t new_size = ctx->bufsize * 2 > need ? ctx->bufsize * 2 : need;
+    unsigned char *new_buf = (unsigned char *)malloc(new_size);
+    if (new_buf == NULL) {
+      ELOG("Out of memory!");
+      return 0;
+    }
+    memcpy(new_buf, ctx->buf, ctx->buflen);
+    if (ctx->buf != ctx->inline_buf) {
+      free(ctx->buf);
+    }
+    ctx->buf = new_buf;
+    ctx->bufsize = new_size;
   }
-  ctx->buf = new_buf;
   memcpy(&(ctx->buf[ctx->buflen]), buf, size * nmemb);
   ctx->buflen += size * nmemb;
   // We always expect to receive valid non-null ASCII but just to be safe...
@@ -36,153 +53,239 @@ static size_t write_buffer(void *buf, size_t size, size_t nmemb, void *userp) {
   return size * nmemb;
 }
 
+// Creates an easy handle with every option that does not vary per transfer.
+static CURL *https_handle_new(https_client_t *client) {
+  CURL *curl = curl_easy_init();
+  if (!curl) {
+    FLOG("curl_easy_init failed");
+  }
+
+  DLOG("Requesting HTTP/1.1: %d", client->opt->use_http_1_1);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+                   client->opt->use_http_1_1 ?
+                   CURL_HTTP_VERSION_1_1 :
+                   CURL_HTTP_VERSION_2_0);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &write_buffer);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 5L);
+  // Wait for a multiplexed connection rather than opening one per stream.
+  // Only DoH endpoints are known to speak HTTP/2.
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT,
+                   client->opt->doh && !client->opt->use_http_1_1 ? 1L : 0L);
+  // curl_easy_setopt(curl, CURLOPT_USERAGENT, "dns-to-https-proxy/0.2");
+  // Signals cannot be used to time out name resolution across threads.
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, client->opt->workers > 1 ? 1L : 0L);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 2L /* seconds */);
+  curl_easy_setopt(curl, CURLOPT_SERVER_RESPONSE_TIMEOUT, 2L /* seconds */);
+
+  if (client->opt->curl_proxy) {
+    DLOG("Using curl proxy: %s", client->opt->curl_proxy);
+    CURLcode res;
+    if ((res = curl_easy_setopt(curl, CURLOPT_PROXY,
+                                client->opt->curl_proxy)) != CURLE_OK) {
+      FLOG("CURLOPT_PROXY error: %s", curl_easy_strerror(res));
+    }
+  }
+  return curl;
+}
+
+// Takes a configured handle from the pool, creating one if it is empty.
+static CURL *https_handle_get(https_client_t *client) {
+  if (client->num_idle > 0) {
+    return client->idle[--client->num_idle];
+  }
+  return https_handle_new(client);
+}
+
+// Returns a handle to the pool, keeping its DNS cache and TLS sessions.
+static void https_handle_put(https_client_t *client, CURL *curl,
+                             unsigned int generation) {
+  if (generation == client->generation &&
+      client->num_idle < HTTPS_CLIENT_POOL_SIZE) {
+    // Its context is freed, see https_awaits_body.
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, NULL);
+    client->idle[client->num_idle++] = curl;
+  } else {
+    curl_easy_cleanup(curl);
+  }
+}
+
 static void https_fetch_ctx_init(https_client_t *client,
                                  struct https_fetch_ctx *ctx, const char *url,
-                                 struct curl_slist *resolv,
-                                 https_response_cb cb, void *cb_data) {
-  ctx->curl = curl_easy_init();
+                                 struct https_resolv *resolv, int fresh,
+                                 const uint8_t *post, size_t postlen,
+                                 https_body_cb body_cb, https_response_cb cb,
+                                 void *cb_data) {
+  ctx->curl = https_handle_get(client);
+  ctx->resolv = resolv;
+  if (resolv) {
+    resolv->refs++;
+  }
+  ctx->generation = client->generation;
   ctx->cb = cb;
+  ctx->body_cb = body_cb;
   ctx->cb_data = cb_data;
-  ctx->buf = NULL;
+  ctx->buf = ctx->inline_buf;
   ctx->buflen = 0;
+  ctx->bufsize = sizeof(ctx->inline_buf);
+  ctx->buf[0] = '\0';
+  // Overwritten when the transfer completes.
+  ctx->result = CURLE_ABORTED_BY_CALLBACK;
+  ctx->prev = NULL;
   ctx->next = client->fetches;
+  if (ctx->next) {
+    ctx->next->prev = ctx;
+  }
   client->fetches = ctx;
 
   CURLcode res;
-  if ((res = curl_easy_setopt(ctx->curl, CURLOPT_RESOLVE, resolv)) !=
+  if ((res = curl_easy_setopt(ctx->curl, CURLOPT_RESOLVE,
+                              resolv ? resolv->list : NULL)) !=
       CURLE_OK) {
     FLOG("CURLOPT_RESOLV error: %s", curl_easy_strerror(res));
   }
-
-  DLOG("Requesting HTTP/1.1: %d", client->opt->use_http_1_1);
-  curl_easy_setopt(ctx->curl, CURLOPT_HTTP_VERSION,
-                   client->opt->use_http_1_1 ?
-                   CURL_HTTP_VERSION_1_1 :
-                   CURL_HTTP_VERSION_2_0);
   curl_easy_setopt(ctx->curl, CURLOPT_URL, url);
-  curl_easy_setopt(ctx->curl, CURLOPT_WRITEFUNCTION, &write_buffer);
+  curl_easy_setopt(ctx->curl, CURLOPT_FRESH_CONNECT, fresh ? 1L : 0L);
+  // Handles are reused, so every transfer sets its method afresh.
+  if (!cb) {
+    // Only warm-up requests go without a callback. They are HEAD requests.
+    curl_easy_setopt(ctx->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(ctx->curl, CURLOPT_NOBODY, 1L);
+  } else if (post) {
+    curl_easy_setopt(ctx->curl, CURLOPT_HTTPHEADER, client->doh_headers);
+    curl_easy_setopt(ctx->curl, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDSIZE, (long)postlen);
+    curl_easy_setopt(ctx->curl, CURLOPT_POSTFIELDS, post);
+  } else {
+    curl_easy_setopt(ctx->curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(ctx->curl, CURLOPT_HTTPGET, 1L);
+  }
   curl_easy_setopt(ctx->curl, CURLOPT_WRITEDATA, ctx);
-  curl_easy_setopt(ctx->curl, CURLOPT_TCP_KEEPALIVE, 5L);
-  // curl_easy_setopt(ctx->curl, CURLOPT_USERAGENT, "dns-to-https-proxy/0.2");
-  curl_easy_setopt(ctx->curl, CURLOPT_NOSIGNAL, 0);
-  curl_easy_setopt(ctx->curl, CURLOPT_TIMEOUT, 2 /* seconds */);
-  curl_easy_setopt(ctx->curl, CURLOPT_SERVER_RESPONSE_TIMEOUT, 2 /* seconds */);
+  curl_easy_setopt(ctx->curl, CURLOPT_PRIVATE, ctx);
+  curl_multi_add_handle(client->curlm, ctx->curl);
+}
 
-  if (client->opt->curl_proxy) {
-    DLOG("Using curl proxy: %s", client->opt->curl_proxy);
-    if ((res = curl_easy_setopt(ctx->curl, CURLOPT_PROXY,
-                                client->opt->curl_proxy)) != CURLE_OK) {
-      FLOG("CURLOPT_PROXY error: %s", curl_easy_strerror(res));
-    }
+static void https_fetch_ctx_unlink(https_client_t *client,
+                                   struct https_fetch_ctx *ctx) {
+  if (ctx->prev) {
+    ctx->prev->next = ctx->next;
+  } else {
+    client->fetches = ctx->next;
   }
-  curl_multi_add_handle(client->curlm, ctx->curl);
+  if (ctx->next) {
+    ctx->next->prev = ctx->prev;
+  }
+  curl_multi_remove_handle(client->curlm, ctx->curl);
+  https_resolv_release(ctx->resolv);
+  ctx->resolv = NULL;
 }
 
 static void https_fetch_ctx_cleanup(https_client_t *client,
                                     struct https_fetch_ctx *ctx) {
-  struct https_fetch_ctx *last = NULL;
-  struct https_fetch_ctx *cur = client->fetches;
-  while (cur) {
-    if (cur == ctx) {
-      curl_multi_remove_handle(client->curlm, ctx->curl);
-      if (client->opt->loglevel <= LOG_DEBUG) {
-        CURLcode res;
-        long long_resp = 0;
-        char *str_resp = NULL;
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_EFFECTIVE_URL, &str_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_EFFECTIVE_URL: %s", curl_easy_strerror(res));
-        } else {
-          DLOG("CURLINFO_EFFECTIVE_URL: %s", str_resp);
-        }
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_REDIRECT_URL, &str_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_REDIRECT_URL: %s", curl_easy_strerror(res));
-        } else if (str_resp != NULL) {
-          DLOG("CURLINFO_REDIRECT_URL: %s", str_resp);
-        }
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_RESPONSE_CODE, &long_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_RESPONSE_CODE: %s", curl_easy_strerror(res));
-        } else if (long_resp != 200) {
-          DLOG("CURLINFO_RESPONSE_CODE: %d", long_resp);
-        }
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_SSL_VERIFYRESULT, &long_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_SSL_VERIFYRESULT: %s", curl_easy_strerror(res));
-        } else if (long_resp != CURLE_OK) {
-          ELOG("CURLINFO_SSL_VERIFYRESULT: %s", curl_easy_strerror(long_resp));
-        }
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_OS_ERRNO, &long_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_OS_ERRNO: %s", curl_easy_strerror(res));
-        } else if (long_resp != 0) {
-          ELOG("CURLINFO_OS_ERRNO: %d", long_resp);
-        }
+  // Unlink first, so the callback may start or cancel other fetches.
+  https_fetch_ctx_unlink(client, ctx);
+  if (client->opt->loglevel <= LOG_DEBUG) {
+    CURLcode res;
+    long long_resp = 0;
+    char *str_resp = NULL;
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_EFFECTIVE_URL, &str_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_EFFECTIVE_URL: %s", curl_easy_strerror(res));
+    } else {
+      DLOG("CURLINFO_EFFECTIVE_URL: %s", str_resp);
+    }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_REDIRECT_URL, &str_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_REDIRECT_URL: %s", curl_easy_strerror(res));
+    } else if (str_resp != NULL) {
+      DLOG("CURLINFO_REDIRECT_URL: %s", str_resp);
+    }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_RESPONSE_CODE, &long_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_RESPONSE_CODE: %s", curl_easy_strerror(res));
+    } else if (long_resp != 200) {
+      DLOG("CURLINFO_RESPONSE_CODE: %ld", long_resp);
+    }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_SSL_VERIFYRESULT, &long_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_SSL_VERIFYRESULT: %s", curl_easy_strerror(res));
+    } else if (long_resp != CURLE_OK) {
+      ELOG("CURLINFO_SSL_VERIFYRESULT: %s", curl_easy_strerror(long_resp));
+    }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_OS_ERRNO, &long_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_OS_ERRNO: %s", curl_easy_strerror(res));
+    } else if (long_resp != 0) {
+      ELOG("CURLINFO_OS_ERRNO: %ld", long_resp);
+    }
 #ifdef CURLINFO_HTTP_VERSION
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_HTTP_VERSION, &long_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_HTTP_VERSION: %s", curl_easy_strerror(res));
-        } else {
-          switch (long_resp) {
-            case CURL_HTTP_VERSION_1_0:
-              DLOG("CURLINFO_HTTP_VERSION: %s", "1.0");
-              break;
-            case CURL_HTTP_VERSION_1_1:
-              DLOG("CURLINFO_HTTP_VERSION: %s", "1.1");
-              break;
-            case CURL_HTTP_VERSION_2_0:
-              DLOG("CURLINFO_HTTP_VERSION: %s", "2");
-              break;
-            default:
-              DLOG("CURLINFO_HTTP_VERSION: %d", long_resp);
-          }
-        }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_HTTP_VERSION, &long_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_HTTP_VERSION: %s", curl_easy_strerror(res));
+    } else {
+      switch (long_resp) {
+        case CURL_HTTP_VERSION_1_0:
+          DLOG("CURLINFO_HTTP_VERSION: %s", "1.0");
+          break;
+        case CURL_HTTP_VERSION_1_1:
+          DLOG("CURLINFO_HTTP_VERSION: %s", "1.1");
+          break;
+        case CURL_HTTP_VERSION_2_0:
+          DLOG("CURLINFO_HTTP_VERSION: %s", "2");
+          break;
+        default:
+          DLOG("CURLINFO_HTTP_VERSION: %d", long_resp);
+      }
+    }
 #endif
 #ifdef CURLINFO_PROTOCOL
-        if ((res = curl_easy_getinfo(
-                ctx->curl, CURLINFO_PROTOCOL, &long_resp)) != CURLE_OK) {
-          ELOG("CURLINFO_PROTOCOL: %s", curl_easy_strerror(res));
-        } else if (long_resp != CURLPROTO_HTTPS) {
-          DLOG("CURLINFO_PROTOCOL: %d", long_resp);
-        }
+    if ((res = curl_easy_getinfo(
+            ctx->curl, CURLINFO_PROTOCOL, &long_resp)) != CURLE_OK) {
+      ELOG("CURLINFO_PROTOCOL: %s", curl_easy_strerror(res));
+    } else if (long_resp != CURLPROTO_HTTPS) {
+      DLOG("CURLINFO_PROTOCOL: %d", long_resp);
+    }
 #endif
+  }
 
-        double namelookup_time, connect_time, appconnect_time, pretransfer_time;
-        double starttransfer_time, total_time;
-        if (curl_easy_getinfo(ctx->curl,
-                              CURLINFO_NAMELOOKUP_TIME, &namelookup_time) != CURLE_OK ||
-            curl_easy_getinfo(ctx->curl,
-                              CURLINFO_CONNECT_TIME, &connect_time) != CURLE_OK ||
-            curl_easy_getinfo(ctx->curl,
-                              CURLINFO_APPCONNECT_TIME, &appconnect_time) != CURLE_OK ||
-            curl_easy_getinfo(ctx->curl,
-                              CURLINFO_PRETRANSFER_TIME, &pretransfer_time) != CURLE_OK ||
-            curl_easy_getinfo(ctx->curl,
-                              CURLINFO_STARTTRANSFER_TIME, &starttransfer_time) != CURLE_OK ||
-            curl_easy_getinfo(ctx->curl,
-                              CURLINFO_TOTAL_TIME, &total_time) != CURLE_OK) {
-          ELOG("Err getting timing");
-        } else {
-          DLOG("Times: %lf, %lf, %lf, %lf, %lf, %lf",
-               namelookup_time, connect_time, appconnect_time, pretransfer_time,
-               starttransfer_time, total_time);
-        }
-
-      }
-      curl_easy_cleanup(ctx->curl);
-      ctx->cb(ctx->cb_data, ctx->buf, ctx->buflen);
-      free(ctx->buf);
+  // Always collected: callers use them to rank upstreams.
+  struct https_fetch_times times;
+  memset(&times, 0, sizeof(times));
+  if (curl_easy_getinfo(ctx->curl, CURLINFO_NAMELOOKUP_TIME,
+                        &times.namelookup) != CURLE_OK ||
+      curl_easy_getinfo(ctx->curl, CURLINFO_CONNECT_TIME,
+                        &times.connect) != CURLE_OK ||
+      curl_easy_getinfo(ctx->curl, CURLINFO_APPCONNECT_TIME,
+                        &times.appconnect) != CURLE_OK ||
+      curl_easy_getinfo(ctx->curl, CURLINFO_PRETRANSFER_TIME,
+                        &times.pretransfer) != CURLE_OK ||
+      curl_easy_getinfo(ctx->curl, CURLINFO_STARTTRANSFER_TIME,
+                        &times.starttransfer) != CURLE_OK ||
+      curl_easy_getinfo(ctx->curl, CURLINFO_TOTAL_TIME,
+                        &times.total) != CURLE_OK) {
+    ELOG("Err getting timing");
+  } else {
+    DLOG("Times: %lf, %lf, %lf, %lf, %lf, %lf",
+         times.namelookup, times.connect, times.appconnect, times.pretransfer,
+         times.starttransfer, times.total);
+  }
 
-      if (last) {
-        last->next = cur->next;
-      } else {
-        client->fetches = cur->next;
-      }
-      return;
-    }
-    last = cur;
-    cur = cur->next;
+  long http_code = 0;
+  if (ctx->result == CURLE_OK) {
+    curl_easy_getinfo(ctx->curl, CURLINFO_RESPONSE_CODE, &http_code);
+  }
+  https_handle_put(client, ctx->curl, ctx->generation);
+  if (!ctx->cb) {
+    DLOG("Warm-up finished: %s, HTTP %ld", curl_easy_strerror(ctx->result),
+         http_code);
+  } else if (ctx->result != CURLE_OK || http_code != 200) {
+    DLOG("Transfer failed: %s, HTTP %ld", curl_easy_strerror(ctx->result),
+         http_code);
+    ctx->cb(ctx->cb_data, NULL, 0, &times);
+  } else {
+    ctx->cb(ctx->cb_data, ctx->buf, ctx->buflen, &times);
+  }
+  if (ctx->buf != ctx->inline_buf) {
+    free(ctx->buf);
   }
 }
 
@@ -191,15 +294,14 @@ static void check_multi_info(https_client_t *c) {
   int msgs_left;
   while ((msg = curl_multi_info_read(c->curlm, &msgs_left))) {
     if (msg->msg == CURLMSG_DONE) {
-      struct https_fetch_ctx *n = c->fetches;
-      while (n) {
-        if (n->curl == msg->easy_handle) {
-          https_fetch_ctx_cleanup(c, n);
-          free(n);
-          break;
-        }
-        n = n->next;
+      struct https_fetch_ctx *n = NULL;
+      if (curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&n) !=
+              CURLE_OK || n == NULL) {
+        FLOG("Finished transfer without context.");
       }
+      n->result = msg->data.result;
+      https_fetch_ctx_cleanup(c, n);
+      obj_pool_free(&c->fetch_pool, n);
     }
   }
 }
@@ -229,108 +331,228 @@ static void timer_cb(struct ev_loop *loop, struct ev_timer *w, int revents) {
   check_multi_info(c);
 }
 
+static void https_fd_watcher_unlink(https_client_t *c,
+                                    struct https_fd_watcher *fdw) {
+  if (fdw->prev) {
+    fdw->prev->next = fdw->next;
+  } else {
+    c->fd_watchers = fdw->next;
+  }
+  if (fdw->next) {
+    fdw->next->prev = fdw->prev;
+  }
+}
+
+#ifndef NO_LIBCURL_BUG_WORKAROUND
+// Whether 'curl' is a transfer in flight that sent a request and reads a
+// body. Sockets of warm-up HEAD requests, and of any transfer that failed
+// to connect, close unread without saying anything about libcurl.
+static int https_awaits_body(CURL *curl) {
+  struct https_fetch_ctx *ctx = NULL;
+  double pretransfer = 0;
+  if (curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&ctx) != CURLE_OK ||
+      ctx == NULL || ctx->cb == NULL) {
+    return 0;
+  }
+  return curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &pretransfer) ==
+             CURLE_OK && pretransfer > 0;
+}
+#endif
+
 static int multi_sock_cb(CURL *curl, curl_socket_t sock, int what,
                          https_client_t *c, void *sockp) {
 #ifndef NO_LIBCURL_BUG_WORKAROUND
-  static int curl_bug = -1;
-  if (curl_bug == -1) {
+  if (c->curl_bug == -1 && https_awaits_body(curl)) {
     if (what == CURL_POLL_IN) {
-      curl_bug = 0;
+      c->curl_bug = 0;
     } else if (what == CURL_POLL_REMOVE) {
       ELOG("libcurl bug detected: socket closed without ever being read.");
       ELOG("Activating workaround.  PERFORMANCE WILL BE GREATLY DEGRADED!");
-      curl_bug = 1;
+      c->curl_bug = 1;
     }
   }
-  if (curl_bug == 1 && what == CURL_POLL_REMOVE && c != NULL) {
+  if (c->curl_bug == 1 && what == CURL_POLL_REMOVE) {
+    // Newer libcurl refuses calls from inside this callback
+    // (CURLM_RECURSIVE_API_CALL), which used to spin here forever.
     do {
-      curl_multi_perform(c->curlm, &c->still_running);
+      if (curl_multi_perform(c->curlm, &c->still_running) != CURLM_OK) {
+        break;
+      }
     } while (c->still_running != 0);
   }
 #endif
+  struct https_fd_watcher *fdw = (struct https_fd_watcher *)sockp;
   if (what == CURL_POLL_REMOVE) {
-    ev_io_stop(c->loop, &c->fd[sock]);
-    c->fd[sock].fd = 0;
+    if (fdw) {
+      ev_io_stop(c->loop, &fdw->watcher);
+      https_fd_watcher_unlink(c, fdw);
+      obj_pool_free(&c->fd_pool, fdw);
+      curl_multi_assign(c->curlm, sock, NULL);
+    }
     return 0;
-  } 
-  if (c->fd[sock].fd) {
-    ev_io_stop(c->loop, &c->fd[sock]);
   }
-  ev_io_init(&c->fd[sock], sock_cb, sock,
+  if (fdw) {
+    ev_io_stop(c->loop, &fdw->watcher);
+  } else {
+    fdw = (struct https_fd_watcher *)obj_pool_alloc(&c->fd_pool);
+    fdw->next = c->fd_watchers;
+    if (fdw->next) {
+      fdw->next->prev = fdw;
+    }
+    c->fd_watchers = fdw;
+    curl_multi_assign(c->curlm, sock, fdw);
+  }
+  ev_io_init(&fdw->watcher, sock_cb, sock,
              ((what & CURL_POLL_IN) ? EV_READ : 0) |
                  ((what & CURL_POLL_OUT) ? EV_WRITE : 0));
-  c->fd[sock].data = c;
-  ev_io_start(c->loop, &c->fd[sock]);
+  fdw->watcher.data = c;
+  ev_io_start(c->loop, &fdw->watcher);
   return 0;
 }
 
 static int multi_timer_cb(CURLM *multi, long timeout_ms, https_client_t *c) {
   ev_timer_stop(c->loop, &c->timer);
-  if (timeout_ms > 0) {
+  if (timeout_ms >= 0) {
+    // libcurl forbids calling curl_multi_socket_action from inside this
+    // callback, so even an immediate timeout goes through the event loop.
     ev_timer_init(&c->timer, timer_cb, timeout_ms / 1000.0, 0);
     ev_timer_start(c->loop, &c->timer);
-  } else {
-    timer_cb(c->loop, &c->timer, 0);
   }
   return 0;
 }
 
-void https_client_init(https_client_t *c, options_t *opt, struct ev_loop *loop) {
-  int i = 0;
+// Applies the options of the multi handle that may change at runtime.
+static void https_multi_setopts(https_client_t *c) {
+#if defined(CURLMOPT_PIPELINING) && defined(CURLPIPE_HTTP1) && \
+  defined(CURLPIPE_MULTIPLEX)
+  if (c->opt->use_http_1_1) {
+    curl_multi_setopt(c->curlm, CURLMOPT_PIPELINING, CURLPIPE_HTTP1);
+  } else {
+    curl_multi_setopt(c->curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  }
+#endif
+  curl_multi_setopt(c->curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                    (long)c->opt->max_total_connections);
+  curl_multi_setopt(c->curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    (long)c->opt->max_host_connections);
+  curl_multi_setopt(c->curlm, CURLMOPT_MAXCONNECTS,
+                    (long)c->opt->max_idle_connections);
+}
+
+struct https_resolv *https_resolv_new(struct curl_slist *list) {
+  struct https_resolv *r = (struct https_resolv *)malloc(sizeof(*r));
+  if (!r) {
+    curl_slist_free_all(list);
+    return NULL;
+  }
+  r->list = list;
+  r->refs = 1;
+  return r;
+}
 
+void https_resolv_release(struct https_resolv *r) {
+  if (r && --r->refs == 0) {
+    curl_slist_free_all(r->list);
+    free(r);
+  }
+}
+
+void https_client_init(https_client_t *c, options_t *opt, struct ev_loop *loop) {
   memset(c, 0, sizeof(*c));
   c->loop = loop;
   c->curlm = curl_multi_init();
   c->fetches = NULL;
+  c->curl_bug = -1;
+  obj_pool_init(&c->fetch_pool, sizeof(struct https_fetch_ctx), 32);
   c->timer.data = c;
 
-  for (i = 0; i < FD_SETSIZE; i++) {
-    c->fd[i].fd = 0;
-  }
+  c->fd_watchers = NULL;
+  obj_pool_init(&c->fd_pool, sizeof(struct https_fd_watcher), 8);
 
   c->opt = opt;
+  c->doh_headers = curl_slist_append(NULL,
+                                     "Content-Type: application/dns-message");
+  c->doh_headers = curl_slist_append(c->doh_headers,
+                                     "Accept: application/dns-message");
 
-#if defined(CURLMOPT_PIPELINING) && defined(CURLPIPE_HTTP1) && \
-  defined(CURLPIPE_MULTIPLEX)
-  if (c->opt->use_http_1_1) {
-    curl_multi_setopt(c->curlm, CURLMOPT_PIPELINING, CURLPIPE_HTTP1);
-  } else {
-    curl_multi_setopt(c->curlm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
-  }
-#endif
-  curl_multi_setopt(c->curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS, 8);
-  curl_multi_setopt(c->curlm, CURLMOPT_MAXCONNECTS, 8);
+  https_multi_setopts(c);
   curl_multi_setopt(c->curlm, CURLMOPT_SOCKETDATA, c);
   curl_multi_setopt(c->curlm, CURLMOPT_SOCKETFUNCTION, multi_sock_cb);
   curl_multi_setopt(c->curlm, CURLMOPT_TIMERDATA, c);
   curl_multi_setopt(c->curlm, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
 }
 
-void https_client_fetch(https_client_t *c, const char *url,
-                        struct curl_slist *resolv, https_response_cb cb,
-                        void *data) {
+void https_client_reconfigure(https_client_t *c, options_t *opt) {
+  c->opt = opt;
+  https_multi_setopts(c);
+  // Idle handles carry the old proxy and HTTP version. Connections live in
+  // the multi handle, so dropping them costs no handshakes.
+  while (c->num_idle > 0) {
+    curl_easy_cleanup(c->idle[--c->num_idle]);
+  }
+  c->generation++;
+}
+
+struct https_fetch_ctx *https_client_fetch(https_client_t *c, const char *url,
+                                           struct https_resolv *resolv,
+                                           int fresh, https_body_cb body_cb,
+                                           https_response_cb cb, void *data) {
+  struct https_fetch_ctx *new_ctx =
+      (struct https_fetch_ctx *)obj_pool_alloc(&c->fetch_pool);
+  https_fetch_ctx_init(c, new_ctx, url, resolv, fresh, NULL, 0, body_cb, cb,
+                       data);
+  return new_ctx;
+}
+
+struct https_fetch_ctx *https_client_post(https_client_t *c, const char *url,
+                                          struct https_resolv *resolv,
+                                          int fresh, const uint8_t *body,
+                                          size_t bodylen, https_response_cb cb,
+                                          void *data) {
   struct https_fetch_ctx *new_ctx =
-      (struct https_fetch_ctx *)calloc(1, sizeof(struct https_fetch_ctx));
-  if (!new_ctx) {
-    FLOG("Out of mem");
+      (struct https_fetch_ctx *)obj_pool_alloc(&c->fetch_pool);
+  https_fetch_ctx_init(c, new_ctx, url, resolv, fresh, body, bodylen, NULL,
+                       cb, data);
+  return new_ctx;
+}
+
+void https_client_cancel(https_client_t *c, struct https_fetch_ctx *ctx) {
+  // Removing the handle also drops a completion libcurl may have queued.
+  https_fetch_ctx_unlink(c, ctx);
+  https_handle_put(c, ctx->curl, ctx->generation);
+  if (ctx->buf != ctx->inline_buf) {
+    free(ctx->buf);
   }
-  https_fetch_ctx_init(c, new_ctx, url, resolv, cb, data);
+  obj_pool_free(&c->fetch_pool, ctx);
 }
 
-void https_client_cleanup(https_client_t *c) {
-  int i;
+void https_client_warm(https_client_t *c, const char *url,
+                       struct https_resolv *resolv) {
+  DLOG("Warming up connection to %s", url);
+  struct https_fetch_ctx *new_ctx =
+      (struct https_fetch_ctx *)obj_pool_alloc(&c->fetch_pool);
+  https_fetch_ctx_init(c, new_ctx, url, resolv, 0, NULL, 0, NULL, NULL,
+                       NULL);
+}
 
+void https_client_cleanup(https_client_t *c) {
+  // Failing them instead would have their owners reply, retry and report
+  // the upstream down while everything is being torn down.
   while (c->fetches) {
-    struct https_fetch_ctx *n = c->fetches;
-    https_fetch_ctx_cleanup(c, n);
-    free(n);
+    https_client_cancel(c, c->fetches);
   }
 
-  for (i = 0; i < FD_SETSIZE; i++) {
-    if (c->fd[i].fd) {
-      ev_io_stop(c->loop, &c->fd[i]);
-    }
+  while (c->fd_watchers) {
+    struct https_fd_watcher *fdw = c->fd_watchers;
+    ev_io_stop(c->loop, &fdw->watcher);
+    https_fd_watcher_unlink(c, fdw);
+  }
+  while (c->num_idle > 0) {
+    curl_easy_cleanup(c->idle[--c->num_idle]);
   }
   ev_timer_stop(c->loop, &c->timer);
   curl_multi_cleanup(c->curlm);
+  curl_slist_free_all(c->doh_headers);
+  obj_pool_cleanup(&c->fetch_pool);
+  obj_pool_cleanup(&c->fd_pool);
 }
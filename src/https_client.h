@@ -6,26 +6,71 @@
 #include <ev.h>
 #include <stdint.h>
 
+#include "obj_pool.h"
 #include "options.h"
 
+// Maximum number of idle easy handles kept around for reuse.
+#define HTTPS_CLIENT_POOL_SIZE 64
+
+// Response bodies up to this size never touch the heap.
+#define HTTPS_INLINE_BUF_SIZE 512
+
+// Timing of a finished transfer in seconds, as reported by libcurl.
+struct https_fetch_times {
+  double namelookup;
+  double connect;
+  double appconnect;
+  double pretransfer;
+  double starttransfer;
+  double total;
+};
+
 // Callback type for receiving data when a transfer finishes.
-typedef void (*https_response_cb)(void *data, uint8_t *buf, uint32_t buflen);
+// 'buf' is NULL if the transfer failed, and never NULL on success, even for
+// an empty body.
+typedef void (*https_response_cb)(void *data, uint8_t *buf, uint32_t buflen,
+                                  const struct https_fetch_times *times);
+
+// Callback type for consuming the body of a successful response piece by
+// piece as it arrives, instead of having it collected. Returns 0 to go on,
+// or -1 to fail the transfer.
+typedef int (*https_body_cb)(void *data, const uint8_t *buf, size_t len);
+
+// Lines for CURLOPT_RESOLVE shared by the transfers handed them. libcurl
+// reads them only once a transfer starts, so a list replaced meanwhile is
+// freed when the last transfer holding it ends.
+struct https_resolv {
+  struct curl_slist *list;
+  int refs;
+};
 
 // Internal: Holds state on an individual transfer.
 struct https_fetch_ctx {
   CURL *curl;
+  struct https_resolv *resolv; // Held until the transfer ends, or NULL.
   https_response_cb cb;
+  https_body_cb body_cb; // NULL to collect the body in 'buf'.
   void *cb_data;
 
-  uint8_t *buf;
+  uint8_t *buf; // Points at inline_buf until the body outgrows it.
   uint32_t buflen;
+  uint32_t bufsize;
+  CURLcode result;
+  unsigned int generation; // https_client_t.generation of the handle.
 
+  // Links in https_client_t.fetches. The easy handle points back at its
+  // context through CURLOPT_PRIVATE.
+  struct https_fetch_ctx *prev;
   struct https_fetch_ctx *next;
+
+  uint8_t inline_buf[HTTPS_INLINE_BUF_SIZE];
 };
 
-// Internal: Holds state on a socket watcher.
+// Internal: Holds state on a socket watcher. Attached to its socket with
+// curl_multi_assign and handed back to multi_sock_cb by libcurl.
 struct https_fd_watcher {
   ev_io watcher;
+  struct https_fd_watcher *prev;
   struct https_fd_watcher *next;
 };
 
@@ -34,20 +79,65 @@ typedef struct {
   struct ev_loop *loop;
   CURLM *curlm;
   struct https_fetch_ctx *fetches;
+  obj_pool_t fetch_pool;
+
+  // Configured easy handles waiting for their next transfer.
+  CURL *idle[HTTPS_CLIENT_POOL_SIZE];
+  int num_idle;
+  // Bumped by https_client_reconfigure. Handles configured before are not
+  // returned to the pool.
+  unsigned int generation;
 
   ev_timer timer;
-  ev_io fd[FD_SETSIZE]; // I'm lazy.
+  struct https_fd_watcher *fd_watchers; // One per live curl socket.
+  obj_pool_t fd_pool;
   int still_running;
+  int curl_bug; // See multi_sock_cb. -1 until known.
+  struct curl_slist *doh_headers; // Content-Type and Accept of RFC 8484.
 
   options_t *opt;
 } https_client_t;
 
+// Takes over 'list', with one reference held by the caller.
+// Returns NULL if out of memory, in which case 'list' is freed.
+struct https_resolv *https_resolv_new(struct curl_slist *list);
+
+// Drops a reference, freeing the list with the last one. Ignores NULL.
+void https_resolv_release(struct https_resolv *r);
+
 void https_client_init(https_client_t *c, options_t *opt, struct ev_loop *loop);
 
-void https_client_fetch(https_client_t *c, const char *url,
-                        struct curl_slist *resolv, https_response_cb cb,
-                        void *data);
+// Applies changed options. Open connections and transfers in flight are
+// kept, new transfers use the new proxy, HTTP version and limits.
+void https_client_reconfigure(https_client_t *c, options_t *opt);
+
+// Starts a transfer, resolving hosts by 'resolv' if it is not NULL, which
+// the transfer holds a reference of. 'fresh' forces a new connection rather than reusing
+// one. With 'body_cb' the body goes there as it arrives, and 'cb' is handed
+// an empty one. The returned handle is valid until 'cb' runs or it is
+// cancelled.
+struct https_fetch_ctx *https_client_fetch(https_client_t *c, const char *url,
+                                           struct https_resolv *resolv,
+                                           int fresh, https_body_cb body_cb,
+                                           https_response_cb cb, void *data);
+
+// Like https_client_fetch, but POSTs 'body' as an RFC 8484 DNS message.
+// 'body' must remain valid until the transfer finishes or is cancelled.
+struct https_fetch_ctx *https_client_post(https_client_t *c, const char *url,
+                                          struct https_resolv *resolv,
+                                          int fresh, const uint8_t *body,
+                                          size_t bodylen, https_response_cb cb,
+                                          void *data);
+
+// Aborts a transfer in flight. Its callback is not called.
+void https_client_cancel(https_client_t *c, struct https_fetch_ctx *ctx);
+
+// Sends a HEAD request to 'url' and ignores the outcome. Opens a connection
+// for later fetches to reuse, or keeps an idle one from timing out.
+void https_client_warm(https_client_t *c, const char *url,
+                       struct https_resolv *resolv);
 
+// Cancels the transfers in flight, whose callbacks are not called.
 void https_client_cleanup(https_client_t *c);
 
 #endif // _HTTPS_CLIENT_H_
@@ -13,131 +13,145 @@
 #include "logging.h"
 #include "nxjson/nxjson.h"
 
-// Writes a string out, pascal style. limited to 63 bytes$
-// (max length without compression for a domain segment).
-// Returns the bytes written to 'out'.$
-// Bytes consumed from source is always one less than that written.
-static int dn_write_name(const char *name, uint8_t *out, size_t outlen) {
-  int namelen = 0;
-  while (name[namelen] && name[namelen] != '.') { namelen++; }
-  if (namelen > 63 || outlen < (namelen + 1)) { return -1; }
-  *out++ = namelen;
-  memcpy(out, name, namelen);
-  return namelen + 1;
-}
-
-// Returns 1 if 'str' is matches domain name 'pos', otherwise returns 0.
-// Equlivalent to expanding label and doing a comparison on the result.
-static int dn_match(const char *str, const uint8_t *pos, const uint8_t *pkt_start) {
-  uint8_t len = *pos;
-  while (len) {
-    if ((len & 0xc0) == 0xc0) {
-      uint16_t ofs = ntohs(*(uint16_t*)pos) & 0xbfff;
+// Returns 1 if the 'len' bytes of dotted 'str' spell out the encoded name at
+// 'pos', following compression pointers back into 'pkt_start'. Equivalent
+// to expanding the name and comparing, but without a copy. Bytes from
+// 'limit' on may still change and never match.
+static int dn_match(const char *str, size_t len, const uint8_t *pos,
+                    const uint8_t *pkt_start, const uint8_t *limit) {
+  const char *end = str + len;
+  if (pos >= limit) { return 0; }
+  uint8_t l = *pos;
+  while (l) {
+    if ((l & 0xc0) == 0xc0) {
+      if (pos + 1 >= limit) { return 0; }
+      uint16_t ofs = ntohs(*(uint16_t*)pos) & 0x3fff;
       if (pkt_start + ofs >= pos || ofs < 12) {
         DLOG("Bad offset (%d)", ofs);
         return 0;
       }
-      DLOG("Following backref to offset %04x.", ofs);
       pos = pkt_start + ofs;
+      l = *pos;
       continue;
     }
     pos++;
-    if (strlen(str) < len) {
-      // If domain is longer than the suffix we're checking, it's no match.
+    if (pos + l >= limit || (size_t)(end - str) < l ||
+        memcmp(str, pos, l) != 0) {
       return 0;
     }
-    if (memcmp(str, pos, len) != 0) { return 0; }
-    str += len;
-    pos += len;
-    len = *pos;
-    if (*str && *str++ != '.') { return 0; }
+    str += l;
+    pos += l;
+    l = *pos;
+    if (str < end && *str++ != '.') { return 0; }
   }
-  int end_of_str = (!(*str));
-  return end_of_str;
+  return str == end;
 }
 
-// Returns offset in 'a' at which string 'a' matches an encoded domain 'b'.
-// Returns -1 if they don't match. Only checks '.' boundaries. i.e.
-// aa.b.c and a.b.c match at offset of b.c, not a.b.c.
-static int dn_suffix_match(const char *a, const uint8_t *b, const uint8_t *pkt_start) {
-  const char *d = a;
-  while (*d) {
-    if (dn_match(d, b, pkt_start)) { return d - a; }
-    while (*d && *d != '.') { d++; }
-    if (*d) { d++; }
+// FNV-1a of a label, chained onto the hash of the suffix that follows it.
+static uint32_t dn_suffix_hash(const char *label, int len, uint32_t next) {
+  uint32_t h = 2166136261u ^ next;
+  int i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)label[i]) * 16777619u;
   }
-  return -1;
+  return h ^ (h >> 15);
 }
 
-// Searches 'dnptrs' for longest suffix match on 'name'.
-// Returns the offset into 'name' at which the suffix starts, or strlen(name)$
-// if no suffix found. *pkt_ofs points at the offset of the suffix from the$
-// start of the packet if found, 0 otherwise.
-static int dn_find_dnptr(const char *name,
-                         const uint8_t **dnptrs, const uint8_t **lastdnptr,
-                         uint16_t *pkt_ofs) {
-  const char *npos = name;
-  const char *nend = name + strlen(name);
-  while (npos < nend) {
-    const uint8_t **d = &dnptrs[1];
-    while(*d && d < lastdnptr) {
-      int name_ofs = dn_suffix_match(npos, *d, dnptrs[0]);
-      if (name_ofs != -1) {
-        *pkt_ofs = *d - dnptrs[0];
-        return name_ofs;
-      }
-      d++;
+void dn_compress_init(dn_compress_t *c, const uint8_t *pkt) {
+  c->pkt = pkt;
+  c->used = 0;
+  memset(c->slots, 0, sizeof(c->slots));
+}
+
+// Returns the packet offset of a name before 'limit' spelling out the 'len'
+// bytes of 'suffix', or 0 if there is none. Names past 'limit' belong to
+// records that were dropped.
+static uint16_t dn_compress_find(const dn_compress_t *c, const char *suffix,
+                                 size_t len, uint32_t hash,
+                                 const uint8_t *limit) {
+  uint32_t i = hash;
+  for (;; i++) {
+    const struct dn_suffix *s = &c->slots[i & (DN_COMPRESS_SLOTS - 1)];
+    if (!s->ofs) {
+      return 0;
+    }
+    if (s->hash == hash && dn_match(suffix, len, c->pkt + s->ofs, c->pkt,
+                                         limit)) {
+      return s->ofs;
     }
-    while (npos < nend && *npos != '.') { npos++; }
-    if (*npos) { npos++; }
   }
-  *pkt_ofs = 0;
-  return nend - name;
 }
 
-// Write null-terminated 'name' to 'out' buffer of at least 'outlen' length.
-// dnptrs[0] should point to the start of the packet. dnptrs[1-n] point at$
-// previous domain names. dnptrs[n] should be NULL. lastdnptr should be$
-// &dnptrs[m] where m > n.
+static void dn_compress_add(dn_compress_t *c, uint16_t ofs, uint32_t hash) {
+  // Leave room so lookups always end at an empty slot.
+  if (c->used >= DN_COMPRESS_SLOTS * 3 / 4 || ofs > 0x3fff) {
+    return;
+  }
+  uint32_t i = hash;
+  while (c->slots[i & (DN_COMPRESS_SLOTS - 1)].ofs) {
+    i++;
+  }
+  c->slots[i & (DN_COMPRESS_SLOTS - 1)].hash = hash;
+  c->slots[i & (DN_COMPRESS_SLOTS - 1)].ofs = ofs;
+  c->used++;
+}
+
 int dn_name_compress(const char *name, uint8_t *out, size_t outlen,
-                     const uint8_t **dnptrs, const uint8_t **lastdnptr) {
-  uint16_t out_ofs;
-  uint16_t name_ofs = dn_find_dnptr(name, dnptrs, lastdnptr, &out_ofs);
+                     dn_compress_t *c) {
+  // Label boundaries and the hash of the suffix starting at each, found
+  // back to front so every suffix costs one pass over its first label.
+  const char *labels[DN_MAX_LABELS];
+  uint8_t lens[DN_MAX_LABELS];
+  uint32_t hashes[DN_MAX_LABELS];
+  int n = 0;
+  // The root, e.g. the exchange of a null MX (RFC 7505), has no labels.
+  const char *p = name[0] == '.' && !name[1] ? name + 1 : name;
+  const char *nend = p; // End of the name, less any trailing dot.
+  while (*p) {
+    if (n == DN_MAX_LABELS) { return -1; }
+    labels[n] = p;
+    while (*p && *p != '.') { p++; }
+    if (p == labels[n] || p - labels[n] > 63) { return -1; }
+    lens[n] = p - labels[n];
+    n++;
+    nend = p;
+    if (*p) { p++; }
+  }
+  uint32_t next = 0;
+  int i;
+  for (i = n - 1; i >= 0; i--) {
+    hashes[i] = next = dn_suffix_hash(labels[i], lens[i], next);
+  }
+
+  // The longest suffix already in the packet, if any.
+  uint16_t ptr = 0;
+  for (i = 0; i < n; i++) {
+    ptr = dn_compress_find(c, labels[i], nend - labels[i], hashes[i], out);
+    if (ptr) { break; }
+  }
 
-  const char *npos = name;
-  const char *nend = name + name_ofs;
   uint8_t *pos = out;
   uint8_t *end = out + outlen;
-  while (npos < nend) {
-    int r = dn_write_name(npos, pos, end - pos);
-    if (r < 0) { return -1; }
-    pos += r;
-    npos += r - 1;
-    if (*npos && *npos != '.') { return -1; }
-    npos++;
+  int j;
+  for (j = 0; j < i; j++) {
+    if (end - pos < lens[j] + 1) { return -1; }
+    dn_compress_add(c, pos - c->pkt, hashes[j]);
+    *pos++ = lens[j];
+    memcpy(pos, labels[j], lens[j]);
+    pos += lens[j];
   }
-  if (out_ofs > 0) {
+  if (ptr) {
     if (end - pos < 2) { return -1; }
-    *(uint16_t*)pos = htons(0xc000 | out_ofs); pos += 2;
+    *(uint16_t*)pos = htons(0xc000 | ptr); pos += 2;
   } else {
     if (end - pos < 1) { return -1; }
     *pos++ = 0;
   }
-  if ((*out & 0xc0) != 0xc0) {  // Don't keep duplicate dnptrs.
-    const uint8_t **d = &dnptrs[1];
-    while (*d && d < lastdnptr) {
-      d++;
-    }
-    if (d < lastdnptr) {
-      *d++ = out;
-      if (d < lastdnptr) { *d = NULL; }
-    }
-  }
   return pos - out;
 }
 
 int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
-                  const uint8_t **dnptrs, const uint8_t **lastdnptr) {
+                  dn_compress_t *c) {
   if ((end - pos) < 2) {
     DLOG("Out of buffer space in json_to_rdata.");
     return -1;
@@ -151,7 +165,7 @@ int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
   case ns_t_cname:
   case ns_t_ns:
   case ns_t_ptr: {
-    int r = dn_name_compress(data, pos, end - pos, dnptrs, lastdnptr);
+    int r = dn_name_compress(data, pos, end - pos, c);
     if (r < 0) {
       DLOG("Failed to compress name.");
       return -1;
@@ -174,7 +188,7 @@ int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
     if (!tok) {
       return -1;
     }
-    int r = dn_name_compress(tok, pos, end - pos, dnptrs, lastdnptr);
+    int r = dn_name_compress(tok, pos, end - pos, c);
     if (r < 0) {
       DLOG("Failed to compress name.");
       return -1;
@@ -228,21 +242,20 @@ int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
   case ns_t_soa: {
     char *saveptr = NULL;
     int r = dn_name_compress(strtok_r(data, " ", &saveptr), pos, end - pos,
-                             dnptrs, lastdnptr);
+                             c);
     if (r < 0) {
       DLOG("Failed to compress mname.");
       return -1;
     }
     pos += r;
-    r = dn_name_compress(strtok_r(NULL, " ", &saveptr), pos, end - pos, dnptrs,
-                         lastdnptr);
+    r = dn_name_compress(strtok_r(NULL, " ", &saveptr), pos, end - pos, c);
     if (r < 0) {
       DLOG("Failed to compress rname.");
       return -1;
     }
     pos += r;
     if ((end - pos) < 20) {
-      DLOG("Buffer too small: %d < 20", end - pos);
+      DLOG("Buffer too small: %d < 20", (int)(end - pos));
       return -1;
     }
     NS_PUT32(atoi(strtok_r(NULL, " ", &saveptr)), pos); // serial
@@ -257,8 +270,8 @@ int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
     NS_PUT16(atoi(strtok_r(data, " ", &saveptr)), pos); // prio
     NS_PUT16(atoi(strtok_r(NULL, " ", &saveptr)), pos); // weight
     NS_PUT16(atoi(strtok_r(NULL, " ", &saveptr)), pos); // port
-    int r = dn_name_compress(strtok_r(NULL, " ", &saveptr), pos, end - pos, dnptrs,
-                         lastdnptr);
+    int r = dn_name_compress(strtok_r(NULL, " ", &saveptr), pos, end - pos,
+                             c);
     if (r < 0) {
       DLOG("Failed to compress rname.");
       return -1;
@@ -302,16 +315,15 @@ int json_to_dns(uint16_t tx_id, char *in, uint8_t *out, int olen) {
   NS_PUT16(nx_json_get(json, "Authority")->length, pos);
   NS_PUT16(nx_json_get(json, "Additional")->length, pos);
 
-  const uint8_t *dnptrs[256];
-  const uint8_t **lastdnptr = &dnptrs[256];
-  dnptrs[0] = out;
-  dnptrs[1] = NULL;
+  // Built once per packet, so each name costs a lookup per suffix.
+  dn_compress_t comp;
+  dn_compress_init(&comp, out);
 
   const nx_json *obj = nx_json_get(json, "Question");
   for (i = 0; i < obj->length; i++) {
     const nx_json *subobj = nx_json_item(obj, i);
     int r = dn_name_compress(nx_json_get(subobj, "name")->text_value, pos,
-                             end - pos, dnptrs, lastdnptr);
+                             end - pos, &comp);
     if (r < 0) {
       DLOG("Failed to encode question name.");
       return r;
@@ -333,7 +345,7 @@ int json_to_dns(uint16_t tx_id, char *in, uint8_t *out, int olen) {
         uint8_t *saved_pos = pos;
         const nx_json *subobj = nx_json_item(obj, j);
         int r = dn_name_compress(nx_json_get(subobj, "name")->text_value, pos,
-                                 end - pos, dnptrs, lastdnptr);
+                                 end - pos, &comp);
         if (r < 0) {
           DLOG("Failed to encode %s ix %d.", rr_keys[i], j);
           return r;
@@ -349,7 +361,7 @@ int json_to_dns(uint16_t tx_id, char *in, uint8_t *out, int olen) {
         NS_PUT32(nx_json_get(subobj, "TTL")->int_value, pos);
         // TODO: Don't drop const? This is probably safe but bad form.
         r = json_to_rdata(type, (char *)nx_json_get(subobj, "data")->text_value,
-                          pos, end, dnptrs, lastdnptr);
+                          pos, end, &comp);
         if (r < 0) {
           WLOG("Failed to encode %s ix %d.", rr_keys[i], j);
           pos = saved_pos;
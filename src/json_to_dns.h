@@ -2,9 +2,46 @@
 #ifndef _JSON_TO_DNS_H_
 #define _JSON_TO_DNS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Labels in a name, at most.
+#define DN_MAX_LABELS 127
+
+// Suffixes remembered per packet for compression, a power of two.
+#define DN_COMPRESS_SLOTS 256
+
+// Name compression state of one packet: a hash table from every name
+// suffix written so far to its offset, so each name is compressed with one
+// lookup per label rather than a search of all earlier names.
+typedef struct {
+  const uint8_t *pkt;
+  int used;
+  struct dn_suffix {
+    uint32_t hash;
+    uint16_t ofs; // 0 while the slot is free.
+  } slots[DN_COMPRESS_SLOTS];
+} dn_compress_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+// Starts compressing names into the packet at 'pkt'.
+void dn_compress_init(dn_compress_t *c, const uint8_t *pkt);
+
+// Writes dotted 'name' to 'out' of 'outlen' bytes, in the packet 'c' was
+// started on, pointing back at the longest suffix already written. The
+// root is "." or "".
+// Returns the bytes written, or -1 if it does not fit or is not a name.
+int dn_name_compress(const char *name, uint8_t *out, size_t outlen,
+                     dn_compress_t *c);
+
+// Writes the length prefixed RDATA of a record of 'type' given in JSON
+// presentation form 'data', which is parsed in place, to [pos, end).
+// Returns the bytes written, or -1 on failure.
+int json_to_rdata(uint16_t type, char *data, uint8_t *pos, uint8_t *end,
+                  dn_compress_t *c);
+
 // Creates a DNS packet from a JSON representation.
 // 'tx_id' is the ID to use in the packet, 'in' is the JSON representation.
 // (https://developers.google.com/speed/public-dns/docs/dns-over-https#dns_response_in_json)
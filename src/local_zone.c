@@ -0,0 +1,396 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dns_packet.h"
+#include "local_zone.h"
+
+// Words on a line, at most.
+#define LOCAL_ZONE_MAX_WORDS 64
+
+// One address of a host while loading, sorted by name to gather them.
+struct host_rec {
+  uint64_t hash;
+  uint32_t seq; // Keeps addresses in file order.
+  uint8_t len;  // 4 or 16.
+  uint8_t addr[16];
+};
+
+// What a load collects before the table is sized for it.
+typedef struct {
+  struct host_rec *hosts;
+  size_t num_hosts;
+  size_t size_hosts;
+  uint64_t *blocked;
+  size_t num_blocked;
+  size_t size_blocked;
+} zone_builder_t;
+
+// FNV-1a over 'c', for hashing names from their last character back, so
+// the hash of each suffix extends that of the next shorter one.
+static uint64_t hash_step(uint64_t h, char c) {
+  return (h ^ (uint8_t)c) * 1099511628211ull;
+}
+
+#define HASH_INIT 14695981039346656037ull
+
+// 0 marks free slots, so no name hashes to it.
+static uint64_t hash_final(uint64_t h) {
+  return h ? h : 1;
+}
+
+static uint64_t name_hash(const char *name, size_t len) {
+  uint64_t h = HASH_INIT;
+  while (len > 0) {
+    h = hash_step(h, name[--len]);
+  }
+  return hash_final(h);
+}
+
+// Lowercases 'w' in place and drops a trailing dot. Returns its length, or
+// -1 if it is not a name.
+static int normalize_name(char *w) {
+  int len = strlen(w);
+  if (len > 1 && w[len - 1] == '.') {
+    w[--len] = '\0';
+  }
+  if (len == 0 || len > DNS_MAX_NAME || w[0] == '.') {
+    return -1;
+  }
+  int i;
+  for (i = 0; i < len; i++) {
+    w[i] = tolower((unsigned char)w[i]);
+    if (w[i] == '.' && w[i + 1] == '.') {
+      return -1;
+    }
+  }
+  return len;
+}
+
+// Parses an IPv4 or IPv6 address into 'out', dropping the zone of a
+// scoped one such as "fe80::1%lo0". Returns its length or 0.
+static int parse_addr(char *w, uint8_t *out) {
+  if (inet_pton(AF_INET, w, out) == 1) {
+    return 4;
+  }
+  char *zone = strchr(w, '%');
+  if (zone) {
+    *zone = '\0';
+  }
+  if (inet_pton(AF_INET6, w, out) == 1) {
+    return 16;
+  }
+  return 0;
+}
+
+// Names hosts files map to loopback or broadcast, which a blocklist in
+// that format lists without meaning to block them.
+static const char *const standard_hosts[] = {
+  "localhost", "localhost.localdomain", "local", "broadcasthost",
+  "ip6-localhost", "ip6-loopback", "ip6-localnet", "ip6-mcastprefix",
+  "ip6-allnodes", "ip6-allrouters", "ip6-allhosts", "0.0.0.0",
+};
+
+static int is_standard_host(const char *name) {
+  size_t i;
+  for (i = 0; i < sizeof(standard_hosts) / sizeof(standard_hosts[0]); i++) {
+    if (strcmp(name, standard_hosts[i]) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int add_host(zone_builder_t *b, const char *name, int namelen,
+                    const uint8_t *addr, int addrlen) {
+  if (b->num_hosts == b->size_hosts) {
+    size_t size = b->size_hosts ? b->size_hosts * 2 : 256;
+    struct host_rec *hosts = (struct host_rec *)realloc(
+        b->hosts, size * sizeof(struct host_rec));
+    if (!hosts) {
+      return -1;
+    }
+    b->hosts = hosts;
+    b->size_hosts = size;
+  }
+  struct host_rec *r = &b->hosts[b->num_hosts];
+  r->hash = name_hash(name, namelen);
+  r->seq = b->num_hosts++;
+  r->len = addrlen;
+  memcpy(r->addr, addr, addrlen);
+  return 0;
+}
+
+static int add_blocked(zone_builder_t *b, const char *name, int namelen) {
+  if (b->num_blocked == b->size_blocked) {
+    size_t size = b->size_blocked ? b->size_blocked * 2 : 1024;
+    uint64_t *blocked =
+        (uint64_t *)realloc(b->blocked, size * sizeof(uint64_t));
+    if (!blocked) {
+      return -1;
+    }
+    b->blocked = blocked;
+    b->size_blocked = size;
+  }
+  b->blocked[b->num_blocked++] = name_hash(name, namelen);
+  return 0;
+}
+
+// Reads the hosts file or blocklist at 'path' into 'b'.
+static int load_file(zone_builder_t *b, const char *path, int blocklist) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("'%s' is not readable.\n", path);
+    return -1;
+  }
+  char *line = NULL;
+  size_t size = 0;
+  int lineno = 0;
+  int ret = 0;
+  while (ret == 0 && getline(&line, &size, f) >= 0) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash) {
+      *hash = '\0';
+    }
+    char *words[LOCAL_ZONE_MAX_WORDS];
+    int n = 0;
+    char *save = NULL;
+    char *w;
+    for (w = strtok_r(line, " \t\r\n", &save);
+         w && n < LOCAL_ZONE_MAX_WORDS; w = strtok_r(NULL, " \t\r\n", &save)) {
+      words[n++] = w;
+    }
+    if (n == 0) {
+      continue; // Blank or only a comment.
+    }
+    // Blocklists often come as hosts files pointing at 0.0.0.0, whose
+    // address is of no interest here.
+    uint8_t addr[16];
+    int addrlen = parse_addr(words[0], addr);
+    int first = addrlen ? 1 : 0;
+    if (blocklist && !addrlen && n > 1) {
+      printf("%s:%d: skipping line with unknown address '%s'.\n", path,
+             lineno, words[0]);
+      continue;
+    }
+    if (first == n || (!addrlen && !blocklist)) {
+      printf("%s:%d: expected \"%s\".\n", path, lineno,
+             blocklist ? "domain" : "address name...");
+      ret = -1;
+      break;
+    }
+    int i;
+    for (i = first; i < n; i++) {
+      int len = normalize_name(words[i]);
+      if (len < 0) {
+        printf("%s:%d: '%s' is not a domain name.\n", path, lineno,
+               words[i]);
+        ret = -1;
+        break;
+      }
+      if (blocklist && is_standard_host(words[i])) {
+        continue;
+      }
+      if (blocklist ? add_blocked(b, words[i], len)
+                    : add_host(b, words[i], len, addr, addrlen)) {
+        printf("Out of memory reading '%s'.\n", path);
+        ret = -1;
+        break;
+      }
+    }
+  }
+  free(line);
+  fclose(f);
+  return ret;
+}
+
+static int host_rec_cmp(const void *x, const void *y) {
+  const struct host_rec *a = (const struct host_rec *)x;
+  const struct host_rec *b = (const struct host_rec *)y;
+  if (a->hash != b->hash) {
+    return a->hash < b->hash ? -1 : 1;
+  }
+  return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+// Returns the slot of 'hash', claiming a free one if it has none.
+static struct local_name *zone_slot(local_zone_t *z, uint64_t hash) {
+  uint32_t i = hash & z->mask;
+  while (z->slots[i].hash && z->slots[i].hash != hash) {
+    i = (i + 1) & z->mask;
+  }
+  z->slots[i].hash = hash;
+  return &z->slots[i];
+}
+
+// Fills 'z' from what 'b' collected.
+static int zone_build(local_zone_t *z, zone_builder_t *b) {
+  // At most two thirds full, so probe sequences stay short.
+  size_t want = (b->num_hosts + b->num_blocked) * 3 / 2;
+  size_t nslots = 16;
+  while (nslots < want) {
+    nslots *= 2;
+  }
+  z->slots = (struct local_name *)calloc(nslots, sizeof(struct local_name));
+  z->addrs = (uint8_t *)malloc(b->num_hosts * 16 + 1);
+  if (!z->slots || !z->addrs) {
+    return -1;
+  }
+  z->mask = nslots - 1;
+
+  if (b->num_hosts > 0) { // A blocklist alone has none, nor an array.
+    qsort(b->hosts, b->num_hosts, sizeof(struct host_rec), host_rec_cmp);
+  }
+  uint32_t used = 0;
+  size_t i = 0;
+  while (i < b->num_hosts) {
+    size_t end = i;
+    while (end < b->num_hosts && b->hosts[end].hash == b->hosts[i].hash) {
+      end++;
+    }
+    struct local_name *n = zone_slot(z, b->hosts[i].hash);
+    n->flags |= LOCAL_HOST;
+    n->addrs = used;
+    int len;
+    for (len = 4; len <= 16; len += 12) {
+      size_t j;
+      for (j = i; j < end; j++) {
+        uint8_t *count = len == 4 ? &n->num_a : &n->num_aaaa;
+        if (b->hosts[j].len == len && *count < LOCAL_ZONE_MAX_ADDRS) {
+          memcpy(z->addrs + used, b->hosts[j].addr, len);
+          used += len;
+          (*count)++;
+        }
+      }
+    }
+    z->num_hosts++;
+    i = end;
+  }
+  for (i = 0; i < b->num_blocked; i++) {
+    struct local_name *n = zone_slot(z, b->blocked[i]);
+    if (!(n->flags & LOCAL_BLOCKED)) {
+      n->flags |= LOCAL_BLOCKED;
+      z->num_blocked++;
+    }
+  }
+  return 0;
+}
+
+int local_zone_load(local_zone_t *z, const char *hosts_file,
+                    const char *blocklist_file) {
+  memset(z, 0, sizeof(*z));
+  zone_builder_t b;
+  memset(&b, 0, sizeof(b));
+  int ret = 0;
+  if ((hosts_file && load_file(&b, hosts_file, 0)) ||
+      (blocklist_file && load_file(&b, blocklist_file, 1))) {
+    ret = -1;
+  } else if (zone_build(z, &b)) {
+    printf("Out of memory loading local names.\n");
+    ret = -1;
+  }
+  free(b.hosts);
+  free(b.blocked);
+  if (ret) {
+    local_zone_cleanup(z);
+  }
+  return ret;
+}
+
+static const struct local_name *zone_find(const local_zone_t *z,
+                                          uint64_t hash) {
+  uint32_t i = hash & z->mask;
+  while (z->slots[i].hash) {
+    if (z->slots[i].hash == hash) {
+      return &z->slots[i];
+    }
+    i = (i + 1) & z->mask;
+  }
+  return NULL;
+}
+
+const struct local_name *local_zone_lookup(const local_zone_t *z,
+                                           const char *name) {
+  const struct local_name *blocked = NULL;
+  size_t i = strlen(name);
+  uint64_t h = HASH_INIT;
+  // One pass from the top-level domain down, looking up each suffix.
+  while (i > 0) {
+    h = hash_step(h, name[--i]);
+    if (i > 0 && name[i - 1] != '.') {
+      continue;
+    }
+    const struct local_name *n = zone_find(z, hash_final(h));
+    if (!n) {
+      continue;
+    }
+    if (i == 0 && (n->flags & LOCAL_HOST)) {
+      return n;
+    }
+    if (n->flags & LOCAL_BLOCKED) {
+      blocked = n;
+    }
+  }
+  return blocked;
+}
+
+int local_zone_reply(const local_zone_t *z, const struct local_name *n,
+                     uint16_t tx_id, int rd, const char *name, uint16_t type,
+                     uint8_t *out, int olen) {
+  if (!(n->flags & LOCAL_HOST)) {
+    return dns_packet_empty_reply(tx_id, rd, ns_r_nxdomain, name, type, out,
+                                  olen);
+  }
+  int r = dns_packet_empty_reply(tx_id, rd, ns_r_noerror, name, type, out,
+                                 olen);
+  if (r < 0) {
+    return -1;
+  }
+  const uint8_t *addr = z->addrs + n->addrs;
+  int num = 0;
+  int len = 0;
+  if (type == ns_t_a) {
+    num = n->num_a;
+    len = 4;
+  } else if (type == ns_t_aaaa) {
+    addr += n->num_a * 4;
+    num = n->num_aaaa;
+    len = 16;
+  }
+  uint8_t *pos = out + r;
+  uint8_t *end = out + olen;
+  int i;
+  for (i = 0; i < num; i++) {
+    if (end - pos < 12 + len) {
+      return -1;
+    }
+    NS_PUT16(0xc00c, pos); // The name of the question.
+    NS_PUT16(type, pos);
+    NS_PUT16(ns_c_in, pos);
+    NS_PUT32(LOCAL_ZONE_TTL, pos);
+    NS_PUT16(len, pos);
+    memcpy(pos, addr + i * len, len);
+    pos += len;
+  }
+  out[6] = num >> 8; // Answer count
+  out[7] = num;
+  return pos - out;
+}
+
+void local_zone_cleanup(local_zone_t *z) {
+  free(z->slots);
+  free(z->addrs);
+  z->slots = NULL;
+  z->addrs = NULL;
+  z->mask = 0;
+  z->num_hosts = 0;
+  z->num_blocked = 0;
+}
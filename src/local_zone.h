@@ -0,0 +1,64 @@
+// Names answered locally instead of upstream: static hosts from a hosts
+// file, and blocked domains, with all their subdomains, from a blocklist.
+#ifndef _LOCAL_ZONE_H_
+#define _LOCAL_ZONE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// TTL of local answers, which hosts files do not give.
+#define LOCAL_ZONE_TTL 300
+
+// Addresses kept per host name, of each family.
+#define LOCAL_ZONE_MAX_ADDRS 16
+
+#define LOCAL_HOST 1    // Has addresses, for the name itself only.
+#define LOCAL_BLOCKED 2 // Answered NXDOMAIN, with its subdomains.
+
+// An open addressing table keyed by a 64-bit hash of each name, so half a
+// million names take a few megabytes and a lookup touches one cache line
+// per label of the query. Names themselves are not kept, as a hash
+// collision among that many is vanishingly unlikely.
+typedef struct local_zone_s {
+  struct local_name {
+    uint64_t hash; // 0 while the slot is free.
+    uint32_t addrs; // Offset in 'addrs': 'num_a' IPv4, then IPv6 ones.
+    uint8_t num_a;
+    uint8_t num_aaaa;
+    uint8_t flags;
+  } *slots;
+  uint32_t mask; // Slots, less one; a power of two.
+  uint8_t *addrs;
+  int num_hosts;
+  int num_blocked;
+} local_zone_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Loads 'hosts_file' ("address name..." lines) and 'blocklist_file' (one
+// domain per line, or hosts-style lines whose names are all blocked),
+// either of which may be NULL. '#' starts a comment in both.
+// Returns 0 on success, -1 after printing what is wrong.
+int local_zone_load(local_zone_t *z, const char *hosts_file,
+                    const char *blocklist_file);
+
+// Looks up lowercase dotted 'name', returning the entry of the name itself
+// if it is a host, else that of its closest blocked ancestor (or itself),
+// else NULL.
+const struct local_name *local_zone_lookup(const local_zone_t *z,
+                                           const char *name);
+
+// Writes the local answer for a query of ('name', 'type') matching 'n'.
+// Hosts without addresses of that type get an empty NOERROR answer.
+// Returns size of packet on success, -1 on failure.
+int local_zone_reply(const local_zone_t *z, const struct local_name *n,
+                     uint16_t tx_id, int rd, const char *name, uint16_t type,
+                     uint8_t *out, int olen);
+
+void local_zone_cleanup(local_zone_t *z);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _LOCAL_ZONE_H_
@@ -1,20 +1,58 @@
-#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "logging.h"
 
-/* logs of this severity or higher are flushed immediately after write */
-#define LOG_FLUSH_LEVEL LOG_WARNING
+// Lines queued between the logging call sites and the writer thread. Both
+// are powers of two, longer lines are cut short.
+#define LOG_RING_SLOTS 1024
+#define LOG_LINE_SIZE 512
 
-static FILE *logf = NULL;
-static int loglevel = LOG_ERROR;
-static ev_timer logging_timer;
+// Most lines a single call site may log per second. The rest are counted
+// and the count is reported with the next line that gets through.
+#define LOG_RATE_LIMIT 1000
+
+// Seconds the idle writer waits before looking for lines by itself. Lines
+// of LOG_WAKE_LEVEL or above, or a half full ring, wake it right away.
+#define LOG_DRAIN_INTERVAL 0.1
+#define LOG_WAKE_LEVEL LOG_WARNING
+
+// Lines the writer hands to a single writev.
+#define LOG_WRITE_BATCH 64
+
+// A bounded multi-producer queue (after Dmitry Vyukov). A slot may be
+// filled when its sequence equals the position being claimed, and read
+// once it is one past it.
+struct log_slot {
+  size_t seq;
+  int len;
+  char text[LOG_LINE_SIZE];
+};
+
+int _log_level = LOG_ERROR;
+static int logfd = STDOUT_FILENO;
+
+static struct log_slot *ring = NULL;
+static size_t ring_head = 0; // Next position claimed by a producer.
+static size_t ring_tail = 0; // Next position read by the writer.
+static unsigned long ring_dropped = 0;
+
+static pthread_t writer;
+static int writer_running = 0;
+static int writer_stop = 0;
+static int writer_sleeping = 0;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
 
 // Renders a severity as a short string.
 static const char *SeverityStr(int severity) {
@@ -30,75 +68,277 @@ static const char *SeverityStr(int severity) {
   case LOG_FATAL:
     return "[F]";
   default:
-    fprintf(logf, "Unknown log severity: %d\n", severity);
+    dprintf(logfd, "Unknown log severity: %d\n", severity);
     exit(EXIT_FAILURE);
   }
 }
 
-static void logging_timer_cb(struct ev_loop *loop, ev_timer *w, int revents) {
-  if (logf) {
-    fflush(logf);
+// A clock read through the vDSO at the resolution of the kernel tick,
+// which is plenty for log lines.
+static void log_clock(struct timespec *ts) {
+#ifdef CLOCK_REALTIME_COARSE
+  if (clock_gettime(CLOCK_REALTIME_COARSE, ts) == 0) {
+    return;
   }
+#endif
+  clock_gettime(CLOCK_REALTIME, ts);
 }
 
-void logging_flush_init(struct ev_loop *loop) {
-  /* don't init timer if we will never write messages that are not flushed */
-  if (loglevel >= LOG_FLUSH_LEVEL) {
-    return;
+static void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t r = write(logfd, buf, len);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return;
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void writer_wake() {
+  if (__atomic_exchange_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&writer_mutex);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
   }
-  DLOG("initializing periodic log flush timer");
-  ev_timer_init(&logging_timer, logging_timer_cb, 0, 10);
-  ev_timer_start(loop, &logging_timer);
+}
+
+// Writes out every complete line in the ring. Returns how many there were.
+static int writer_drain() {
+  struct iovec iov[LOG_WRITE_BATCH];
+  int total = 0;
+  for (;;) {
+    int n = 0;
+    while (n < LOG_WRITE_BATCH) {
+      struct log_slot *s = &ring[(ring_tail + n) & (LOG_RING_SLOTS - 1)];
+      if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) != ring_tail + n + 1) {
+        break;
+      }
+      iov[n].iov_base = s->text;
+      iov[n].iov_len = s->len;
+      n++;
+    }
+    if (n == 0) {
+      break;
+    }
+    // Partial writes are not retried, a log line is not worth blocking on.
+    while (writev(logfd, iov, n) < 0 && errno == EINTR) {
+    }
+    int i;
+    for (i = 0; i < n; i++) {
+      struct log_slot *s = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+      __atomic_store_n(&s->seq, ring_tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+      __atomic_store_n(&ring_tail, ring_tail + 1, __ATOMIC_RELEASE);
+    }
+    total += n;
+  }
+  unsigned long dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    char line[80];
+    struct timespec ts;
+    log_clock(&ts);
+    int len = snprintf(line, sizeof(line), "%s %8ld.%06ld logging.c:0 "
+                       "%lu log lines dropped, the writer fell behind.\n",
+                       SeverityStr(LOG_WARNING), (long)ts.tv_sec,
+                       ts.tv_nsec / 1000, dropped);
+    write_all(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1);
+  }
+  return total;
+}
+
+static void *writer_main(void *data) {
+  for (;;) {
+    if (writer_drain() > 0) {
+      continue;
+    }
+    if (__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    pthread_mutex_lock(&writer_mutex);
+    __atomic_store_n(&writer_sleeping, 1, __ATOMIC_SEQ_CST);
+    struct log_slot *s = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+    if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != ring_tail + 1 &&
+        !__atomic_load_n(&writer_stop, __ATOMIC_SEQ_CST)) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += (long)(LOG_DRAIN_INTERVAL * 1e9);
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&writer_cond, &writer_mutex, &until);
+    }
+    __atomic_store_n(&writer_sleeping, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer_mutex);
+  }
+  return NULL;
 }
 
 void logging_init(int fd, int level) {
-  if (logf) {
-    fclose(logf);
+  logfd = fd;
+  _log_level = level;
+}
+
+void logging_set_level(int level) {
+  __atomic_store_n(&_log_level, level, __ATOMIC_RELAXED);
+}
+
+void logging_start() {
+  if (writer_running) {
+    return;
+  }
+  ring = (struct log_slot *)calloc(LOG_RING_SLOTS, sizeof(struct log_slot));
+  if (!ring) {
+    return; // Keep writing synchronously.
+  }
+  size_t i;
+  for (i = 0; i < LOG_RING_SLOTS; i++) {
+    ring[i].seq = i;
   }
-  logf = fdopen(fd, "a");
-  loglevel = level;
+  ring_head = ring_tail = 0;
+  writer_stop = 0;
+  if (pthread_create(&writer, NULL, writer_main, NULL)) {
+    free(ring);
+    ring = NULL;
+    return;
+  }
+  __atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
 }
 
 void logging_cleanup() {
-  if (logf) {
-    fclose(logf);
+  if (!writer_running) {
+    return;
   }
-  logf = NULL;
+  __atomic_store_n(&writer_stop, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&writer_mutex);
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_mutex);
+  pthread_join(writer, NULL);
+  __atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+  free(ring);
+  ring = NULL;
 }
 
-void _log(const char *file, int line, int severity, const char *fmt, ...) {
-  if (severity < loglevel) {
-    return;
+// Claims the next free slot, or returns NULL with the ring full.
+static struct log_slot *ring_claim(size_t *pos_out) {
+  size_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+  for (;;) {
+    struct log_slot *s = &ring[pos & (LOG_RING_SLOTS - 1)];
+    size_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *pos_out = pos;
+        return s;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    }
   }
+}
 
-  if (!logf) {
-    logf = fdopen(STDOUT_FILENO, "w");
+// Formats a line into 'buf', always ending it with a newline.
+static int log_format(char *buf, size_t size, struct _log_site *site,
+                      int severity, unsigned int suppressed,
+                      const struct timespec *ts, const char *fmt,
+                      va_list args) {
+  // We just want to log the filename, not the path. Found once per site.
+  const char *filename = __atomic_load_n(&site->filename, __ATOMIC_RELAXED);
+  if (!filename) {
+    filename = strrchr(site->file, '/');
+    filename = filename ? filename + 1 : site->file;
+    __atomic_store_n(&site->filename, filename, __ATOMIC_RELAXED);
   }
 
-  // We just want to log the filename, not the path.
-  const char *filename = file + strlen(file);
-  while (filename > file && *filename != '/') {
-    filename--;
+  int len = snprintf(buf, size, "%s %8ld.%06ld %s:%d ", SeverityStr(severity),
+                     (long)ts->tv_sec, ts->tv_nsec / 1000, filename,
+                     site->line);
+  if (len < (int)size - 1) {
+    int r = vsnprintf(buf + len, size - len, fmt, args);
+    len = r < 0 ? len : len + r;
+  }
+  if (suppressed && len < (int)size - 1) {
+    int r = snprintf(buf + len, size - len, " (%u similar lines suppressed)",
+                     suppressed);
+    len = r < 0 ? len : len + r;
   }
-  if (*filename == '/') {
-    filename++;
+  if (len > (int)size - 1) {
+    len = size - 1;
+  }
+  buf[len++] = '\n';
+  return len;
+}
+
+void _log(struct _log_site *site, int severity, const char *fmt, ...) {
+  if (severity < _log_level) {
+    return;
   }
 
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  fprintf(logf, "%s %8ld.%06ld %s:%d ", SeverityStr(severity), tv.tv_sec,
-          tv.tv_usec, filename, line);
+  struct timespec ts;
+  log_clock(&ts);
+
+  // Rate limit per call site. Races between threads only blur the count.
+  unsigned int suppressed = 0;
+  if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != ts.tv_sec) {
+    __atomic_store_n(&site->window, ts.tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_RATE_LIMIT &&
+      severity < LOG_FATAL) {
+    __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return;
+  }
 
   va_list args;
   va_start(args, fmt);
-  vfprintf(logf, fmt, args);
+  if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+    char line[LOG_LINE_SIZE];
+    int len = log_format(line, sizeof(line), site, severity, suppressed, &ts,
+                         fmt, args);
+    va_end(args);
+    write_all(line, len);
+    if (severity == LOG_FATAL) {
+      exit(1);
+    }
+    return;
+  }
+
+  size_t pos;
+  struct log_slot *s = ring_claim(&pos);
+  if (!s) {
+    va_end(args);
+    __atomic_add_fetch(&ring_dropped, 1, __ATOMIC_RELAXED);
+    writer_wake();
+    if (severity == LOG_FATAL) {
+      exit(1);
+    }
+    return;
+  }
+  s->len = log_format(s->text, sizeof(s->text), site, severity, suppressed,
+                      &ts, fmt, args);
   va_end(args);
-  fprintf(logf, "\n");
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
 
-  if (severity >= LOG_FLUSH_LEVEL) {
-    fflush(logf);
+  if (severity >= LOG_WAKE_LEVEL ||
+      pos - __atomic_load_n(&ring_tail, __ATOMIC_RELAXED) >=
+          LOG_RING_SLOTS / 2) {
+    writer_wake();
   }
   if (severity == LOG_FATAL) {
+    // Give the writer a moment to get this line and those before it out.
+    int i;
+    for (i = 0; i < 1000 && __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) <=
+                                pos; i++) {
+      struct timespec ms = { 0, 1000000 };
+      nanosleep(&ms, NULL);
+    }
     exit(1);
   }
 }
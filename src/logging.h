@@ -1,23 +1,37 @@
 #ifndef _LOGGING_H_
 #define _LOGGING_H_
 
-#include <ev.h>
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 // Initializes logging.
 // Writes logs to descriptor 'fd' for log levels above or equal to 'level'.
+// Until logging_start, lines are written synchronously.
 void logging_init(int fd, int level);
 
-// Initialize periodic timer to flush logs.
-void logging_flush_init(struct ev_loop *loop);
+// Changes the level lines are logged at, from any thread.
+void logging_set_level(int level);
+
+// Starts the thread writing out queued log lines, so logging never blocks
+// the caller. Call after forking into the background.
+void logging_start();
 
 // Cleans up and flushes open logs.
 void logging_cleanup();
 
 // Internal. Don't use.
-void _log(const char *file, int line, int severity, const char *fmt, ...);
+struct _log_site {
+  const char *file;
+  int line;
+  const char *filename; // 'file' without the path, set on first use.
+  // Rate limiting state, see LOG_RATE_LIMIT.
+  long window;
+  unsigned int count;
+  unsigned int suppressed;
+};
+extern int _log_level;
+void _log(struct _log_site *site, int severity, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
 #ifdef __cplusplus
 }
 #endif
@@ -30,11 +44,20 @@ enum _LogSeverity {
   LOG_FATAL = 4,
 };
 
+// Each call site keeps its own state, and disabled levels cost a compare.
+#define _LOG_AT(severity, ...)                                     \
+  do {                                                             \
+    static struct _log_site _log_site_ = { __FILE__, __LINE__ };   \
+    if ((severity) >= _log_level) {                                \
+      _log(&_log_site_, (severity), __VA_ARGS__);                  \
+    }                                                              \
+  } while (0)
+
 // Debug, Info, Warning, Error logging.
-#define DLOG(...) _log(__FILE__, __LINE__, LOG_DEBUG, __VA_ARGS__)
-#define ILOG(...) _log(__FILE__, __LINE__, LOG_INFO, __VA_ARGS__)
-#define WLOG(...) _log(__FILE__, __LINE__, LOG_WARNING, __VA_ARGS__)
-#define ELOG(...) _log(__FILE__, __LINE__, LOG_ERROR, __VA_ARGS__)
-#define FLOG(...) _log(__FILE__, __LINE__, LOG_FATAL, __VA_ARGS__)
+#define DLOG(...) _LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define ILOG(...) _LOG_AT(LOG_INFO, __VA_ARGS__)
+#define WLOG(...) _LOG_AT(LOG_WARNING, __VA_ARGS__)
+#define ELOG(...) _LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define FLOG(...) _LOG_AT(LOG_FATAL, __VA_ARGS__)
 
 #endif // _LOGGING_H_
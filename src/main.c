@@ -4,18 +4,26 @@
 //
 // Intended for use with Google's Public-DNS over HTTPS service
 // (https://developers.google.com/speed/public-dns/docs/dns-over-https)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pthread_setaffinity_np
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include <ares.h>
 #include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <ctype.h>
 #include <curl/curl.h>
 #include <errno.h>
 #include <ev.h>
 #include <grp.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,26 +32,130 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "bootstrap.h"
+#include "dns_cache.h"
+#include "dns_packet.h"
 #include "dns_server.h"
+#include "handoff.h"
 #include "https_client.h"
 #include "json_to_dns.h"
+#include "local_zone.h"
 #include "text_to_dns.h"
 #include "logging.h"
+#include "metrics.h"
+#include "obj_pool.h"
 #include "options.h"
+#include "rate_limit.h"
+#include "stats_server.h"
+#include "subnet.h"
+#include "upstream.h"
+
+// Number of buckets in the table of lookups currently in flight.
+#define PENDING_BUCKETS 1024
+
+// Cache hits within this last fraction of their TTL trigger a refresh.
+#define PREFETCH_FRACTION 0.1
+
+// TTL of answers served from expired cache entries (RFC 8767).
+#define STALE_ANSWER_TTL 30
+
+// Largest query forwarded to a DoH upstream.
+#define REQUEST_MAX_QUERY 512
+
+// Largest answer built from an HTTPDNS body, the EDNS buffer size clients
+// commonly offer. Addresses past it are dropped.
+#define REQUEST_MAX_ANSWER 1232
+
+// Most hedged fetches that may be saved up while traffic is light.
+#define HEDGE_BURST 10
+
+// After handing its sockets over, a worker waits this long at most for its
+// lookups in flight, checking every interval.
+#define DRAIN_TIMEOUT 5.0
+#define DRAIN_INTERVAL 0.05
+
+struct request_s;
 
 // Holds app state required for dns_server_cb.
 typedef struct {
+  struct ev_loop *loop;
   https_client_t *https_client;
-  struct curl_slist *resolv;
-  // currently only used for edns_client_subnet, if specified.
-  const char *extra_request_args;
+  // Addresses of upstream hosts, looked up on the bootstrap servers.
+  const bootstrap_t *bootstrap;
+  // Whether each client gets answers for its own subnet, looked up in
+  // 'prefix_table' first if there is one.
+  int client_subnet;
+  const subnet_table_t *prefix_table;
+  // Used for every client otherwise, and for clients on private addresses.
+  // Its text is part of the cache key, so answers for different subnets
+  // never mix. A negative prefix means it is not sent as a Client Subnet.
+  subnet_t default_subnet;
+  // Hosts and blocked domains answered right away, NULL for none.
+  const local_zone_t *local_zone;
+  // Admission control: the query rate of each client address, and the most
+  // lookups in flight, 0 for no limit.
+  rate_limit_t rate_limit;
+  int max_in_flight;
+  uint32_t min_ttl;
+  uint32_t max_ttl;
+  int aaaa_rcode; // -1 drops AAAA queries.
+  int doh; // Upstreams take RFC 8484 wire-format queries.
+  dns_cache_t cache;
+  upstream_set_t upstreams;
+  // Delay before a slow fetch is duplicated: 0 adapts to the upstream's
+  // latency, negative disables hedging.
+  ev_tstamp hedge_delay;
+  // Every request earns 'hedge_ratio' tokens and a hedge costs one, so
+  // hedges never exceed that share of requests, even during an outage.
+  double hedge_ratio;
+  double hedge_tokens;
+  // Keeps connections to idle upstreams from timing out.
+  ev_timer keepalive_timer;
+  // Upstream lookups in flight, keyed like the cache.
+  struct request_s *pending[PENDING_BUCKETS];
+  obj_pool_t request_pool;
+  obj_pool_t waiter_pool;
+  metrics_t metrics;
 } app_state_t;
 
-typedef struct {
+// A client waiting for the answer of an upstream lookup.
+typedef struct waiter_s {
+  struct waiter_s *next;
   uint16_t tx_id;
-  struct sockaddr_in raddr;
+  uint8_t rd; // Recursion desired, echoed in the answer.
+  dns_peer_t peer;
+  ev_tstamp start; // When the query arrived, in loop time.
+} waiter_t;
+
+// One fetch of a request. A hedged request has two in flight.
+typedef struct {
+  struct request_s *req;
+  upstream_t *upstream;
+  struct https_fetch_ctx *fetch; // NULL unless in flight.
+  // HTTPDNS bodies are decoded as they arrive, into 'answer'.
+  text_parser_t parser;
+  uint8_t answer[REQUEST_MAX_ANSWER];
+} attempt_t;
+
+// A single upstream lookup, shared by every client asking the same question
+// while it is in flight.
+typedef struct request_s {
+  struct request_s *hnext; // Chain in app_state_t.pending.
+  uint32_t hash;
+  uint16_t type;
+  // Copied, as the options it comes from may be reloaded meanwhile.
+  char subnet[MAX_SUBNET_LENGTH + 1];
   dns_server_t *dns_server;
-  char name[254]; // The full domain name may not exceed the length of 253 characters
+  app_state_t *app;
+  attempt_t attempts[2]; // The first fetch and its hedge.
+  ev_timer hedge_timer;
+  int retried; // Already failed over to another upstream.
+  waiter_t *waiters;
+  waiter_t first; // Storage for the first waiter, saves an allocation.
+  char name[DNS_MAX_NAME + 1];
+  // The wire-format query POSTed to DoH upstreams.
+  uint8_t query[REQUEST_MAX_QUERY];
+  int querylen;
 } request_t;
 
 static void sigint_cb(struct ev_loop *loop, ev_signal *w, int revents) {
@@ -54,73 +166,1032 @@ static void sigpipe_cb(struct ev_loop *loop, ev_signal *w, int revents) {
   ELOG("Received SIGPIPE. Ignoring.");
 }
 
-static void https_resp_cb(void *data, unsigned char *buf, unsigned int buflen) {
-  DLOG("buflen %u", buflen);
-  if (buf == NULL) { // Timeout, DNS failure, or something similar.
+static request_t *pending_find(app_state_t *app, uint32_t hash,
+                               const char *name, uint16_t type,
+                               const char *subnet) {
+  request_t *req = app->pending[hash % PENDING_BUCKETS];
+  for (; req; req = req->hnext) {
+    if (req->hash == hash && req->type == type &&
+        !strcmp(req->subnet, subnet) && !strcmp(req->name, name)) {
+      return req;
+    }
+  }
+  return NULL;
+}
+
+static void pending_remove(app_state_t *app, request_t *req) {
+  request_t **pp = &app->pending[req->hash % PENDING_BUCKETS];
+  while (*pp != req) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = req->hnext;
+}
+
+static void request_free(request_t *req) {
+  app_state_t *app = req->app;
+  waiter_t *w = req->waiters;
+  while (w) {
+    waiter_t *next = w->next;
+    if (w != &req->first) {
+      obj_pool_free(&app->waiter_pool, w);
+    }
+    w = next;
+  }
+  ev_timer_stop(app->loop, &req->hedge_timer);
+  METRIC_DEC(&app->metrics, in_flight);
+  obj_pool_free(&app->request_pool, req);
+}
+
+static void request_add_waiter(request_t *req, uint16_t tx_id, int rd,
+                               const dns_peer_t *peer) {
+  waiter_t *w = &req->first;
+  if (req->waiters) {
+    w = (waiter_t *)obj_pool_alloc(&req->app->waiter_pool);
+  }
+  w->tx_id = tx_id;
+  w->rd = rd != 0;
+  w->peer = *peer;
+  w->start = ev_now(req->app->loop);
+  w->next = req->waiters;
+  req->waiters = w;
+}
+
+// Sends 'pkt' to every waiter of 'req', each with its own transaction id
+// and RD bit.
+static void request_respond(request_t *req, char *pkt, int len) {
+  app_state_t *app = req->app;
+  ev_tstamp now = ev_now(app->loop);
+  waiter_t *w;
+  for (w = req->waiters; w; w = w->next) {
+    dns_packet_set_id((uint8_t *)pkt, w->tx_id, w->rd);
+    dns_server_respond(req->dns_server, &w->peer, pkt, len);
+    metrics_hist_observe(&app->metrics.client_latency, now - w->start);
+  }
+}
+
+// Answers the waiters of a failed lookup from an expired entry if there is
+// one, and with SERVFAIL otherwise, so clients need not wait for a timeout.
+static void request_respond_failure(request_t *req) {
+  app_state_t *app = req->app;
+  if (!req->waiters) {
     return;
   }
-  request_t *req = (request_t *)data;
-  if (req == NULL) {
-    FLOG("data NULL");
+  const dns_cache_entry_t *e = dns_cache_lookup_stale(
+      &app->cache, req->name, req->type, req->subnet, ev_now(app->loop));
+  if (e) {
+    DLOG("Serving stale answer for '%s'.", req->name);
+    METRIC_INC(&app->metrics, cache_stale);
+    char obuf[e->pktlen];
+    memcpy(obuf, e->pkt, e->pktlen);
+    dns_packet_set_ttl((uint8_t *)obuf, e->pktlen, STALE_ANSWER_TTL);
+    request_respond(req, obuf, e->pktlen);
+    return;
   }
-  unsigned int namelen = strlen(req->name);
-  unsigned int datalen = 0;
-  for (; ';' != buf[datalen] && datalen < buflen; ++datalen);
-  char *bufcpy = (char *)calloc(1, namelen + datalen + 2);
-  if (bufcpy == NULL) {
-    FLOG("Out of mem");
+  METRIC_INC(&app->metrics, servfail);
+  uint8_t obuf[DNS_HEADER_LENGTH + 258];
+  int r = dns_packet_empty_reply(0, 0, ns_r_servfail, req->name, req->type,
+                                 obuf, sizeof(obuf));
+  if (r > 0) {
+    request_respond(req, (char *)obuf, r);
+    return;
   }
-  memcpy(bufcpy, req->name, namelen);
-  memset(bufcpy + namelen, ':', 1);
-  memcpy(bufcpy + namelen + 1, buf, datalen);
+  waiter_t *w;
+  for (w = req->waiters; w; w = w->next) {
+    dns_server_release(req->dns_server, &w->peer);
+  }
+}
 
-  DLOG("Received response for id %04x: %.*s", req->tx_id, namelen + 1 + datalen, bufcpy);
+// Whether new upstream lookups would exceed the limit on those in flight.
+static int app_overloaded(const app_state_t *app) {
+  return app->max_in_flight > 0 &&
+         app->metrics.in_flight >= app->max_in_flight;
+}
 
-  const int obuf_size = 1500;
-  char obuf[obuf_size];
-  int r;
-  if ((r = text_to_dns(req->tx_id, bufcpy,
-                       (unsigned char *)obuf, obuf_size)) <= 0) {
-    ELOG("Failed to decode JSON.");
+// Answers a query that cannot be looked up now for lack of capacity, like
+// one whose lookup failed.
+static void respond_overloaded(app_state_t *app, dns_server_t *dns_server,
+                               const dns_peer_t *peer, uint16_t tx_id,
+                               int rd, const char *name, uint16_t type,
+                               const char *subnet) {
+  METRIC_INC(&app->metrics, overloaded);
+  const dns_cache_entry_t *e = dns_cache_lookup_stale(
+      &app->cache, name, type, subnet, ev_now(app->loop));
+  if (e) {
+    DLOG("Overloaded, serving stale answer for '%s'.", name);
+    METRIC_INC(&app->metrics, cache_stale);
+    char obuf[e->pktlen];
+    memcpy(obuf, e->pkt, e->pktlen);
+    dns_packet_set_id((uint8_t *)obuf, tx_id, rd);
+    dns_packet_set_ttl((uint8_t *)obuf, e->pktlen, STALE_ANSWER_TTL);
+    dns_server_respond(dns_server, peer, obuf, e->pktlen);
+    return;
+  }
+  DLOG("Overloaded, failing '%s'.", name);
+  METRIC_INC(&app->metrics, servfail);
+  uint8_t obuf[DNS_HEADER_LENGTH + 258];
+  int r = dns_packet_empty_reply(tx_id, rd, ns_r_servfail, name, type, obuf,
+                                 sizeof(obuf));
+  if (r > 0) {
+    dns_server_respond(dns_server, peer, (char *)obuf, r);
   } else {
-    dns_server_respond(req->dns_server, req->raddr, obuf, r);
+    dns_server_release(dns_server, peer);
+  }
+}
+
+static void request_fetch(request_t *req, attempt_t *a, int fresh);
+
+// Checks that an answer from a DoH upstream answers the query of 'req'
+// and applies the TTL bounds to it in place. Only NOERROR and NXDOMAIN are
+// relayed and cached, other codes fail the fetch like a timeout would.
+// Returns its length, or -1 if it cannot be relayed.
+static int doh_check_response(const request_t *req, uint8_t *buf,
+                              unsigned int buflen) {
+  const app_state_t *app = req->app;
+  if (buflen < DNS_HEADER_LENGTH || buflen > DNS_MAX_MSG ||
+      !(buf[2] & 0x80)) {
+    ELOG("Malformed response for '%s'.", req->name);
+    return -1;
+  }
+  int rcode = buf[3] & 0x0f;
+  if (rcode != ns_r_noerror && rcode != ns_r_nxdomain) {
+    DLOG("Upstream answered '%s' with rcode %d.", req->name, rcode);
+    return -1;
+  }
+  char name[DNS_MAX_NAME + 1];
+  int ofs = -1;
+  if (!memcmp(buf, req->query, 2) && buf[4] == 0 && buf[5] == 1) {
+    ofs = dns_packet_read_qname(buf, buflen, DNS_HEADER_LENGTH, name);
   }
-  free(bufcpy);
-  free(req);
+  if (ofs < 0 || ofs + 4 > (int)buflen || strcmp(name, req->name) ||
+      ((buf[ofs] << 8) | buf[ofs + 1]) != req->type) {
+    ELOG("Response does not match the query for '%s'.", req->name);
+    return -1;
+  }
+  if (dns_packet_clamp_ttl(buf, buflen, app->min_ttl, app->max_ttl)) {
+    ELOG("Malformed response for '%s'.", req->name);
+    return -1;
+  }
+  return buflen;
+}
+
+static void https_resp_cb(void *data, unsigned char *buf, unsigned int buflen,
+                          const struct https_fetch_times *times) {
+  DLOG("buflen %u", buflen);
+  attempt_t *a = (attempt_t *)data;
+  if (a == NULL) {
+    FLOG("data NULL");
+  }
+  request_t *req = a->req;
+  app_state_t *app = req->app;
+  attempt_t *other = &req->attempts[a == &req->attempts[0]];
+  a->fetch = NULL;
+  // Decoded first, as an answer that cannot be relayed fails the fetch: it
+  // is retried, or answered stale, and never cached. Large answer sets go
+  // out over TCP, or truncated over UDP.
+  char *pkt = NULL;
+  int r = -1;
+  if (buf && app->doh) {
+    // Relayed as received, request_respond patches the transaction id.
+    DLOG("Received %u byte response for '%s'", buflen, req->name);
+    pkt = (char *)buf;
+    r = doh_check_response(req, buf, buflen);
+  } else if (buf) {
+    pkt = (char *)a->answer;
+    r = text_parser_finish(&a->parser, app->min_ttl, app->max_ttl);
+    DLOG("Received %d answers for '%s'", a->parser.ancount, req->name);
+    if (r <= 0) {
+      ELOG("Failed to decode response for '%s' from %s.", req->name,
+           a->upstream->url);
+    }
+  }
+  upstream_report(a->upstream, r > 0, times->total);
+  metrics_t *m = &app->metrics;
+  if (r > 0) {
+    METRIC_INC(m, upstream_ok);
+  } else {
+    METRIC_INC(m, upstream_errors);
+  }
+  metrics_hist_observe(&m->upstream_namelookup, times->namelookup);
+  metrics_hist_observe(&m->upstream_connect, times->connect);
+  metrics_hist_observe(&m->upstream_starttransfer, times->starttransfer);
+  metrics_hist_observe(&m->upstream_total, times->total);
+  if (r <= 0) { // Timeout, DNS failure, undecodable answer or similar.
+    if (other->fetch) {
+      return; // The other attempt may still succeed.
+    }
+    ev_timer_stop(app->loop, &req->hedge_timer);
+    if (!req->retried && app->upstreams.num > 1) {
+      // Try the next best.
+      req->retried = 1;
+      METRIC_INC(&app->metrics, retries);
+      a->upstream =
+          upstream_select(&app->upstreams, a->upstream, ev_now(app->loop));
+      DLOG("Retrying '%s' on %s", req->name, a->upstream->url);
+      request_fetch(req, a, 0);
+      return;
+    }
+    pending_remove(app, req);
+    request_respond_failure(req);
+    request_free(req);
+    return;
+  }
+  ev_timer_stop(app->loop, &req->hedge_timer);
+  if (other->fetch) {
+    DLOG("Cancelling slower fetch of '%s' on %s", req->name,
+         other->upstream->url);
+    https_client_cancel(app->https_client, other->fetch);
+    other->fetch = NULL;
+  }
+  pending_remove(app, req);
+  dns_cache_insert(&app->cache, req->name, req->type, req->subnet,
+                   (uint8_t *)pkt, r, ev_now(app->loop));
+  request_respond(req, pkt, r);
+  request_free(req);
+}
+
+// Decodes an HTTPDNS body as it arrives. Malformed ones fail once complete.
+static int https_text_body_cb(void *data, const uint8_t *buf, size_t len) {
+  attempt_t *a = (attempt_t *)data;
+  text_parser_feed(&a->parser, (const char *)buf, len);
+  return 0;
+}
+
+// Sends the lookup for 'req' to 'a->upstream', on a new connection if
+// 'fresh' is set.
+static void request_fetch(request_t *req, attempt_t *a, int fresh) {
+  app_state_t *app = req->app;
+  const char *base = a->upstream->url;
+  a->req = req;
+
+  if (app->doh) {
+    a->fetch = https_client_post(app->https_client, base,
+                                 app->bootstrap->resolv, fresh, req->query,
+                                 req->querylen, https_resp_cb, a);
+    return;
+  }
+
+  // Build URL. Hostnames rarely need escaping at all, so it is done here
+  // rather than in a string allocated by curl_escape.
+  char escaped_name[DNS_MAX_NAME * 3 + 1];
+  char *e = escaped_name;
+  const char *n;
+  for (n = req->name; *n; n++) {
+    unsigned char ch = *n;
+    if (isalnum(ch) || ch == '-' || ch == '.' || ch == '_' || ch == '~') {
+      *e++ = ch;
+    } else {
+      e += sprintf(e, "%%%02X", ch);
+    }
+  }
+  *e = '\0';
+  char url[1500] = "";
+  snprintf(url, sizeof(url) - 1,
+           "%s%sdn=%s&ttl=1%s%s", base, strchr(base, '?') ? "&" : "?",
+           escaped_name, req->subnet[0] ? "&ip=" : "", req->subnet);
+
+  if (text_parser_init(&a->parser, 0, req->name, a->answer,
+                       sizeof(a->answer))) {
+    a->parser.error = 1; // Fails like an undecodable body.
+  }
+  a->fetch = https_client_fetch(app->https_client, url,
+                                app->bootstrap->resolv, fresh,
+                                https_text_body_cb, https_resp_cb, a);
+}
+
+// Races a second fetch against one that is taking unusually long, on
+// another endpoint if there is one and on another connection otherwise.
+static void hedge_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  request_t *req = (request_t *)w->data;
+  app_state_t *app = req->app;
+  if (app->hedge_tokens < 1) {
+    DLOG("Hedge budget exhausted, not hedging '%s'.", req->name);
+    return;
+  }
+  app->hedge_tokens -= 1;
+  METRIC_INC(&app->metrics, hedges);
+  attempt_t *first = &req->attempts[0];
+  attempt_t *hedge = &req->attempts[1];
+  hedge->upstream =
+      upstream_select(&app->upstreams, first->upstream, ev_now(loop));
+  DLOG("Hedging '%s' on %s", req->name, hedge->upstream->url);
+  request_fetch(req, hedge, hedge->upstream == first->upstream);
+}
+
+// Starts an upstream lookup for (name, type) on behalf of 'subnet' and
+// registers it as pending. 'pkt' is the client query that caused it. The
+// caller adds waiters; a prefetch has none. Returns NULL if the query cannot
+// be forwarded.
+static request_t *request_start(app_state_t *app, dns_server_t *dns_server,
+                                uint32_t hash, const char *name, int type,
+                                const subnet_t *subnet, const uint8_t *pkt,
+                                int pktlen) {
+  request_t *req = (request_t *)obj_pool_alloc(&app->request_pool);
+  if (app->doh) {
+    // Forwarded as received, EDNS options included, with id 0 as RFC 8484
+    // recommends for the benefit of HTTP caches. Queries too large to keep
+    // are rebuilt from the question alone, and so are those answered for a
+    // subnet, which then travels as their only EDNS option.
+    if (subnet->text[0] && subnet->prefix >= 0) {
+      req->querylen =
+          dns_packet_query_ecs(0, name, type, subnet->addr, subnet->prefix,
+                               req->query, sizeof(req->query));
+    } else if (pktlen <= (int)sizeof(req->query)) {
+      memcpy(req->query, pkt, pktlen);
+      req->querylen = pktlen;
+      req->query[0] = req->query[1] = 0;
+    } else {
+      req->querylen =
+          dns_packet_query(0, name, type, req->query, sizeof(req->query));
+    }
+    if (req->querylen <= 0) {
+      obj_pool_free(&app->request_pool, req);
+      return NULL;
+    }
+  }
+  METRIC_INC(&app->metrics, in_flight);
+  req->hash = hash;
+  req->type = type;
+  strcpy(req->subnet, subnet->text);
+  req->dns_server = dns_server;
+  req->app = app;
+  memcpy(req->name, name, strlen(name));
+  req->hnext = app->pending[hash % PENDING_BUCKETS];
+  app->pending[hash % PENDING_BUCKETS] = req;
+
+  attempt_t *a = &req->attempts[0];
+  a->upstream = upstream_select(&app->upstreams, NULL, ev_now(app->loop));
+  request_fetch(req, a, 0);
+
+  ev_timer_init(&req->hedge_timer, hedge_cb, 0, 0);
+  req->hedge_timer.data = req;
+  if (app->hedge_delay >= 0) {
+    app->hedge_tokens += app->hedge_ratio;
+    if (app->hedge_tokens > HEDGE_BURST) {
+      app->hedge_tokens = HEDGE_BURST;
+    }
+    ev_timer_set(&req->hedge_timer, app->hedge_delay > 0 ?
+                 app->hedge_delay : upstream_hedge_delay(a->upstream), 0);
+    ev_timer_start(app->loop, &req->hedge_timer);
+  }
+  return req;
+}
+
+// Returns the subnet answers for this client are tailored to, using 'buf'
+// if it has to be worked out.
+static const subnet_t *client_subnet(const app_state_t *app,
+                                     const dns_peer_t *peer,
+                                     const uint8_t *pkt, int pktlen,
+                                     subnet_t *buf) {
+  if (!app->client_subnet) {
+    return &app->default_subnet;
+  }
+  uint8_t addr[4];
+  int prefix;
+  int ecs = dns_packet_ecs(pkt, pktlen, addr, &prefix);
+  if (ecs > 0 && prefix == 0) {
+    // The client asks that no subnet be used (RFC 7871 section 7.1.2).
+    buf->text[0] = '\0';
+    buf->prefix = -1;
+    return buf;
+  }
+  if (ecs <= 0 && peer->addr.sa.sa_family != AF_INET) {
+    // Subnets are IPv4 only, so IPv6 clients get the default one.
+    return &app->default_subnet;
+  }
+  if (ecs <= 0) {
+    memcpy(addr, &peer->addr.in.sin_addr, sizeof(addr));
+    prefix = 32;
+  }
+  const subnet_t *mapped =
+      app->prefix_table ? subnet_table_lookup(app->prefix_table, addr) : NULL;
+  if (mapped) {
+    return mapped;
+  }
+  if (!subnet_is_public(addr)) {
+    return &app->default_subnet;
+  }
+  subnet_set(buf, addr,
+             prefix < SUBNET_CLIENT_PREFIX ? prefix : SUBNET_CLIENT_PREFIX);
+  return buf;
+}
+
+// The rate limit bucket of 'peer': its IPv4 address, or its IPv6 /64, as
+// a host is usually handed a whole one.
+static uint32_t peer_key(const dns_peer_t *peer) {
+  if (peer->addr.sa.sa_family == AF_INET) {
+    return ntohl(peer->addr.in.sin_addr.s_addr);
+  }
+  const uint8_t *a = peer->addr.in6.sin6_addr.s6_addr;
+  uint32_t key = 0;
+  int i;
+  for (i = 0; i < 8; i++) {
+    key = key * 31 + a[i];
+  }
+  return key;
 }
 
 static void dns_server_cb(dns_server_t *dns_server, void *data,
-                          struct sockaddr_in addr, uint16_t tx_id,
-                          uint16_t flags, const char *name, int type) {
+                          const dns_peer_t *peer, uint16_t tx_id,
+                          uint16_t flags, const char *name, int type,
+                          const uint8_t *pkt, int pktlen) {
   app_state_t *app = (app_state_t *)data;
 
   DLOG("Received request for '%s' id: %04x, type %d, flags %04x", name, tx_id,
        type, flags);
 
-  if (type != 1 || strlen(name) > 253) {
-    DLOG("Drop Received request for '%s' id: %04x, type %d", name, tx_id, type);
+  // Checked first, as dropping is the cheapest answer there is.
+  if (!rate_limit_allow(&app->rate_limit, peer_key(peer),
+                        ev_now(app->loop))) {
+    DLOG("Client over its rate, dropping '%s' id: %04x", name, tx_id);
+    METRIC_INC(&app->metrics, rate_limited);
+    dns_server_release(dns_server, peer);
     return;
   }
 
-  // Build URL
-  int cd_bit = flags & (1 << 4);
-  char *escaped_name = curl_escape(name, strlen(name));
-  char url[1500] = "";
-  snprintf(url, sizeof(url) - 1,
-           "http://119.29.29.29/d?dn=%s%s",
-           escaped_name, app->extra_request_args);
+  const struct local_name *local =
+      app->local_zone ? local_zone_lookup(app->local_zone, name) : NULL;
+  if (local) {
+    uint8_t obuf[DNS_SERVER_MAX_MSG];
+    int r = local_zone_reply(app->local_zone, local, tx_id, flags & (1 << 8),
+                             name, type, obuf, sizeof(obuf));
+    if (r > 0) {
+      DLOG("Answering '%s' id: %04x locally.", name, tx_id);
+      if (local->flags & LOCAL_HOST) {
+        METRIC_INC(&app->metrics, local_hosts);
+      } else {
+        METRIC_INC(&app->metrics, local_blocked);
+      }
+      dns_server_respond(dns_server, peer, (char *)obuf, r);
+    } else {
+      dns_server_release(dns_server, peer);
+    }
+    return;
+  }
 
-  request_t *req = (request_t *)calloc(1, sizeof(request_t));
+  if (!app->doh && type != ns_t_a) {
+    // DNSPod HTTPDNS only serves A records. Answer right away rather than
+    // leave the client waiting for its retry timeout.
+    int rcode = type == ns_t_aaaa ? app->aaaa_rcode : ns_r_refused;
+    if (rcode < 0) {
+      DLOG("Drop Received request for '%s' id: %04x, type %d", name, tx_id, type);
+      METRIC_INC(&app->metrics, dropped_aaaa);
+      dns_server_release(dns_server, peer);
+      return;
+    }
+    METRIC_INC(&app->metrics, unsupported);
+    DLOG("Refusing request for '%s' id: %04x, type %d, rcode %d", name, tx_id,
+         type, rcode);
+    uint8_t obuf[DNS_SERVER_MAX_MSG];
+    int r = dns_packet_empty_reply(tx_id, flags & (1 << 8), rcode, name, type,
+                                   obuf, sizeof(obuf));
+    if (r > 0) {
+      dns_server_respond(dns_server, peer, (char *)obuf, r);
+    } else {
+      dns_server_release(dns_server, peer);
+    }
+    return;
+  }
+
+  ev_tstamp now = ev_now(app->loop);
+  subnet_t subnet_buf;
+  const subnet_t *subnet =
+      client_subnet(app, peer, pkt, pktlen, &subnet_buf);
+  uint32_t hash = dns_cache_key_hash(name, type, subnet->text);
+  request_t *req = pending_find(app, hash, name, type, subnet->text);
+
+  const dns_cache_entry_t *hit =
+      dns_cache_lookup(&app->cache, name, type, subnet->text, now);
+  if (hit) {
+    DLOG("Cache hit for '%s' id: %04x", name, tx_id);
+    METRIC_INC(&app->metrics, cache_hits);
+    char obuf[hit->pktlen];
+    memcpy(obuf, hit->pkt, hit->pktlen);
+    dns_packet_set_id((uint8_t *)obuf, tx_id, flags & (1 << 8));
+    // Clients count down from what is left, not from when it was stored.
+    ev_tstamp age = hit->ttl - (hit->expiry - now);
+    if (age >= 1) {
+      dns_packet_age_ttl((uint8_t *)obuf, hit->pktlen, (uint32_t)age);
+    }
+    // Refresh hot entries in the background before they expire.
+    int prefetch = !req && !app_overloaded(app) && app->bootstrap->ready &&
+                   hit->expiry - now < hit->ttl * PREFETCH_FRACTION;
+    dns_server_respond(dns_server, peer, obuf, hit->pktlen);
+    // In loop time, answers from the cache take no time at all.
+    metrics_hist_observe(&app->metrics.client_latency, 0);
+    if (prefetch) {
+      DLOG("Prefetching '%s'.", name);
+      METRIC_INC(&app->metrics, prefetches);
+      request_start(app, dns_server, hash, name, type, subnet, pkt,
+                    pktlen);
+    }
+    return;
+  }
+
+  METRIC_INC(&app->metrics, cache_misses);
+  if (req) {
+    DLOG("Joining lookup in flight for '%s' id: %04x", name, tx_id);
+    METRIC_INC(&app->metrics, coalesced);
+  } else if (app_overloaded(app)) {
+    respond_overloaded(app, dns_server, peer, tx_id, flags & (1 << 8), name,
+                       type, subnet->text);
+    return;
+  } else if (!app->bootstrap->ready) {
+    // Only at startup, for a few seconds at most. The client will retry.
+    DLOG("Upstreams not looked up yet, dropping '%s' id: %04x", name, tx_id);
+    METRIC_INC(&app->metrics, bootstrapping);
+    dns_server_release(dns_server, peer);
+    return;
+  } else {
+    req = request_start(app, dns_server, hash, name, type, subnet, pkt,
+                        pktlen);
+  }
   if (!req) {
+    DLOG("Cannot forward request for '%s'.", name);
+    METRIC_INC(&app->metrics, dropped_unforwardable);
+    dns_server_release(dns_server, peer);
+    return;
+  }
+  request_add_waiter(req, tx_id, flags & (1 << 8), peer);
+}
+
+// Refreshes the connection to every upstream that went unused since the
+// last tick, so the next query does not pay for a handshake.
+static void keepalive_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  app_state_t *app = (app_state_t *)w->data;
+  ev_tstamp now = ev_now(loop);
+  if (!app->bootstrap->ready) {
+    return; // Connecting now would ask the system resolver.
+  }
+  int i;
+  for (i = 0; i < app->upstreams.num; i++) {
+    upstream_t *up = &app->upstreams.list[i];
+    if (now - up->last_used >= w->repeat) {
+      https_client_warm(app->https_client, up->url, app->bootstrap->resolv);
+    }
+  }
+}
+
+// Warms connections as soon as upstream addresses are known or change,
+// unless keepalive is off or the worker is draining.
+static void bootstrapped_cb(bootstrap_t *b, void *data) {
+  app_state_t *app = (app_state_t *)data;
+  if (b->ready && ev_is_active(&app->keepalive_timer)) {
+    ev_timer_stop(app->loop, &app->keepalive_timer);
+    ev_timer_set(&app->keepalive_timer, 0, app->keepalive_timer.repeat);
+    ev_timer_start(app->loop, &app->keepalive_timer);
+  }
+}
+
+// A self-contained proxy instance: one event loop, a listener per listen
+// address, curl multi handle, cache and pending table. Workers share
+// nothing but options.
+typedef struct {
+  int id;
+  int num_listeners;
+  int socks[MAX_LISTEN_ADDRS];
+  int tcp_socks[MAX_LISTEN_ADDRS]; // -1 without TCP.
+  options_t *opt;
+  struct ev_loop *loop;
+  https_client_t https_client;
+  bootstrap_t bootstrap;
+  app_state_t app;
+  dns_server_t *dns_servers; // One per listen address.
+  char snapshot_file[PATH_MAX + 16]; // Empty without -f.
+  ev_timer snapshot_timer;
+
+  ev_async stop;
+  // Options reloaded on SIGHUP, handed over by the main thread.
+  ev_async reload;
+  options_t *reload_opt;
+  // Stops serving once another process has taken the sockets over.
+  ev_async drain;
+  ev_timer drain_timer;
+  ev_tstamp drain_start;
+  pthread_t thread;
+} worker_t;
+
+// The snapshot of worker 'id', numbered so that any number of workers reads
+// back what any other number saved.
+static void snapshot_path(const char *base, int id, char *out, size_t size) {
+  if (id == 0) {
+    snprintf(out, size, "%s", base);
+  } else {
+    snprintf(out, size, "%s.%d", base, id);
+  }
+}
+
+static void worker_save_cache(worker_t *w) {
+  if (dns_cache_save(&w->app.cache, w->snapshot_file) < 0) {
+    WLOG("Failed to save cache to '%s': %s", w->snapshot_file,
+         strerror(errno));
+  } else {
+    DLOG("Saved %zu cached answers to '%s'.", w->app.cache.entries,
+         w->snapshot_file);
+  }
+}
+
+static void snapshot_cb(struct ev_loop *loop, ev_timer *t, int revents) {
+  worker_save_cache((worker_t *)t->data);
+}
+
+// Every worker loads all snapshots, as SO_REUSEPORT may hand it any query.
+static void worker_load_cache(worker_t *w) {
+  ev_tstamp now = ev_time();
+  int i, total = 0;
+  for (i = 0;; i++) {
+    char path[sizeof(w->snapshot_file)];
+    snapshot_path(w->opt->snapshot_file, i, path, sizeof(path));
+    int r = dns_cache_load(&w->app.cache, path, now);
+    if (r < 0) {
+      if (errno != ENOENT) {
+        WLOG("Failed to load cache from '%s': %s", path, strerror(errno));
+      }
+      break;
+    }
+    total += r;
+  }
+  if (total > 0) {
+    ILOG("Worker %d loaded %d cached answers.", w->id, total);
+  }
+}
+
+// Applies the options that may change while running, at startup and again
+// on every reload.
+static void app_configure(app_state_t *app, options_t *opt) {
+  app->client_subnet = opt->client_subnet;
+  app->prefix_table = opt->prefix_table;
+  app->local_zone = opt->local_zone;
+  rate_limit_set_rate(&app->rate_limit, opt->client_qps);
+  app->max_in_flight = opt->max_in_flight;
+  // Sent verbatim as the "ip" parameter even if it is not a plain subnet.
+  if (subnet_parse(opt->edns_client_subnet, &app->default_subnet)) {
+    app->default_subnet.prefix = -1;
+  }
+  snprintf(app->default_subnet.text, sizeof(app->default_subnet.text), "%s",
+           opt->edns_client_subnet);
+  app->min_ttl = opt->min_ttl;
+  app->max_ttl = opt->max_ttl;
+  app->aaaa_rcode = opt->aaaa_rcode;
+  app->hedge_delay = opt->hedge_delay_ms / 1000.0;
+  app->hedge_ratio = opt->hedge_budget / 100.0;
+  app->cache.max_stale = opt->max_stale;
+  ev_timer_stop(app->loop, &app->keepalive_timer);
+  ev_timer_set(&app->keepalive_timer, 0, opt->keepalive);
+  if (opt->keepalive > 0) {
+    // The first tick connects to every upstream right away.
+    ev_timer_start(app->loop, &app->keepalive_timer);
+  }
+}
+
+static void worker_init(worker_t *w) {
+  options_t *opt = w->opt;
+  https_client_init(&w->https_client, opt, w->loop);
+
+  app_state_t *app = &w->app;
+  app->loop = w->loop;
+  app->https_client = &w->https_client;
+  app->bootstrap = &w->bootstrap;
+  app->doh = opt->doh;
+  memset(app->pending, 0, sizeof(app->pending));
+  memset(&app->metrics, 0, sizeof(app->metrics));
+  rate_limit_init(&app->rate_limit, 0);
+  obj_pool_init(&app->request_pool, sizeof(request_t), 32);
+  obj_pool_init(&app->waiter_pool, sizeof(waiter_t), 64);
+  dns_cache_init(&app->cache, opt->cache_entries, opt->cache_bytes,
+                 opt->max_stale);
+  w->snapshot_file[0] = '\0';
+  ev_timer_init(&w->snapshot_timer, snapshot_cb, opt->snapshot_interval,
+                opt->snapshot_interval);
+  w->snapshot_timer.data = w;
+  if (opt->snapshot_file) {
+    // Loaded before the server starts, so hits begin with the first query.
+    worker_load_cache(w);
+    snapshot_path(opt->snapshot_file, w->id, w->snapshot_file,
+                  sizeof(w->snapshot_file));
+    if (opt->snapshot_interval > 0) {
+      ev_timer_start(w->loop, &w->snapshot_timer);
+    }
+  }
+  upstream_set_init(&app->upstreams, opt->upstreams, opt->num_upstreams);
+  app->hedge_tokens = 0;
+  ev_timer_init(&app->keepalive_timer, keepalive_cb, 0, opt->keepalive);
+  app->keepalive_timer.data = app;
+  app_configure(app, opt);
+  bootstrap_init(&w->bootstrap, w->loop, opt, bootstrapped_cb, app);
+  ev_init(&w->drain_timer, NULL);
+
+  w->dns_servers =
+      (dns_server_t *)calloc(w->num_listeners, sizeof(dns_server_t));
+  if (!w->dns_servers) {
     FLOG("Out of mem");
   }
-  req->tx_id = tx_id;
-  req->raddr = addr;
-  req->dns_server = dns_server;
-  memcpy(req->name, escaped_name, strlen(escaped_name));
-  curl_free(escaped_name);
+  int i;
+  for (i = 0; i < w->num_listeners; i++) {
+    dns_server_init(&w->dns_servers[i], w->loop, w->socks[i],
+                    w->tcp_socks[i], opt->tcp_clients, &app->metrics,
+                    dns_server_cb, app);
+  }
+}
+
+// Switches worker 'w' over to reloaded options 'opt', keeping its cache,
+// connections and lookups in flight.
+static void worker_reconfigure(worker_t *w, options_t *opt) {
+  app_configure(&w->app, opt);
+  upstream_set_update(&w->app.upstreams, opt->upstreams, opt->num_upstreams);
+  https_client_reconfigure(&w->https_client, opt);
+  bootstrap_reconfigure(&w->bootstrap, opt);
+  ev_timer_stop(w->loop, &w->snapshot_timer);
+  ev_timer_set(&w->snapshot_timer, opt->snapshot_interval,
+               opt->snapshot_interval);
+  if (w->snapshot_file[0] && opt->snapshot_interval > 0) {
+    ev_timer_start(w->loop, &w->snapshot_timer);
+  }
+  // Published last, the main thread frees options no worker points at.
+  __atomic_store_n(&w->opt, opt, __ATOMIC_RELEASE);
+}
+
+static void worker_reload_cb(struct ev_loop *loop, ev_async *a, int revents) {
+  worker_t *w = (worker_t *)a->data;
+  options_t *opt = __atomic_exchange_n(&w->reload_opt, NULL, __ATOMIC_ACQUIRE);
+  if (opt) {
+    worker_reconfigure(w, opt);
+  }
+}
+
+static void drain_cb(struct ev_loop *loop, ev_timer *t, int revents) {
+  worker_t *w = (worker_t *)t->data;
+  if (w->app.metrics.in_flight <= 0) {
+    ev_break(loop, EVBREAK_ALL);
+  } else if (ev_now(loop) - w->drain_start >= DRAIN_TIMEOUT) {
+    WLOG("Worker %d gave up on %lld lookups in flight.", w->id,
+         (long long)w->app.metrics.in_flight);
+    ev_break(loop, EVBREAK_ALL);
+  }
+}
+
+// Stops reading queries, which now go to the process the sockets were
+// handed to, and stops the loop once the lookups in flight are answered.
+static void worker_drain(worker_t *w) {
+  int i;
+  for (i = 0; i < w->num_listeners; i++) {
+    dns_server_stop(&w->dns_servers[i]);
+  }
+  ev_timer_stop(w->loop, &w->app.keepalive_timer);
+  w->drain_start = ev_now(w->loop);
+  ev_timer_init(&w->drain_timer, drain_cb, 0, DRAIN_INTERVAL);
+  w->drain_timer.data = w;
+  ev_timer_start(w->loop, &w->drain_timer);
+}
+
+static void worker_drain_cb(struct ev_loop *loop, ev_async *a, int revents) {
+  worker_drain((worker_t *)a->data);
+}
+
+static void worker_cleanup(worker_t *w) {
+  ev_timer_stop(w->loop, &w->app.keepalive_timer);
+  ev_timer_stop(w->loop, &w->snapshot_timer);
+  ev_timer_stop(w->loop, &w->drain_timer);
+  if (w->snapshot_file[0]) {
+    worker_save_cache(w);
+  }
+  // Lookups still in flight are dropped before the listeners they answer
+  // through.
+  https_client_cleanup(&w->https_client);
+  bootstrap_cleanup(&w->bootstrap);
+  int i;
+  for (i = 0; i < w->num_listeners; i++) {
+    dns_server_cleanup(&w->dns_servers[i]);
+  }
+  free(w->dns_servers);
+  dns_cache_cleanup(&w->app.cache);
+  obj_pool_cleanup(&w->app.waiter_pool);
+  obj_pool_cleanup(&w->app.request_pool);
+}
+
+static void worker_stop_cb(struct ev_loop *loop, ev_async *w, int revents) {
+  ev_break(loop, EVBREAK_ALL);
+}
+
+// The loop is destroyed by the main thread once the thread is joined, so
+// it may still signal the loop after it stopped by itself.
+static void *worker_main(void *data) {
+  worker_t *w = (worker_t *)data;
+  ev_run(w->loop, 0);
+  ev_async_stop(w->loop, &w->stop);
+  ev_async_stop(w->loop, &w->reload);
+  ev_async_stop(w->loop, &w->drain);
+  worker_cleanup(w);
+  return NULL;
+}
+
+// Starts worker 'w' on its own thread, optionally pinned to a CPU.
+static void worker_start(worker_t *w) {
+  ev_async_init(&w->stop, worker_stop_cb);
+  ev_async_start(w->loop, &w->stop);
+  ev_async_init(&w->reload, worker_reload_cb);
+  w->reload.data = w;
+  ev_async_start(w->loop, &w->reload);
+  ev_async_init(&w->drain, worker_drain_cb);
+  w->drain.data = w;
+  ev_async_start(w->loop, &w->drain);
+
+  // Signals are left to the main thread's default loop.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  if (pthread_create(&w->thread, NULL, worker_main, w)) {
+    FLOG("Failed to start worker %d.", w->id);
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (w->opt->pin_workers) {
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->id % (ncpu > 0 ? ncpu : 1), &set);
+    if (pthread_setaffinity_np(w->thread, sizeof(set), &set)) {
+      WLOG("Failed to pin worker %d.", w->id);
+    }
+  }
+}
+
+// Workers whose metrics the stats endpoint sums up.
+typedef struct {
+  worker_t *workers;
+  int num;
+} stats_state_t;
+
+static void stats_cb(void *data, metrics_buf_t *b) {
+  stats_state_t *st = (stats_state_t *)data;
+  metrics_t *m[st->num];
+  int i;
+  for (i = 0; i < st->num; i++) {
+    m[i] = &st->workers[i].app.metrics;
+  }
+  metrics_render(b, m, st->num);
+}
+
+// Options parsed on SIGHUP. Older ones are freed once no worker uses them.
+typedef struct options_gen_s {
+  struct options_gen_s *next;
+  options_t opt;
+} options_gen_t;
+
+// State of the main thread's loop.
+typedef struct {
+  struct ev_loop *loop;
+  int argc;
+  char **argv;
+  worker_t *workers;
+  int num_workers;
+  options_t *opt; // The options in effect.
+  options_gen_t *gens; // Newest first.
+  stats_server_t *stats_server; // NULL unless serving.
+  int draining; // The sockets were handed over.
+} control_t;
+
+static int options_gen_in_use(control_t *ctl, options_t *opt) {
+  if (opt == ctl->opt || (ctl->gens && ctl->gens->next &&
+                          opt == &ctl->gens->next->opt)) {
+    // The newest two stay, a worker may be just switching between them.
+    return 1;
+  }
+  int i;
+  for (i = 0; i < ctl->num_workers; i++) {
+    worker_t *w = &ctl->workers[i];
+    if (__atomic_load_n(&w->opt, __ATOMIC_ACQUIRE) == opt ||
+        __atomic_load_n(&w->reload_opt, __ATOMIC_ACQUIRE) == opt) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void options_gen_collect(control_t *ctl, int all) {
+  options_gen_t **pp = &ctl->gens;
+  while (*pp) {
+    options_gen_t *g = *pp;
+    if (!all && options_gen_in_use(ctl, &g->opt)) {
+      pp = &g->next;
+      continue;
+    }
+    *pp = g->next;
+    options_cleanup(&g->opt);
+    free(g);
+  }
+}
+
+// Options that only take effect at startup keep the values in use, with a
+// warning if the reloaded ones differ.
+#define RELOAD_KEEP(field, flag)                                        \
+  do {                                                                  \
+    if (n->field != o->field) {                                         \
+      WLOG("Changing %s needs a restart.", flag);                       \
+      n->field = o->field;                                              \
+    }                                                                   \
+  } while (0)
+#define RELOAD_KEEP_STR(field, flag)                                    \
+  do {                                                                  \
+    if ((n->field == NULL) != (o->field == NULL) ||                     \
+        (n->field && strcmp(n->field, o->field))) {                     \
+      WLOG("Changing %s needs a restart.", flag);                       \
+    }                                                                   \
+    n->field = o->field;                                                \
+  } while (0)
+
+static void options_keep_startup(options_t *n, const options_t *o) {
+  int i;
+  int same = n->num_listen_addrs == o->num_listen_addrs;
+  for (i = 0; same && i < n->num_listen_addrs; i++) {
+    same = !strcmp(n->listen_addrs[i], o->listen_addrs[i]);
+  }
+  if (!same) {
+    WLOG("Changing -a needs a restart.");
+  }
+  memcpy(n->listen_addrs, o->listen_addrs, sizeof(n->listen_addrs));
+  n->num_listen_addrs = o->num_listen_addrs;
+  RELOAD_KEEP(listen_port, "-p");
+  RELOAD_KEEP(workers, "-w");
+  RELOAD_KEEP(pin_workers, "-W");
+  RELOAD_KEEP(tcp_clients, "-T");
+  RELOAD_KEEP(doh, "-D");
+  RELOAD_KEEP(cache_entries, "-c");
+  RELOAD_KEEP(cache_bytes, "-C");
+  RELOAD_KEEP(stats_port, "-s");
+  RELOAD_KEEP_STR(logfile, "-l");
+  RELOAD_KEEP_STR(handoff_path, "-U");
+  RELOAD_KEEP(daemonize, "-d");
+  // Made absolute at startup, so not compared.
+  n->snapshot_file = o->snapshot_file;
+  n->stats_addr = o->stats_addr;
+  n->user = o->user;
+  n->group = o->group;
+  n->uid = o->uid;
+  n->gid = o->gid;
+  // Log lines keep going where they went.
+  if (n->logfd > 0 && n->logfd != o->logfd && n->logfd != STDOUT_FILENO) {
+    close(n->logfd);
+  }
+  n->logfd = -1;
+}
+
+// Parses the command line and the options file again and applies what
+// can change without a restart.
+static void sighup_cb(struct ev_loop *loop, ev_signal *w, int revents) {
+  control_t *ctl = (control_t *)w->data;
+  if (ctl->draining) {
+    return;
+  }
+  options_gen_collect(ctl, 0);
+  options_gen_t *g = (options_gen_t *)calloc(1, sizeof(options_gen_t));
+  if (!g) {
+    ELOG("Out of mem, not reloading.");
+    return;
+  }
+  options_init(&g->opt);
+  if (options_parse_args(&g->opt, ctl->argc, ctl->argv)) {
+    ELOG("Failed to parse the reloaded options, keeping the current ones.");
+    options_cleanup(&g->opt);
+    free(g);
+    return;
+  }
+  options_keep_startup(&g->opt, ctl->opt);
+  g->next = ctl->gens;
+  ctl->gens = g;
+  ctl->opt = &g->opt;
+  logging_set_level(g->opt.loglevel);
 
-  https_client_fetch(app->https_client, url, app->resolv, https_resp_cb, req);
+  int i;
+  if (ctl->num_workers == 1) {
+    worker_reconfigure(&ctl->workers[0], ctl->opt);
+  } else {
+    for (i = 0; i < ctl->num_workers; i++) {
+      worker_t *w = &ctl->workers[i];
+      __atomic_store_n(&w->reload_opt, ctl->opt, __ATOMIC_RELEASE);
+      ev_async_send(w->loop, &w->reload);
+    }
+  }
+  ILOG("Reloaded options, %d upstreams.", ctl->opt->num_upstreams);
+}
+
+// Another process serves the sockets now. Finishes what is in flight here
+// and exits.
+static void handed_off_cb(void *data) {
+  control_t *ctl = (control_t *)data;
+  ctl->draining = 1;
+  if (ctl->stats_server) {
+    stats_server_cleanup(ctl->stats_server);
+    ctl->stats_server = NULL;
+  }
+  int i;
+  if (ctl->num_workers == 1) {
+    worker_drain(&ctl->workers[0]); // Breaks the main loop when done.
+    return;
+  }
+  for (i = 0; i < ctl->num_workers; i++) {
+    ev_async_send(ctl->workers[i].loop, &ctl->workers[i].drain);
+  }
+  ev_break(ctl->loop, EVBREAK_ALL);
 }
 
 int main(int argc, char *argv[]) {
@@ -141,30 +1212,93 @@ int main(int argc, char *argv[]) {
   // tricks to increase it's entropy pool. This confuses valgrind and leaks
   // through to errors about use of uninitialized values in our code. :(
   curl_global_init(CURL_GLOBAL_DEFAULT);
+  ares_library_init(ARES_LIB_INIT_ALL);
 
-  // Note: This calls ev_default_loop(0) which never cleans up.
-  //       valgrind will report a leak. :(
-  struct ev_loop *loop = EV_DEFAULT;
-
-  https_client_t https_client;
-  https_client_init(&https_client, &opt, loop);
+  // Take the sockets over from a running instance if there is one, so no
+  // query goes unanswered while the binary is upgraded. Sockets it has and
+  // we do not want are closed, those we want and it has not are bound.
+  int from_fds[HANDOFF_MAX_FDS];
+  int num_from = 0;
+  int handoff_conn = -1;
+  if (opt.handoff_path) {
+    num_from = handoff_receive(opt.handoff_path, from_fds, HANDOFF_MAX_FDS,
+                               &handoff_conn);
+    if (num_from < 0) {
+      num_from = 0;
+    }
+  }
 
-  app_state_t app;
-  app.https_client = &https_client;
-  app.resolv = NULL;
-  if (opt.edns_client_subnet[0]) {
-    static char buf[200];
-    memset(buf, 0, sizeof(buf));
-    snprintf(buf, sizeof(buf)-1, "&ip=%s",
-             opt.edns_client_subnet);
-    app.extra_request_args = buf;
-  } else {
-    app.extra_request_args = "";
+  // Bind before dropping privileges. With several workers each one gets its
+  // own SO_REUSEPORT sockets and the kernel spreads queries across them.
+  worker_t *workers = (worker_t *)calloc(opt.workers, sizeof(worker_t));
+  if (!workers) {
+    FLOG("Out of mem");
+  }
+  // Sockets that may be handed over share their address, so a successor
+  // with more workers can bind sockets of its own next to them.
+  int reuse_port = opt.workers > 1;
+#ifdef SO_REUSEPORT
+  if (opt.handoff_path) {
+    reuse_port = 1;
+  }
+#endif
+  int i, j;
+  for (i = 0; i < opt.workers; i++) {
+    worker_t *w = &workers[i];
+    w->id = i;
+    w->opt = &opt;
+    w->num_listeners = opt.num_listen_addrs;
+    for (j = 0; j < w->num_listeners; j++) {
+      const char *addr = opt.listen_addrs[j];
+      dns_addr_t laddr;
+      dns_server_parse_addr(addr, opt.listen_port, &laddr);
+      w->socks[j] = handoff_take(from_fds, &num_from, SOCK_DGRAM, &laddr.sa);
+      if (w->socks[j] < 0) {
+        w->socks[j] =
+            dns_server_listen(addr, opt.listen_port, reuse_port);
+      }
+      w->tcp_socks[j] = -1;
+      if (opt.tcp_clients > 0) {
+        w->tcp_socks[j] =
+            handoff_take(from_fds, &num_from, SOCK_STREAM, &laddr.sa);
+      }
+      if (opt.tcp_clients > 0 && w->tcp_socks[j] < 0) {
+        w->tcp_socks[j] =
+            dns_server_listen_tcp(addr, opt.listen_port, reuse_port);
+      }
+    }
+  }
+  int stats_sock = -1;
+  if (opt.stats_port) {
+    dns_addr_t saddr;
+    if (dns_server_parse_addr(opt.stats_addr, opt.stats_port, &saddr) == 0) {
+      stats_sock = handoff_take(from_fds, &num_from, SOCK_STREAM, &saddr.sa);
+    }
+    if (stats_sock < 0) {
+      stats_sock = stats_server_listen(opt.stats_addr, opt.stats_port);
+    }
+  }
+  for (i = 0; i < num_from; i++) {
+    close(from_fds[i]);
+  }
+  int handoff_sock = -1;
+  if (opt.handoff_path) {
+    handoff_sock = handoff_listen(opt.handoff_path);
   }
 
-  dns_server_t dns_server;
-  dns_server_init(&dns_server, loop, opt.listen_addr, opt.listen_port,
-                  dns_server_cb, &app);
+  // daemon() changes to the root directory.
+  static char snapshot_file[PATH_MAX];
+  if (opt.snapshot_file && opt.snapshot_file[0] != '/') {
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd))) {
+      FLOG("Failed to get the working directory.");
+    }
+    if (snprintf(snapshot_file, sizeof(snapshot_file), "%s/%s", cwd,
+                 opt.snapshot_file) >= (int)sizeof(snapshot_file)) {
+      FLOG("Snapshot path too long.");
+    }
+    opt.snapshot_file = snapshot_file;
+  }
 
   if (opt.daemonize) {
     if (setgid(opt.gid)) {
@@ -176,6 +1310,88 @@ int main(int argc, char *argv[]) {
     // daemon() is non-standard. If needed, see OpenSSH openbsd-compat/daemon.c
     daemon(0, 0);
   }
+  // Threads do not survive daemon(), so the log writer starts after it.
+  logging_start();
+
+  // Note: This calls ev_default_loop(0) which never cleans up.
+  //       valgrind will report a leak. :(
+  struct ev_loop *loop = EV_DEFAULT;
+
+  // A single worker runs on the default loop, as it always has.
+  if (opt.workers == 1) {
+    workers[0].loop = loop;
+    worker_init(&workers[0]);
+  } else {
+    for (i = 0; i < opt.workers; i++) {
+      if (!(workers[i].loop = ev_loop_new(EVFLAG_AUTO))) {
+        FLOG("Failed to create loop for worker %d.", i);
+      }
+      worker_init(&workers[i]);
+      worker_start(&workers[i]);
+    }
+    ILOG("Started %d workers.", opt.workers);
+  }
+  if (opt.snapshot_file) {
+    // Everything is loaded, drop snapshots of workers we no longer have.
+    for (i = opt.workers;; i++) {
+      char path[sizeof(workers[0].snapshot_file)];
+      snapshot_path(opt.snapshot_file, i, path, sizeof(path));
+      if (unlink(path) < 0) {
+        break;
+      }
+    }
+  }
+  if (handoff_conn >= 0) {
+    // We are serving, the old instance may stop reading.
+    handoff_ready(handoff_conn);
+  }
+
+  control_t ctl;
+  memset(&ctl, 0, sizeof(ctl));
+  ctl.loop = loop;
+  ctl.argc = argc;
+  ctl.argv = argv;
+  ctl.workers = workers;
+  ctl.num_workers = opt.workers;
+  ctl.opt = &opt;
+
+  // Scrapes are served from the main loop, whichever worker runs on it.
+  stats_state_t stats_state = { workers, opt.workers };
+  stats_server_t stats_server;
+  if (stats_sock >= 0) {
+    stats_server_init(&stats_server, loop, stats_sock, stats_cb,
+                      &stats_state);
+    ctl.stats_server = &stats_server;
+  }
+
+  handoff_server_t handoff_server;
+  if (handoff_sock >= 0) {
+    // Counted in full, so that too many disable handoffs.
+    int fds[HANDOFF_MAX_FDS];
+    int n = 0;
+    for (i = 0; i < opt.workers; i++) {
+      for (j = 0; j < workers[i].num_listeners; j++) {
+        if (n < HANDOFF_MAX_FDS) {
+          fds[n] = workers[i].socks[j];
+        }
+        n++;
+        if (workers[i].tcp_socks[j] >= 0) {
+          if (n < HANDOFF_MAX_FDS) {
+            fds[n] = workers[i].tcp_socks[j];
+          }
+          n++;
+        }
+      }
+    }
+    if (stats_sock >= 0) {
+      if (n < HANDOFF_MAX_FDS) {
+        fds[n] = stats_sock;
+      }
+      n++;
+    }
+    handoff_server_init(&handoff_server, loop, handoff_sock,
+                        opt.handoff_path, fds, n, handed_off_cb, &ctl);
+  }
 
   ev_signal sigpipe;
   ev_signal_init(&sigpipe, sigpipe_cb, SIGPIPE);
@@ -185,20 +1401,47 @@ int main(int argc, char *argv[]) {
   ev_signal_init(&sigint, sigint_cb, SIGINT);
   ev_signal_start(loop, &sigint);
 
-  logging_flush_init(loop);
+  // Stops like SIGINT, saving the cache on the way out.
+  ev_signal sigterm;
+  ev_signal_init(&sigterm, sigint_cb, SIGTERM);
+  ev_signal_start(loop, &sigterm);
 
-  ev_run(loop, 0);
+  ev_signal sighup;
+  ev_signal_init(&sighup, sighup_cb, SIGHUP);
+  sighup.data = &ctl;
+  ev_signal_start(loop, &sighup);
 
-  curl_slist_free_all(app.resolv);
+  ev_run(loop, 0);
 
   ev_signal_stop(loop, &sigint);
-  dns_server_cleanup(&dns_server);
-  https_client_cleanup(&https_client);
+  ev_signal_stop(loop, &sigterm);
+  ev_signal_stop(loop, &sighup);
+  if (handoff_sock >= 0) {
+    handoff_server_cleanup(&handoff_server);
+  }
+  if (ctl.stats_server) {
+    stats_server_cleanup(ctl.stats_server);
+  }
+  if (opt.workers == 1) {
+    worker_cleanup(&workers[0]);
+  } else {
+    // Draining workers stop by themselves.
+    for (i = 0; !ctl.draining && i < opt.workers; i++) {
+      ev_async_send(workers[i].loop, &workers[i].stop);
+    }
+    for (i = 0; i < opt.workers; i++) {
+      pthread_join(workers[i].thread, NULL);
+      ev_loop_destroy(workers[i].loop);
+    }
+  }
+  free(workers);
 
   ev_loop_destroy(loop);
 
+  ares_library_cleanup();
   curl_global_cleanup();
   logging_cleanup();
+  options_gen_collect(&ctl, 1);
   options_cleanup(&opt);
 
   return EXIT_SUCCESS;
@@ -0,0 +1,213 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "metrics.h"
+
+static int hist_bucket(uint64_t us) {
+  if (us < (1 << METRICS_HIST_SUB_BITS)) {
+    return us;
+  }
+  int msb = 63 - __builtin_clzll(us);
+  int shift = msb - METRICS_HIST_SUB_BITS;
+  int idx = (shift + 1) << METRICS_HIST_SUB_BITS |
+            ((us >> shift) & ((1 << METRICS_HIST_SUB_BITS) - 1));
+  return idx < METRICS_HIST_BUCKETS ? idx : METRICS_HIST_BUCKETS - 1;
+}
+
+// Returns the exclusive upper bound of bucket 'idx' in microseconds.
+static uint64_t hist_bucket_limit(int idx) {
+  if (idx < (1 << METRICS_HIST_SUB_BITS)) {
+    return idx + 1;
+  }
+  int shift = (idx >> METRICS_HIST_SUB_BITS) - 1;
+  uint64_t sub = idx & ((1 << METRICS_HIST_SUB_BITS) - 1);
+  return ((1 << METRICS_HIST_SUB_BITS) + sub + 1) << shift;
+}
+
+void metrics_hist_observe(metrics_hist_t *h, double seconds) {
+  uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+  METRIC_INC(h, buckets[hist_bucket(us)]);
+  METRIC_ADD(h, sum_us, us);
+}
+
+void metrics_printf(metrics_buf_t *b, const char *fmt, ...) {
+  for (;;) {
+    va_list args;
+    va_start(args, fmt);
+    int r = vsnprintf(b->buf + b->len, b->size - b->len, fmt, args);
+    va_end(args);
+    if (r < 0) {
+      return;
+    }
+    if (b->len + r < b->size) {
+      b->len += r;
+      return;
+    }
+    size_t new_size = b->size ? b->size * 2 : 4096;
+    while (new_size <= b->len + r) {
+      new_size *= 2;
+    }
+    char *new_buf = (char *)realloc(b->buf, new_size);
+    if (!new_buf) {
+      FLOG("Out of mem");
+    }
+    b->buf = new_buf;
+    b->size = new_size;
+  }
+}
+
+void metrics_render_value(metrics_buf_t *b, const char *name,
+                          const char *type, const char *help,
+                          const char *labels, double value) {
+  if (help) {
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  }
+  if (labels) {
+    metrics_printf(b, "%s{%s} %.17g\n", name, labels, value);
+  } else {
+    metrics_printf(b, "%s %.17g\n", name, value);
+  }
+}
+
+#define SUM(field) sum_field(m, n, offsetof(metrics_t, field))
+
+static double sum_field(metrics_t *const *m, int n, size_t ofs) {
+  uint64_t total = 0;
+  int i;
+  for (i = 0; i < n; i++) {
+    total += __atomic_load_n((uint64_t *)((char *)m[i] + ofs),
+                             __ATOMIC_RELAXED);
+  }
+  return (double)total;
+}
+
+static void render_hist(metrics_buf_t *b, const char *name, const char *help,
+                        const char *labels, metrics_t *const *m, int n,
+                        size_t ofs) {
+  if (help) {
+    metrics_printf(b, "# HELP %s %s\n# TYPE %s histogram\n", name, help,
+                   name);
+  }
+  const char *sep = labels ? "," : "";
+  labels = labels ? labels : "";
+  uint64_t cumulative = 0;
+  int idx;
+  for (idx = 0; idx < METRICS_HIST_BUCKETS; idx++) {
+    int i;
+    for (i = 0; i < n; i++) {
+      const metrics_hist_t *h = (const metrics_hist_t *)((char *)m[i] + ofs);
+      cumulative += __atomic_load_n(&h->buckets[idx], __ATOMIC_RELAXED);
+    }
+    if (idx == METRICS_HIST_BUCKETS - 1) {
+      metrics_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+                     sep, (unsigned long long)cumulative);
+    } else {
+      metrics_printf(b, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, sep,
+                     hist_bucket_limit(idx) / 1e6,
+                     (unsigned long long)cumulative);
+    }
+  }
+  double sum = sum_field(m, n, ofs + offsetof(metrics_hist_t, sum_us)) / 1e6;
+  if (*labels) {
+    metrics_printf(b, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", name, labels,
+                   sum, name, labels, (unsigned long long)cumulative);
+  } else {
+    metrics_printf(b, "%s_sum %.6f\n%s_count %llu\n", name, sum, name,
+                   (unsigned long long)cumulative);
+  }
+}
+
+#define HIST(field) offsetof(metrics_t, field)
+
+void metrics_render(metrics_buf_t *b, metrics_t *const *m, int n) {
+  metrics_render_value(b, "dns_queries_total", "counter",
+                       "Queries received.", "transport=\"udp\"",
+                       SUM(queries_udp));
+  metrics_render_value(b, "dns_queries_total", "counter", NULL,
+                       "transport=\"tcp\"", SUM(queries_tcp));
+
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       "Queries not forwarded upstream, by reason.",
+                       "reason=\"unsupported_type\"", SUM(unsupported));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"aaaa_dropped\"", SUM(dropped_aaaa));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"unforwardable\"",
+                       SUM(dropped_unforwardable));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"malformed\"", SUM(malformed));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"rate_limited\"", SUM(rate_limited));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"overloaded\"", SUM(overloaded));
+  metrics_render_value(b, "dns_queries_not_forwarded_total", "counter",
+                       NULL, "reason=\"bootstrapping\"", SUM(bootstrapping));
+  metrics_render_value(b, "dns_local_answers_total", "counter",
+                       "Queries answered locally, by source.",
+                       "source=\"hosts\"", SUM(local_hosts));
+  metrics_render_value(b, "dns_local_answers_total", "counter", NULL,
+                       "source=\"blocklist\"", SUM(local_blocked));
+  metrics_render_value(b, "dns_truncated_total", "counter",
+                       "UDP replies truncated to the client's size.", NULL,
+                       SUM(truncated));
+  metrics_render_value(b, "dns_tcp_refused_total", "counter",
+                       "TCP connections over the client limit.", NULL,
+                       SUM(tcp_refused));
+  metrics_render_value(b, "dns_servfail_total", "counter",
+                       "Lookups answered with SERVFAIL.", NULL,
+                       SUM(servfail));
+
+  metrics_render_value(b, "dns_cache_hits_total", "counter",
+                       "Queries answered from the cache.", NULL,
+                       SUM(cache_hits));
+  metrics_render_value(b, "dns_cache_misses_total", "counter",
+                       "Queries not found in the cache.", NULL,
+                       SUM(cache_misses));
+  metrics_render_value(b, "dns_cache_stale_total", "counter",
+                       "Lookups answered from expired entries.", NULL,
+                       SUM(cache_stale));
+  metrics_render_value(b, "dns_coalesced_total", "counter",
+                       "Queries joining a lookup in flight.", NULL,
+                       SUM(coalesced));
+  metrics_render_value(b, "dns_prefetches_total", "counter",
+                       "Lookups refreshing hot cache entries.", NULL,
+                       SUM(prefetches));
+  metrics_render_value(b, "dns_in_flight", "gauge",
+                       "Upstream lookups in flight.", NULL,
+                       SUM(in_flight));
+
+  metrics_render_value(b, "dns_upstream_fetches_total", "counter",
+                       "Upstream transfers by outcome.", "result=\"ok\"",
+                       SUM(upstream_ok));
+  metrics_render_value(b, "dns_upstream_fetches_total", "counter", NULL,
+                       "result=\"error\"", SUM(upstream_errors));
+  metrics_render_value(b, "dns_upstream_hedges_total", "counter",
+                       "Second transfers raced against slow ones.", NULL,
+                       SUM(hedges));
+  metrics_render_value(b, "dns_upstream_retries_total", "counter",
+                       "Transfers retried on another upstream.", NULL,
+                       SUM(retries));
+
+  render_hist(b, "dns_upstream_seconds",
+              "Time into upstream transfers by phase, as libcurl reports.",
+              "phase=\"namelookup\"", m, n, HIST(upstream_namelookup));
+  render_hist(b, "dns_upstream_seconds", NULL, "phase=\"connect\"", m, n,
+              HIST(upstream_connect));
+  render_hist(b, "dns_upstream_seconds", NULL, "phase=\"starttransfer\"", m,
+              n, HIST(upstream_starttransfer));
+  render_hist(b, "dns_upstream_seconds", NULL, "phase=\"total\"", m, n,
+              HIST(upstream_total));
+  render_hist(b, "dns_client_latency_seconds",
+              "Time from receiving a query to answering it.", NULL, m, n,
+              HIST(client_latency));
+}
+
+void metrics_buf_free(metrics_buf_t *b) {
+  free(b->buf);
+  b->buf = NULL;
+  b->len = b->size = 0;
+}
@@ -0,0 +1,97 @@
+// Always-on counters and latency histograms, rendered in the Prometheus
+// text exposition format.
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear histogram buckets, four per power of two of microseconds
+// (a precision of 25%), from 1us to about 30s. The last one takes the rest.
+#define METRICS_HIST_SUB_BITS 2
+#define METRICS_HIST_BUCKETS 96
+
+// Every worker keeps its own metrics and is the only one writing them, so
+// updates are plain relaxed loads and stores, without locked instructions.
+// The stats endpoint reads them from another thread and sums them up.
+#define METRIC_ADD(m, field, n)                              \
+  __atomic_store_n(&(m)->field,                              \
+                   __atomic_load_n(&(m)->field, __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+#define METRIC_INC(m, field) METRIC_ADD(m, field, 1)
+#define METRIC_DEC(m, field) METRIC_ADD(m, field, -1)
+
+typedef struct {
+  uint64_t buckets[METRICS_HIST_BUCKETS];
+  uint64_t sum_us;
+} metrics_hist_t;
+
+// The metrics of a single worker.
+typedef struct {
+  // Queries by transport, and those answered without an upstream lookup
+  // or not answered at all, by reason.
+  uint64_t queries_udp;
+  uint64_t queries_tcp;
+  uint64_t unsupported;   // Types the upstream cannot answer.
+  uint64_t dropped_aaaa;  // -A drop.
+  uint64_t dropped_unforwardable;
+  uint64_t rate_limited;  // Clients over -R.
+  uint64_t overloaded;    // Lookups over -Q, answered stale or SERVFAIL.
+  uint64_t bootstrapping; // Before upstream hosts were looked up.
+  uint64_t servfail;      // Upstream failed and nothing stale to serve.
+  uint64_t malformed;
+  uint64_t truncated;     // UDP replies cut short for the client's size.
+  uint64_t tcp_refused;   // Connections over the TCP client limit.
+  uint64_t local_hosts;   // Answered from the hosts file.
+  uint64_t local_blocked; // Blocklisted.
+
+  uint64_t cache_hits;
+  uint64_t cache_misses;
+  uint64_t cache_stale;   // Expired answers served on upstream failure.
+  uint64_t coalesced;     // Queries joining a lookup in flight.
+  uint64_t prefetches;
+
+  uint64_t upstream_ok;
+  uint64_t upstream_errors;
+  uint64_t hedges;
+  uint64_t retries;
+  int64_t in_flight;      // Upstream lookups, not counting hedges.
+
+  metrics_hist_t upstream_namelookup;
+  metrics_hist_t upstream_connect;
+  metrics_hist_t upstream_starttransfer;
+  metrics_hist_t upstream_total;
+  metrics_hist_t client_latency; // From query receipt to answer.
+} metrics_t;
+
+// A growing text buffer.
+typedef struct {
+  char *buf;
+  size_t len;
+  size_t size;
+} metrics_buf_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void metrics_hist_observe(metrics_hist_t *h, double seconds);
+
+void metrics_printf(metrics_buf_t *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Appends a counter or gauge with its HELP and TYPE lines. 'labels' is
+// e.g. "phase=\"total\"" or NULL; 'help' NULL continues the previous
+// metric with another label set.
+void metrics_render_value(metrics_buf_t *b, const char *name,
+                          const char *type, const char *help,
+                          const char *labels, double value);
+
+// Appends the sum of 'n' workers' metrics.
+void metrics_render(metrics_buf_t *b, metrics_t *const *m, int n);
+
+void metrics_buf_free(metrics_buf_t *b);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _METRICS_H_
@@ -0,0 +1,72 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "obj_pool.h"
+
+// Free objects and chunks are chained through their first word.
+struct obj_pool_link {
+  struct obj_pool_link *next;
+};
+
+// Chunk headers are padded so objects keep the strictest alignment.
+#define CHUNK_HEADER_SIZE 16
+
+void obj_pool_init(obj_pool_t *p, size_t obj_size, size_t per_chunk) {
+  memset(p, 0, sizeof(*p));
+  if (obj_size < sizeof(struct obj_pool_link)) {
+    obj_size = sizeof(struct obj_pool_link);
+  }
+  // Round up so every object in a chunk stays aligned.
+  p->obj_size = (obj_size + sizeof(void *) * 2 - 1) & ~(sizeof(void *) * 2 - 1);
+  p->per_chunk = per_chunk ? per_chunk : 1;
+}
+
+static void obj_pool_grow(obj_pool_t *p) {
+  uint8_t *chunk =
+      (uint8_t *)malloc(CHUNK_HEADER_SIZE + p->obj_size * p->per_chunk);
+  if (!chunk) {
+    FLOG("Out of mem");
+  }
+  ((struct obj_pool_link *)chunk)->next = (struct obj_pool_link *)p->chunks;
+  p->chunks = chunk;
+
+  size_t i;
+  for (i = 0; i < p->per_chunk; i++) {
+    struct obj_pool_link *l =
+        (struct obj_pool_link *)(chunk + CHUNK_HEADER_SIZE + i * p->obj_size);
+    l->next = (struct obj_pool_link *)p->free_list;
+    p->free_list = l;
+  }
+}
+
+void *obj_pool_alloc(obj_pool_t *p) {
+  if (!p->free_list) {
+    obj_pool_grow(p);
+  }
+  struct obj_pool_link *l = (struct obj_pool_link *)p->free_list;
+  p->free_list = l->next;
+  p->in_use++;
+  memset(l, 0, p->obj_size);
+  return l;
+}
+
+void obj_pool_free(obj_pool_t *p, void *obj) {
+  struct obj_pool_link *l = (struct obj_pool_link *)obj;
+  l->next = (struct obj_pool_link *)p->free_list;
+  p->free_list = l;
+  p->in_use--;
+}
+
+void obj_pool_cleanup(obj_pool_t *p) {
+  struct obj_pool_link *c = (struct obj_pool_link *)p->chunks;
+  while (c) {
+    struct obj_pool_link *next = c->next;
+    free(c);
+    c = next;
+  }
+  p->chunks = NULL;
+  p->free_list = NULL;
+  p->in_use = 0;
+}
@@ -0,0 +1,35 @@
+// A fixed-size object allocator for hot-path structures.
+#ifndef _OBJ_POOL_H_
+#define _OBJ_POOL_H_
+
+#include <stddef.h>
+
+// Objects are carved out of chunks that are only released by
+// obj_pool_cleanup, so steady-state allocation never reaches malloc.
+typedef struct {
+  size_t obj_size;
+  size_t per_chunk;
+  void *free_list;
+  void *chunks;
+  size_t in_use;
+} obj_pool_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Initializes a pool of 'obj_size' byte objects grown 'per_chunk' at a time.
+void obj_pool_init(obj_pool_t *p, size_t obj_size, size_t per_chunk);
+
+// Returns a zeroed object. Never returns NULL.
+void *obj_pool_alloc(obj_pool_t *p);
+
+// Puts 'obj' back on the free list.
+void obj_pool_free(obj_pool_t *p, void *obj);
+
+// Releases every chunk. Outstanding objects become invalid.
+void obj_pool_cleanup(obj_pool_t *p);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _OBJ_POOL_H_
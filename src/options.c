@@ -1,6 +1,9 @@
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <grp.h>
@@ -11,12 +14,22 @@
 #include <unistd.h>
 
 #include "logging.h"
+#include "local_zone.h"
 #include "options.h"
+#include "rate_limit.h"
+#include "subnet.h"
 
 void options_init(struct Options *opt) {
-  opt->listen_addr = "0.0.0.0";
+  opt->listen_addrs[0] = "0.0.0.0";
+  opt->num_listen_addrs = 0; // The default applies until -a is given.
   opt->listen_port = 5353;
   opt->edns_client_subnet = "";
+  opt->client_subnet = 0;
+  opt->prefix_file = NULL;
+  opt->prefix_table = NULL;
+  opt->hosts_file = NULL;
+  opt->blocklist_file = NULL;
+  opt->local_zone = NULL;
   opt->logfile = "-";
   opt->logfd = -1;
   opt->loglevel = LOG_ERROR;
@@ -27,23 +40,188 @@ void options_init(struct Options *opt) {
   opt->gid = -1;
   //new as from https://dnsprivacy.org/wiki/display/DP/DNS+Privacy+Test+Servers
   opt->bootstrap_dns = "8.8.8.8,8.8.4.4,145.100.185.15,145.100.185.16,185.49.141.37,199.58.81.218,80.67.188.188"; 
+  opt->upstreams[0] = "http://119.29.29.29/d";
+  opt->num_upstreams = 0; // The default applies until -r is given.
+  opt->doh = 0;
+  opt->hedge_delay_ms = 0;
+  opt->hedge_budget = 5;
+  opt->max_total_connections = 8;
+  opt->max_host_connections = 0;
+  opt->max_idle_connections = 8;
+  opt->keepalive = 20;
+  opt->client_qps = 0;
+  opt->max_in_flight = 1024;
   opt->curl_proxy = NULL;
   opt->use_http_1_1 = 0;
+  opt->aaaa_rcode = ns_r_noerror;
+  opt->min_ttl = 0;
+  opt->max_ttl = 0;
+  opt->tcp_clients = 32;
+  opt->stats_addr = "127.0.0.1";
+  opt->stats_port = 0;
+  opt->workers = 1;
+  opt->pin_workers = 0;
+  opt->cache_entries = 4096;
+  opt->cache_bytes = 1024 * 1024;
+  opt->max_stale = 86400;
+  opt->snapshot_file = NULL;
+  opt->snapshot_interval = 0;
+  opt->options_file = NULL;
+  opt->options_buf = NULL;
+  opt->options_argv = NULL;
+  opt->handoff_path = NULL;
 }
 
-int options_parse_args(struct Options *opt, int argc, char **argv) {
+// Whether 'csv' is a list of servers as c-ares takes them: IPv4 or IPv6
+// addresses separated by commas, each optionally with a port as in
+// "1.2.3.4:53" or "[::1]:53".
+static int valid_servers(const char *csv) {
+  char buf[1024];
+  if (!csv[0] || strlen(csv) >= sizeof(buf)) {
+    return 0;
+  }
+  strcpy(buf, csv);
+  char *save = NULL;
+  char *s;
+  for (s = strtok_r(buf, ",", &save); s; s = strtok_r(NULL, ",", &save)) {
+    unsigned char addr[16];
+    char *port = NULL;
+    if (s[0] == '[') {
+      char *end = strchr(s, ']');
+      if (!end || (end[1] && end[1] != ':')) {
+        return 0;
+      }
+      *end = '\0';
+      port = end[1] ? end + 2 : NULL;
+      s++;
+    } else if (inet_pton(AF_INET6, s, addr) != 1 && strchr(s, ':')) {
+      port = strchr(s, ':');
+      *port++ = '\0';
+    }
+    if (inet_pton(AF_INET, s, addr) != 1 &&
+        inet_pton(AF_INET6, s, addr) != 1) {
+      return 0;
+    }
+    if (port && (atoi(port) <= 0 || atoi(port) > 65535)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Reads 'path' and splits it into words, each an argument. '#' starts a
+// comment running to the end of the line. Returns the number of words
+// after a leading 'argv0', or -1 if the file cannot be read.
+static int options_read_file(struct Options *opt, const char *path,
+                             char *argv0) {
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("Options file '%s' is not readable.\n", path);
+    return -1;
+  }
+  size_t len = 0, size = 1024;
+  char *buf = (char *)malloc(size);
+  size_t r;
+  while (buf && (r = fread(buf + len, 1, size - len - 1, f)) > 0) {
+    len += r;
+    if (len + 1 == size) {
+      char *grown = (char *)realloc(buf, size * 2);
+      if (!grown) {
+        free(buf);
+      }
+      buf = grown;
+      size *= 2;
+    }
+  }
+  fclose(f);
+  if (!buf) {
+    printf("Out of memory reading '%s'.\n", path);
+    return -1;
+  }
+  buf[len] = '\0';
+
+  // At most one word per two bytes, plus argv0 and the terminating NULL.
+  char **argv = (char **)malloc((len / 2 + 3) * sizeof(char *));
+  if (!argv) {
+    free(buf);
+    printf("Out of memory reading '%s'.\n", path);
+    return -1;
+  }
+  int argc = 0;
+  argv[argc++] = argv0;
+  char *p = buf;
+  while (*p) {
+    if (isspace((unsigned char)*p)) {
+      *p++ = '\0';
+    } else if (*p == '#') {
+      while (*p && *p != '\n') {
+        *p++ = '\0';
+      }
+    } else {
+      argv[argc++] = p;
+      while (*p && !isspace((unsigned char)*p)) {
+        p++;
+      }
+    }
+  }
+  argv[argc] = NULL;
+  opt->options_buf = buf;
+  opt->options_argv = argv;
+  return argc;
+}
+
+// Applies the flags in 'argv'. 'in_file' is set for those of the options
+// file, which may not name another one.
+static int options_parse_flags(struct Options *opt, int argc, char **argv,
+                               int in_file) {
+  int replace_upstreams = 1;
+  int replace_listen_addrs = 1;
   int c;
-  while ((c = getopt(argc, argv, "a:p:e:du:g:t:l:vxh")) != -1) {
+  optind = 0; // Rescans from the start, in glibc and musl alike.
+  while ((c = getopt(argc, argv, "a:p:e:du:g:b:r:t:l:vxA:m:M:c:C:S:w:WH:B:n:N:K:k:DT:s:f:F:o:U:EP:L:Z:R:Q:h")) != -1) {
     switch (c) {
-    case 'a': // listen_addr
-      opt->listen_addr = optarg;
+    case 'a': { // listen_addrs
+      if (replace_listen_addrs) {
+        opt->num_listen_addrs = 0;
+        replace_listen_addrs = 0;
+      }
+      if (opt->num_listen_addrs == MAX_LISTEN_ADDRS) {
+        printf("At most %d listen addresses are supported.\n",
+               MAX_LISTEN_ADDRS);
+        return -1;
+      }
+      struct in6_addr addr;
+      if (inet_pton(AF_INET, optarg, &addr) != 1 &&
+          inet_pton(AF_INET6, optarg, &addr) != 1) {
+        printf("Listen address '%s' is not an IPv4 or IPv6 address.\n",
+               optarg);
+        return -1;
+      }
+      opt->listen_addrs[opt->num_listen_addrs++] = optarg;
       break;
+    }
     case 'p': // listen_port
       opt->listen_port = atoi(optarg);
       break;
     case 'e': // edns_client_subnet
+      if (strlen(optarg) > MAX_SUBNET_LENGTH) {
+        printf("Subnet '%s' is too long.\n", optarg);
+        return -1;
+      }
       opt->edns_client_subnet = optarg;
       break;
+    case 'E': // client subnet
+      opt->client_subnet = 1;
+      break;
+    case 'P': // prefix table
+      opt->prefix_file = optarg;
+      break;
+    case 'L': // hosts file
+      opt->hosts_file = optarg;
+      break;
+    case 'Z': // blocklist
+      opt->blocklist_file = optarg;
+      break;
     case 'd': // daemonize
       opt->daemonize = 1;
       break;
@@ -54,8 +232,51 @@ int options_parse_args(struct Options *opt, int argc, char **argv) {
       opt->group = optarg;
       break;
     case 'b': // bootstrap dns servers
+      if (!valid_servers(optarg)) {
+        printf("Bootstrap servers '%s' are not a list of addresses.\n",
+               optarg);
+        return -1;
+      }
       opt->bootstrap_dns = optarg;
       break;
+    case 'r': // upstream
+      if (replace_upstreams) {
+        opt->num_upstreams = 0;
+        replace_upstreams = 0;
+      }
+      if (opt->num_upstreams == MAX_UPSTREAMS) {
+        printf("At most %d upstreams are supported.\n", MAX_UPSTREAMS);
+        return -1;
+      }
+      opt->upstreams[opt->num_upstreams++] = optarg;
+      break;
+    case 'D': // doh
+      opt->doh = 1;
+      break;
+    case 'H': // hedge delay
+      opt->hedge_delay_ms = atoi(optarg);
+      break;
+    case 'B': // hedge budget
+      opt->hedge_budget = atoi(optarg);
+      break;
+    case 'n': // max total connections
+      opt->max_total_connections = atoi(optarg);
+      break;
+    case 'N': // max host connections
+      opt->max_host_connections = atoi(optarg);
+      break;
+    case 'K': // max idle connections
+      opt->max_idle_connections = atoi(optarg);
+      break;
+    case 'k': // keepalive
+      opt->keepalive = atoi(optarg);
+      break;
+    case 'R': // client qps
+      opt->client_qps = atoi(optarg);
+      break;
+    case 'Q': // max in flight
+      opt->max_in_flight = atoi(optarg);
+      break;
     case 't': // curl http proxy
       opt->curl_proxy = optarg;
       break;
@@ -68,6 +289,81 @@ int options_parse_args(struct Options *opt, int argc, char **argv) {
     case 'x': // http/1.1
       opt->use_http_1_1 = 1;
       break;
+    case 'A': // aaaa reply
+      if (!strcmp(optarg, "nodata")) {
+        opt->aaaa_rcode = ns_r_noerror;
+      } else if (!strcmp(optarg, "refused")) {
+        opt->aaaa_rcode = ns_r_refused;
+      } else if (!strcmp(optarg, "drop")) {
+        opt->aaaa_rcode = -1;
+      } else {
+        printf("Unknown AAAA reply '%s'.\n", optarg);
+        return -1;
+      }
+      break;
+    case 'm': // min ttl
+      opt->min_ttl = atoi(optarg);
+      break;
+    case 'M': // max ttl
+      opt->max_ttl = atoi(optarg);
+      break;
+    case 'c': // cache entries
+      opt->cache_entries = atoi(optarg);
+      break;
+    case 'C': // cache bytes
+      opt->cache_bytes = atoi(optarg);
+      break;
+    case 'S': // max stale
+      opt->max_stale = atoi(optarg);
+      break;
+    case 'f': // snapshot file
+      opt->snapshot_file = optarg;
+      break;
+    case 'F': // snapshot interval
+      opt->snapshot_interval = atoi(optarg);
+      break;
+    case 'T': // tcp clients
+      opt->tcp_clients = atoi(optarg);
+      break;
+    case 's': { // stats endpoint, [addr:]port
+      // Copied rather than cut short in place, so argv parses again alike.
+      const char *colon = strrchr(optarg, ':');
+      if (colon) {
+        // IPv6 addresses come in brackets, e.g. "[::1]:9100".
+        const char *addr = optarg;
+        int len = colon - optarg;
+        if (len >= 2 && addr[0] == '[' && addr[len - 1] == ']') {
+          addr++;
+          len -= 2;
+        }
+        if (len >= (int)sizeof(opt->stats_addr_buf)) {
+          printf("Stats address '%s' is too long.\n", optarg);
+          return -1;
+        }
+        memcpy(opt->stats_addr_buf, addr, len);
+        opt->stats_addr_buf[len] = '\0';
+        opt->stats_addr = opt->stats_addr_buf;
+        optarg = (char *)colon + 1;
+      }
+      opt->stats_port = atoi(optarg);
+      break;
+    }
+    case 'o': // options file
+      if (in_file) {
+        printf("Options files cannot include others.\n");
+        return -1;
+      }
+      opt->options_file = optarg;
+      break;
+    case 'U': // handoff socket
+      opt->handoff_path = optarg;
+      break;
+    case 'w': // workers
+      opt->workers = atoi(optarg);
+      break;
+    case 'W': // pin workers
+      opt->pin_workers = 1;
+      break;
     case 'h':
       return -1;
     case '?':
@@ -78,6 +374,55 @@ int options_parse_args(struct Options *opt, int argc, char **argv) {
       exit(EXIT_FAILURE);
     }
   }
+  if (in_file && optind < argc) {
+    printf("Unexpected argument '%s'.\n", argv[optind]);
+    return -1;
+  }
+  return 0;
+}
+
+int options_parse_args(struct Options *opt, int argc, char **argv) {
+  if (options_parse_flags(opt, argc, argv, 0)) {
+    return -1;
+  }
+  if (opt->options_file) {
+    int fargc = options_read_file(opt, opt->options_file, argv[0]);
+    if (fargc < 0 || options_parse_flags(opt, fargc, opt->options_argv, 1)) {
+      return -1;
+    }
+  }
+  if (opt->prefix_file) {
+    opt->prefix_table = (subnet_table_t *)malloc(sizeof(subnet_table_t));
+    if (!opt->prefix_table ||
+        subnet_table_load(opt->prefix_table, opt->prefix_file)) {
+      free(opt->prefix_table);
+      opt->prefix_table = NULL;
+      return -1;
+    }
+    opt->client_subnet = 1;
+  }
+  if (opt->hosts_file || opt->blocklist_file) {
+    opt->local_zone = (local_zone_t *)malloc(sizeof(local_zone_t));
+    if (!opt->local_zone || local_zone_load(opt->local_zone, opt->hosts_file,
+                                            opt->blocklist_file)) {
+      free(opt->local_zone);
+      opt->local_zone = NULL;
+      return -1;
+    }
+  }
+  if (opt->num_listen_addrs == 0) {
+    opt->num_listen_addrs = 1;
+  }
+  if (opt->num_upstreams == 0) {
+    if (opt->doh) {
+      opt->upstreams[0] = DOH_DEFAULT_UPSTREAM;
+    }
+    opt->num_upstreams = 1;
+  }
+  if (opt->workers < 1) {
+    printf("Need at least one worker.\n");
+    return -1;
+  }
   if (opt->daemonize) {
     struct passwd *p;
     if (!(p = getpwnam(opt->user)) || !p->pw_uid) {
@@ -105,36 +450,136 @@ int options_parse_args(struct Options *opt, int argc, char **argv) {
 void options_show_usage(int argc, char **argv) {
   struct Options defaults;
   options_init(&defaults);
-  printf("Usage: %s [-a <listen_addr>] [-p <listen_port>]\n", argv[0]);
+  printf("Usage: %s [-a <listen_addr>]... [-p <listen_port>]\n", argv[0]);
   printf("        [-e <subnet>] [-d] [-u <user>] [-g <group>] [-l <logfile>]\n");
-  printf("  -a listen_addr    Local address to bind to. (%s)\n",
-         defaults.listen_addr);
+  printf("        [-r <upstream_url>]... [-A <aaaa_reply>] [-m <min_ttl>]\n");
+  printf("        [-M <max_ttl>] [-c <cache_entries>] [-C <cache_bytes>]\n");
+  printf("        [-S <max_stale>] [-w <workers>] [-W] [-H <hedge_ms>]\n");
+  printf("        [-B <hedge_budget>] [-n <max_conns>] [-N <max_host_conns>]\n");
+  printf("        [-K <max_idle_conns>] [-k <keepalive>] [-D]\n");
+  printf("        [-R <client_qps>] [-Q <max_in_flight>] [-b <dns_servers>]\n");
+  printf("        [-T <tcp_clients>] [-s <[stats_addr:]stats_port>]\n");
+  printf("        [-f <snapshot_file>] [-F <snapshot_interval>]\n");
+  printf("        [-o <options_file>] [-U <handoff_socket>] [-E]\n");
+  printf("        [-P <prefix_file>] [-L <hosts_file>] [-Z <blocklist>]\n");
+  printf("  -a listen_addr    Local IPv4 or IPv6 address to bind to, may be\n"
+         "                    repeated. (%s)\n",
+         defaults.listen_addrs[0]);
   printf("  -p listen_port    Local port to bind to. (%d)\n",
          defaults.listen_port);
   printf("  -e subnet_addr    An edns-client-subnet to use such as "
                              "\"203.31.0.0/16\". (%s)\n",
          defaults.edns_client_subnet);
+  printf("  -E                Derive the subnet from each client, from its\n"
+         "                    Client Subnet option or else its address, as a\n"
+         "                    /24. Private addresses use -e.\n");
+  printf("  -P prefix_file    Map client prefixes to subnets, one\n"
+         "                    \"client_prefix subnet\" pair per line, the\n"
+         "                    longest prefix winning. Implies -E.\n");
+  printf("  -L hosts_file     Answer the names in this hosts file locally.\n");
+  printf("  -Z blocklist      Answer NXDOMAIN for these domains and their\n"
+         "                    subdomains, one per line or hosts file style.\n");
   printf("  -d                Daemonize.\n");
   printf("  -u user           User to drop to launched as root. (%s)\n",
          defaults.user);
   printf("  -g group          Group to drop to launched as root. (%s)\n",
          defaults.group);
+  printf("  -r upstream_url   HTTPDNS endpoint, may be repeated. Queries go to the\n"
+         "                    fastest healthy one and fail over to the next.\n"
+         "                    (%s)\n", defaults.upstreams[0]);
+  printf("  -D                Upstreams are DNS-over-HTTPS (RFC 8484) endpoints.\n"
+         "                    Any query type is forwarded. (%s)\n",
+         DOH_DEFAULT_UPSTREAM);
+  printf("  -H hedge_ms       Race a second fetch after this many ms without an\n"
+         "                    answer, 0 adapts to upstream latency, -1 disables.\n"
+         "                    (%d)\n", defaults.hedge_delay_ms);
+  printf("  -B hedge_budget   Most hedged fetches in percent of requests. (%d)\n",
+         defaults.hedge_budget);
+  printf("  -n max_conns      Most upstream connections at once. (%d)\n",
+         defaults.max_total_connections);
+  printf("  -N max_host_conns Most connections to one host, 0 is unlimited. (%d)\n",
+         defaults.max_host_connections);
+  printf("  -K max_idle_conns Most idle connections kept for reuse. (%d)\n",
+         defaults.max_idle_connections);
+  printf("  -k keepalive      Seconds between requests keeping idle upstream\n"
+         "                    connections warm, 0 disables. (%d)\n",
+         defaults.keepalive);
+  printf("  -R client_qps     Queries per second a client address may send,\n"
+         "                    with bursts of %d seconds' worth, 0 is\n"
+         "                    unlimited. (%d)\n",
+         RATE_LIMIT_BURST, defaults.client_qps);
+  printf("  -Q max_in_flight  Most upstream lookups in flight per worker,\n"
+         "                    past which cache misses get stale answers or\n"
+         "                    SERVFAIL. 0 is unlimited. (%d)\n",
+         defaults.max_in_flight);
   printf("  -t proxy_server   Optional HTTP proxy. e.g. socks5://127.0.0.1:1080\n");
   printf("                    Remote name resolution will be used if the protocol\n");
   printf("                    supports it (http, https, socks4a, socks5h), otherwise\n");
   printf("                    initial DNS resolution will still be done via the\n");
   printf("                    bootstrap DNS servers.\n");
+  printf("  -b dns_servers    Servers upstream host names are looked up on,\n"
+         "                    as comma separated addresses with optional\n"
+         "                    ports. (%s)\n",
+         defaults.bootstrap_dns);
   printf("  -l logfile        Path to file to log to. (%s)\n",
          defaults.logfile);
   printf("  -x                Use HTTP/1.1 instead of HTTP/2. Useful with broken\n"
          "                    or limited builds of libcurl (false).\n");
+  printf("  -A aaaa_reply     Reply to AAAA queries with nodata, refused or drop\n"
+         "                    them. (nodata)\n");
+  printf("  -m min_ttl        Lowest TTL handed to clients. (%d)\n",
+         defaults.min_ttl);
+  printf("  -M max_ttl        Highest TTL handed to clients, 0 is unbounded. (%d)\n",
+         defaults.max_ttl);
+  printf("  -c cache_entries  Maximum number of cached answers, 0 disables. (%d)\n",
+         defaults.cache_entries);
+  printf("  -C cache_bytes    Maximum memory used by cached answers. (%d)\n",
+         defaults.cache_bytes);
+  printf("  -S max_stale      Seconds an expired answer may still be served\n"
+         "                    when the upstream fails, 0 disables. (%d)\n",
+         defaults.max_stale);
+  printf("  -f snapshot_file  Save the cache here on exit and load it at startup.\n");
+  printf("  -F snapshot_interval\n"
+         "                    Also save the cache every this many seconds,\n"
+         "                    0 saves on exit only. (%d)\n",
+         defaults.snapshot_interval);
+  printf("  -T tcp_clients    Most TCP clients per worker, 0 disables TCP. (%d)\n",
+         defaults.tcp_clients);
+  printf("  -s stats_port     Serve Prometheus metrics over HTTP on this port,\n"
+         "                    optionally prefixed by an address, IPv6 ones\n"
+         "                    in brackets. (%s, off)\n",
+         defaults.stats_addr);
+  printf("  -w workers        Worker threads, each with its own SO_REUSEPORT\n"
+         "                    socket, event loop and cache. (%d)\n",
+         defaults.workers);
+  printf("  -W                Pin each worker thread to a CPU.\n");
+  printf("  -o options_file   Read more options from this file, overriding those\n"
+         "                    given here. Re-read on SIGHUP, when those that\n"
+         "                    can change without a restart are applied.\n");
+  printf("  -U handoff_socket Hand the listening sockets over to a newer process\n"
+         "                    started with the same socket path, then exit.\n");
   printf("  -v                Increase logging verbosity. (INFO)\n");
   printf("  -h                Show Usage and Exit.\n");
   options_cleanup(&defaults);
 }
 
 void options_cleanup(struct Options *opt) {
-  if (opt->logfd > 0) {
+  if (opt->logfd > 0 && opt->logfd != STDOUT_FILENO) {
     close(opt->logfd);
   }
+  opt->logfd = -1;
+  if (opt->prefix_table) {
+    subnet_table_cleanup(opt->prefix_table);
+    free(opt->prefix_table);
+    opt->prefix_table = NULL;
+  }
+  if (opt->local_zone) {
+    local_zone_cleanup(opt->local_zone);
+    free(opt->local_zone);
+    opt->local_zone = NULL;
+  }
+  free(opt->options_argv);
+  free(opt->options_buf);
+  opt->options_argv = NULL;
+  opt->options_buf = NULL;
 }
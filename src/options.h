@@ -4,8 +4,20 @@
 
 #include <stdint.h>
 
+#define MAX_UPSTREAMS 8
+
+#define MAX_LISTEN_ADDRS 8
+
+// Longest edns-client-subnet accepted, e.g. "203.31.0.0/16".
+#define MAX_SUBNET_LENGTH 63
+
+// Upstream used with -D unless -r is given.
+#define DOH_DEFAULT_UPSTREAM "https://doh.pub/dns-query"
+
 struct Options {
-  const char *listen_addr;
+  // IPv4 and IPv6 addresses to serve on, all at 'listen_port'.
+  const char *listen_addrs[MAX_LISTEN_ADDRS];
+  int num_listen_addrs;
   uint16_t listen_port;
 
   // Google DNS can accept an edns_client_subnet option.
@@ -16,6 +28,21 @@ struct Options {
   // If an IPv4 subnet is specified here, all requests will be made as if from
   // this address for supported domain resolvers.
   const char *edns_client_subnet;
+  // Whether the subnet is derived from each client instead: its Client
+  // Subnet option if it sends one, else its address, truncated to /24.
+  // Private addresses fall back to 'edns_client_subnet'.
+  int client_subnet;
+  // Maps client prefixes to subnets ahead of the above, NULL for none.
+  // Loaded from 'prefix_file', which implies 'client_subnet'.
+  const char *prefix_file;
+  struct subnet_table_s *prefix_table;
+
+  // Names answered without asking upstream: hosts from 'hosts_file' and
+  // domains blocked with their subdomains from 'blocklist_file', NULL for
+  // none. Both are loaded into 'local_zone'.
+  const char *hosts_file;
+  const char *blocklist_file;
+  struct local_zone_s *local_zone;
 
   // Logfile.
   const char *logfile;
@@ -37,12 +64,88 @@ struct Options {
   // DNS servers to look up dns.google.com
   const char *bootstrap_dns;
 
+  // HTTPDNS endpoints, e.g. "http://119.29.29.29/d". The query string with
+  // the name is appended. Queries go to the fastest healthy one.
+  const char *upstreams[MAX_UPSTREAMS];
+  int num_upstreams;
+
+  // Whether the upstreams are DNS-over-HTTPS (RFC 8484) endpoints taking
+  // wire-format queries, rather than HTTPDNS ones.
+  int doh;
+
+  // Milliseconds before a slow fetch is raced by a second one. Zero adapts
+  // to the observed upstream latency, negative disables hedging.
+  int hedge_delay_ms;
+  // Hedged fetches allowed, in percent of requests.
+  int hedge_budget;
+
+  // Limits applied to the curl multi handle: connections in use, to a
+  // single host (0 is unlimited) and kept open while idle.
+  int max_total_connections;
+  int max_host_connections;
+  int max_idle_connections;
+  // Seconds between HEAD requests that keep idle upstream connections
+  // open. Zero disables keepalive and warm-up at startup.
+  int keepalive;
+
+  // Queries per second each client address may send to a worker, 0 for no
+  // limit; those over it are dropped. Upstream lookups in flight per worker at
+  // most, 0 for no limit; past it, queries not answered from the cache
+  // get stale answers or SERVFAIL.
+  int client_qps;
+  int max_in_flight;
+
   // Optional http proxy if required.
   // e.g. "socks5://127.0.0.1:1080"
   const char *curl_proxy;
 
   // Hack to fix OpenWRT issues due to dropping of HTTP/2 support from libcurl.
   int use_http_1_1;
+
+  // Reply code for AAAA queries, which DNSPod cannot answer: NOERROR gives
+  // an empty answer (NODATA), REFUSED sends clients elsewhere, -1 drops.
+  int aaaa_rcode;
+
+  // Bounds applied to the TTL of upstream answers. Zero max means unbounded.
+  int min_ttl;
+  int max_ttl;
+
+  // Most TCP clients served at once per worker. Zero disables TCP.
+  int tcp_clients;
+
+  // Address and port of the HTTP endpoint serving metrics. Port zero
+  // disables it.
+  const char *stats_addr;
+  int stats_port;
+  char stats_addr_buf[64]; // Holds the address given with -s.
+
+  // Number of worker threads, each with its own loop, socket and cache.
+  int workers;
+  // Whether to pin each worker thread to a CPU.
+  int pin_workers;
+
+  // Limits of the in-process answer cache. Zero disables caching.
+  int cache_entries;
+  int cache_bytes;
+  // File the cache is saved to on exit and loaded from at startup, NULL
+  // for none, and seconds between periodic saves, zero for none. Each
+  // worker past the first adds its number to the name, e.g. "cache.1".
+  const char *snapshot_file;
+  int snapshot_interval;
+  // Seconds past expiry a cached answer may still be served when the
+  // upstream fails (RFC 8767). Zero disables serve-stale.
+  int max_stale;
+
+  // File holding more options, read after the command line and again on
+  // SIGHUP. Those it gives override the command line, and upstreams given
+  // there replace those given on it.
+  const char *options_file;
+  char *options_buf;   // The file, split into words.
+  char **options_argv; // Points into options_buf.
+
+  // UNIX socket through which a newer process takes over the listening
+  // sockets, NULL for none.
+  const char *handoff_path;
 };
 typedef struct Options options_t;
 
@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "rate_limit.h"
+
+void rate_limit_init(rate_limit_t *r, double rate) {
+  memset(r, 0, sizeof(*r));
+  rate_limit_set_rate(r, rate);
+}
+
+void rate_limit_set_rate(rate_limit_t *r, double rate) {
+  r->rate = rate;
+  r->burst = rate * RATE_LIMIT_BURST;
+  if (r->burst < 1) {
+    r->burst = 1;
+  }
+}
+
+int rate_limit_allow(rate_limit_t *r, uint32_t key, ev_tstamp now) {
+  if (r->rate <= 0) {
+    return 1;
+  }
+  // Fibonacci hashing spreads neighbouring addresses over the table.
+  uint32_t set = (key * 2654435769u) >> 20 & (RATE_LIMIT_SLOTS / 2 - 1);
+  struct rate_bucket *b = &r->slots[set * 2];
+  if (b->key != key || b->last == 0) {
+    struct rate_bucket *other = b + 1;
+    if (other->key == key && other->last != 0) {
+      b = other;
+    } else {
+      // New to the set: starts full, in place of the one idle longest.
+      if (other->last < b->last) {
+        b = other;
+      }
+      b->key = key;
+      b->tokens = r->burst;
+      b->last = now;
+    }
+  }
+  double tokens = b->tokens + (now - b->last) * r->rate;
+  b->tokens = tokens < r->burst ? tokens : r->burst;
+  b->last = now;
+  if (b->tokens < 1) {
+    return 0;
+  }
+  b->tokens -= 1;
+  return 1;
+}
@@ -0,0 +1,43 @@
+// Token buckets limiting the query rate of each client, in a fixed table so
+// that a flood of clients costs no memory.
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include <ev.h>
+#include <stdint.h>
+
+// Buckets per table, two per set; a power of two.
+#define RATE_LIMIT_SLOTS 4096
+
+// Seconds of queries a client may send at once after being quiet.
+#define RATE_LIMIT_BURST 2
+
+typedef struct {
+  // Two way set associative: a client new to its set takes the bucket
+  // used least recently, so a few busy clients cannot evict each other.
+  struct rate_bucket {
+    uint32_t key;
+    float tokens;
+    ev_tstamp last;
+  } slots[RATE_LIMIT_SLOTS];
+  double rate;  // Queries per second, 0 for no limit.
+  double burst; // Tokens a bucket holds at most.
+} rate_limit_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Limits each client to 'rate' queries per second. 0 disables the limit.
+void rate_limit_init(rate_limit_t *r, double rate);
+
+// Changes the rate, keeping what clients used so far.
+void rate_limit_set_rate(rate_limit_t *r, double rate);
+
+// Takes a token from the bucket of client 'key' (e.g. its IPv4 address).
+// Returns 1 if the query may go ahead, 0 if it is over the rate.
+int rate_limit_allow(rate_limit_t *r, uint32_t key, ev_tstamp now);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _RATE_LIMIT_H_
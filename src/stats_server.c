@@ -0,0 +1,188 @@
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ev.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dns_server.h"
+#include "logging.h"
+#include "stats_server.h"
+
+int stats_server_listen(const char *listen_addr, int listen_port) {
+  dns_addr_t laddr;
+  if (dns_server_parse_addr(listen_addr, listen_port, &laddr) < 0) {
+    FLOG("Bad stats address '%s'", listen_addr);
+  }
+  int v6 = laddr.sa.sa_family == AF_INET6;
+  int sock = socket(laddr.sa.sa_family, SOCK_STREAM, 0);
+  if (sock < 0) {
+    FLOG("Error creating stats socket");
+  }
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(sock, &laddr.sa, dns_server_addr_len(&laddr)) < 0) {
+    FLOG("Error binding stats %s%s%s:%d", v6 ? "[" : "", listen_addr,
+         v6 ? "]" : "", listen_port);
+  }
+  if (listen(sock, SOMAXCONN) < 0) {
+    FLOG("Error listening on stats %s%s%s:%d", v6 ? "[" : "", listen_addr,
+         v6 ? "]" : "", listen_port);
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+  ILOG("Serving stats on http://%s%s%s:%d/metrics", v6 ? "[" : "",
+       listen_addr, v6 ? "]" : "", listen_port);
+  return sock;
+}
+
+static void stats_conn_close(struct stats_conn *c) {
+  ev_io_stop(c->s->loop, &c->watcher);
+  ev_timer_stop(c->s->loop, &c->timer);
+  close(c->fd);
+  c->fd = -1;
+  metrics_buf_free(&c->resp);
+}
+
+static void conn_write_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  struct stats_conn *c = (struct stats_conn *)w->data;
+  while (c->sent < c->resp.len) {
+    ssize_t r = write(c->fd, c->resp.buf + c->sent, c->resp.len - c->sent);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (r <= 0) {
+      DLOG("Stats write failed: %s", strerror(errno));
+      break;
+    }
+    c->sent += r;
+  }
+  stats_conn_close(c);
+}
+
+// Builds the whole response, then writes it out as the socket allows.
+static void stats_conn_respond(struct stats_conn *c) {
+  stats_server_t *s = c->s;
+  const char *status = "404 Not Found";
+  metrics_buf_t body = { NULL, 0, 0 };
+  if (!strncmp(c->req, "GET /metrics ", 13) ||
+      !strncmp(c->req, "GET /metrics?", 13)) {
+    status = "200 OK";
+    s->cb(s->cb_data, &body);
+  } else if (!strncmp(c->req, "GET / ", 6)) {
+    metrics_printf(&body, "See /metrics\n");
+    status = "200 OK";
+  }
+  metrics_printf(&c->resp,
+                 "HTTP/1.0 %s\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n%.*s",
+                 status, body.len, (int)body.len, body.buf ? body.buf : "");
+  metrics_buf_free(&body);
+  c->sent = 0;
+
+  ev_io_stop(s->loop, &c->watcher);
+  ev_io_init(&c->watcher, conn_write_cb, c->fd, EV_WRITE);
+  c->watcher.data = c;
+  ev_io_start(s->loop, &c->watcher);
+}
+
+static void conn_read_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  struct stats_conn *c = (struct stats_conn *)w->data;
+  ssize_t r = read(c->fd, c->req + c->rlen, sizeof(c->req) - 1 - c->rlen);
+  if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return;
+  }
+  if (r <= 0) {
+    stats_conn_close(c);
+    return;
+  }
+  c->rlen += r;
+  c->req[c->rlen] = '\0';
+  // Only the request line matters, headers are read and ignored.
+  if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")) {
+    stats_conn_respond(c);
+  } else if (c->rlen == sizeof(c->req) - 1) {
+    DLOG("Oversized stats request, closing.");
+    stats_conn_close(c);
+  }
+}
+
+static void conn_timeout_cb(struct ev_loop *loop, ev_timer *w, int revents) {
+  struct stats_conn *c = (struct stats_conn *)w->data;
+  DLOG("Stats request timed out.");
+  stats_conn_close(c);
+}
+
+static void accept_cb(struct ev_loop *loop, ev_io *w, int revents) {
+  stats_server_t *s = (stats_server_t *)w->data;
+  for (;;) {
+    int fd = accept(w->fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+        WLOG("accept failed: %s", strerror(errno));
+      }
+      return;
+    }
+    struct stats_conn *c = NULL;
+    int i;
+    for (i = 0; i < STATS_SERVER_MAX_CONNS; i++) {
+      if (s->conns[i].fd < 0) {
+        c = &s->conns[i];
+        break;
+      }
+    }
+    if (!c) {
+      DLOG("Too many stats clients, refusing one.");
+      close(fd);
+      continue;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    c->s = s;
+    c->fd = fd;
+    c->rlen = 0;
+    ev_io_init(&c->watcher, conn_read_cb, fd, EV_READ);
+    c->watcher.data = c;
+    ev_io_start(loop, &c->watcher);
+    ev_timer_init(&c->timer, conn_timeout_cb, STATS_SERVER_TIMEOUT, 0);
+    c->timer.data = c;
+    ev_timer_start(loop, &c->timer);
+  }
+}
+
+void stats_server_init(stats_server_t *s, struct ev_loop *loop, int sock,
+                       stats_render_cb cb, void *data) {
+  s->loop = loop;
+  s->sock = sock;
+  s->cb = cb;
+  s->cb_data = data;
+  int i;
+  for (i = 0; i < STATS_SERVER_MAX_CONNS; i++) {
+    memset(&s->conns[i], 0, sizeof(s->conns[i]));
+    s->conns[i].fd = -1;
+  }
+  ev_io_init(&s->accept_watcher, accept_cb, sock, EV_READ);
+  s->accept_watcher.data = s;
+  ev_io_start(loop, &s->accept_watcher);
+}
+
+void stats_server_cleanup(stats_server_t *s) {
+  int i;
+  for (i = 0; i < STATS_SERVER_MAX_CONNS; i++) {
+    if (s->conns[i].fd >= 0) {
+      stats_conn_close(&s->conns[i]);
+    }
+  }
+  ev_io_stop(s->loop, &s->accept_watcher);
+  close(s->sock);
+}
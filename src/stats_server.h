@@ -0,0 +1,54 @@
+// A minimal HTTP endpoint serving metrics to Prometheus style scrapers.
+#ifndef _STATS_SERVER_H_
+#define _STATS_SERVER_H_
+
+#include <ev.h>
+
+#include "metrics.h"
+
+// Most scrapes served at once, and seconds one may take.
+#define STATS_SERVER_MAX_CONNS 8
+#define STATS_SERVER_TIMEOUT 5
+
+// Appends the metrics to 'b'.
+typedef void (*stats_render_cb)(void *data, metrics_buf_t *b);
+
+// Internal: A scrape in progress.
+struct stats_conn {
+  struct stats_server_s *s;
+  int fd; // -1 while the slot is free.
+  ev_io watcher;
+  ev_timer timer;
+  char req[1024];
+  int rlen;
+  metrics_buf_t resp;
+  size_t sent;
+};
+
+typedef struct stats_server_s {
+  struct ev_loop *loop;
+  int sock;
+  ev_io accept_watcher;
+  stats_render_cb cb;
+  void *cb_data;
+  struct stats_conn conns[STATS_SERVER_MAX_CONNS];
+} stats_server_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Creates and binds a non-blocking listening TCP socket on an IPv4 or IPv6
+// 'listen_addr'.
+int stats_server_listen(const char *listen_addr, int listen_port);
+
+// Answers "GET /metrics" on 'sock' with what 'cb' renders. The server takes
+// ownership of the socket.
+void stats_server_init(stats_server_t *s, struct ev_loop *loop, int sock,
+                       stats_render_cb cb, void *data);
+
+void stats_server_cleanup(stats_server_t *s);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _STATS_SERVER_H_
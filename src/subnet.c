@@ -0,0 +1,161 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "subnet.h"
+
+static uint32_t subnet_mask(int len) {
+  return len == 0 ? 0 : 0xffffffffu << (32 - len);
+}
+
+static uint32_t subnet_addr_u32(const uint8_t addr[4]) {
+  return (uint32_t)addr[0] << 24 | (uint32_t)addr[1] << 16 |
+         (uint32_t)addr[2] << 8 | addr[3];
+}
+
+void subnet_set(subnet_t *s, const uint8_t addr[4], int prefix) {
+  uint32_t a = subnet_addr_u32(addr) & subnet_mask(prefix);
+  s->addr[0] = a >> 24;
+  s->addr[1] = a >> 16;
+  s->addr[2] = a >> 8;
+  s->addr[3] = a;
+  s->prefix = prefix;
+  snprintf(s->text, sizeof(s->text), "%u.%u.%u.%u/%d", s->addr[0],
+           s->addr[1], s->addr[2], s->addr[3], prefix);
+}
+
+int subnet_parse(const char *text, subnet_t *s) {
+  unsigned int a, b, c, d;
+  int prefix = 32;
+  char tail;
+  int n = sscanf(text, "%u.%u.%u.%u/%d%c", &a, &b, &c, &d, &prefix, &tail);
+  if ((n != 4 && n != 5) || (n == 4 && strchr(text, '/')) || a > 255 ||
+      b > 255 || c > 255 || d > 255 || prefix < 0 || prefix > 32) {
+    return -1;
+  }
+  uint8_t addr[4] = { a, b, c, d };
+  subnet_set(s, addr, prefix);
+  return 0;
+}
+
+int subnet_is_public(const uint8_t addr[4]) {
+  // Private, shared, loopback, link local, multicast and reserved ranges.
+  static const struct {
+    uint32_t net;
+    int len;
+  } special[] = {
+    { 0x00000000, 8 },  { 0x0a000000, 8 },  { 0x64400000, 10 },
+    { 0x7f000000, 8 },  { 0xa9fe0000, 16 }, { 0xac100000, 12 },
+    { 0xc0a80000, 16 }, { 0xe0000000, 3 },
+  };
+  uint32_t a = subnet_addr_u32(addr);
+  size_t i;
+  for (i = 0; i < sizeof(special) / sizeof(special[0]); i++) {
+    if ((a & subnet_mask(special[i].len)) == special[i].net) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int rule_cmp(const void *x, const void *y) {
+  const struct subnet_rule *a = (const struct subnet_rule *)x;
+  const struct subnet_rule *b = (const struct subnet_rule *)y;
+  if (a->len != b->len) {
+    return b->len - a->len;
+  }
+  return a->net < b->net ? -1 : a->net > b->net;
+}
+
+int subnet_table_load(subnet_table_t *t, const char *path) {
+  memset(t, 0, sizeof(*t));
+  FILE *f = fopen(path, "r");
+  if (!f) {
+    printf("Prefix table '%s' is not readable.\n", path);
+    return -1;
+  }
+  int size = 0;
+  int lineno = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    lineno++;
+    char *hash = strchr(line, '#');
+    if (hash) {
+      *hash = '\0';
+    }
+    char from[64], to[64], extra;
+    int n = sscanf(line, "%63s %63s %c", from, to, &extra);
+    if (n <= 0) {
+      continue; // Blank or only a comment.
+    }
+    subnet_t prefix, subnet;
+    if (n != 2 || subnet_parse(from, &prefix) || subnet_parse(to, &subnet)) {
+      printf("%s:%d: expected \"client_prefix subnet\".\n", path, lineno);
+      fclose(f);
+      subnet_table_cleanup(t);
+      return -1;
+    }
+    if (t->num == size) {
+      size = size ? size * 2 : 16;
+      struct subnet_rule *rules = (struct subnet_rule *)realloc(
+          t->rules, size * sizeof(struct subnet_rule));
+      if (!rules) {
+        printf("Out of memory reading '%s'.\n", path);
+        fclose(f);
+        subnet_table_cleanup(t);
+        return -1;
+      }
+      t->rules = rules;
+    }
+    struct subnet_rule *r = &t->rules[t->num++];
+    r->net = subnet_addr_u32(prefix.addr);
+    r->len = prefix.prefix;
+    r->subnet = subnet;
+  }
+  fclose(f);
+  qsort(t->rules, t->num, sizeof(struct subnet_rule), rule_cmp);
+  int i;
+  for (i = 0; i < t->num; i++) {
+    struct subnet_group *g =
+        t->num_groups ? &t->groups[t->num_groups - 1] : NULL;
+    if (!g || g->len != t->rules[i].len) {
+      g = &t->groups[t->num_groups++];
+      g->len = t->rules[i].len;
+      g->start = i;
+    }
+    g->end = i + 1;
+  }
+  return 0;
+}
+
+const subnet_t *subnet_table_lookup(const subnet_table_t *t,
+                                    const uint8_t addr[4]) {
+  uint32_t a = subnet_addr_u32(addr);
+  int i;
+  // A binary search within the rules of each prefix length, longest first.
+  for (i = 0; i < t->num_groups; i++) {
+    const struct subnet_group *g = &t->groups[i];
+    uint32_t net = a & subnet_mask(g->len);
+    int lo = g->start, hi = g->end;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (t->rules[mid].net < net) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo < g->end && t->rules[lo].net == net) {
+      return &t->rules[lo].subnet;
+    }
+  }
+  return NULL;
+}
+
+void subnet_table_cleanup(subnet_table_t *t) {
+  free(t->rules);
+  t->rules = NULL;
+  t->num = 0;
+  t->num_groups = 0;
+}
@@ -0,0 +1,66 @@
+// Picks the client subnet upstream answers are tailored for (EDNS Client
+// Subnet, or the HTTPDNS "ip" parameter), so clients of different sites
+// and ISPs each get nearby CDN endpoints.
+#ifndef _SUBNET_H_
+#define _SUBNET_H_
+
+#include <stdint.h>
+
+#include "options.h"
+
+// Prefix length client addresses are truncated to (RFC 7871 section 11.1).
+#define SUBNET_CLIENT_PREFIX 24
+
+// A subnet, kept as the text used in cache keys and upstream requests,
+// e.g. "203.31.5.0/24", and as the address and prefix length it stands for.
+typedef struct {
+  uint8_t addr[4];
+  int prefix;
+  char text[MAX_SUBNET_LENGTH + 1];
+} subnet_t;
+
+// Maps client prefixes to subnets, for clients on private addresses or
+// behind a resolver of their own. The longest matching prefix wins.
+typedef struct subnet_table_s {
+  struct subnet_rule {
+    uint32_t net; // Host order, masked to 'len'.
+    int len;
+    subnet_t subnet;
+  } *rules; // Longest prefixes first, then by 'net'.
+  int num;
+  // The rules of each prefix length present, searched in turn.
+  struct subnet_group {
+    int len;
+    int start;
+    int end;
+  } groups[33];
+  int num_groups;
+} subnet_table_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+// Parses "a.b.c.d/len", or "a.b.c.d" for a /32. Returns 0 on success.
+int subnet_parse(const char *text, subnet_t *s);
+
+// Sets 's' to the first 'prefix' bits of 'addr', in canonical text.
+void subnet_set(subnet_t *s, const uint8_t addr[4], int prefix);
+
+// Whether 'addr' is routable on the internet, so its subnet means something
+// to an upstream.
+int subnet_is_public(const uint8_t addr[4]);
+
+// Reads a table of "client_prefix subnet" lines from 'path', '#' starting
+// a comment. Returns 0 on success, -1 after printing what is wrong.
+int subnet_table_load(subnet_table_t *t, const char *path);
+
+// Returns the subnet of the longest prefix matching 'addr', or NULL.
+const subnet_t *subnet_table_lookup(const subnet_table_t *t,
+                                    const uint8_t addr[4]);
+
+void subnet_table_cleanup(subnet_table_t *t);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SUBNET_H_
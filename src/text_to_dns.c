@@ -1,29 +1,182 @@
 #include <sys/types.h>
+
+#include <arpa/nameser.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
+#include "dns_packet.h"
 #include "logging.h"
-#include "json_to_dns.h"
 #include "text_to_dns.h"
 
-#define MAX_MSG_LENGTH 512
+// TTL written on answers when the body does not carry one.
+#define DEFAULT_TTL 99
+
+// Parses a dotted quad from [s, e) into 'out' in network order.
+// Returns the number of bytes consumed, or -1 if it is not an IPv4 address.
+static int parse_ipv4(const char *s, const char *e, uint8_t *out) {
+  const char *p = s;
+  int i;
+  for (i = 0; i < 4; i++) {
+    if (i > 0) {
+      if (p >= e || *p != '.') { return -1; }
+      p++;
+    }
+    unsigned int v = 0;
+    const char *digits = p;
+    while (p < e && *p >= '0' && *p <= '9' && p - digits < 3) {
+      v = v * 10 + (*p++ - '0');
+    }
+    if (p == digits || v > 255) { return -1; }
+    out[i] = v;
+  }
+  return p - s;
+}
+
+int text_parser_init(text_parser_t *p, uint16_t tx_id, const char *name,
+                     uint8_t *out, int olen) {
+  memset(p, 0, sizeof(*p));
+  p->out = out;
+  p->olen = olen;
+  uint8_t *pos = out;
+  uint8_t *end = out + olen;
+
+  if (olen < 12) { return -1; }
+  NS_PUT16(tx_id, pos);
+  NS_PUT16(0x8180, pos); // Response, RD, RA, NOERROR.
+  NS_PUT16(1, pos); // Question
+  NS_PUT16(0, pos); // Answer, set when finished.
+  NS_PUT16(0, pos); // Authority
+  NS_PUT16(0, pos); // Additional
+
+  int r = dns_packet_write_name(name, pos, end - pos);
+  if (r < 0 || end - pos < r + 4) {
+    DLOG("Failed to encode question name.");
+    return -1;
+  }
+  pos += r;
+  NS_PUT16(ns_t_a, pos);
+  NS_PUT16(ns_c_in, pos);
+  p->len = p->answers = pos - out;
+  return 0;
+}
+
+// Appends an A record for 'addr', unless out of space.
+static void text_parser_put(text_parser_t *p, const uint8_t addr[4]) {
+  if (p->olen - p->len < 16) {
+    // Keep what fits rather than failing the whole answer.
+    WLOG("Out of buffer space after %d answers.", p->ancount);
+    p->full = 1;
+    return;
+  }
+  uint8_t *pos = p->out + p->len;
+  NS_PUT16(0xc000 | 12, pos); // Points back at the question name.
+  NS_PUT16(ns_t_a, pos);
+  NS_PUT16(ns_c_in, pos);
+  NS_PUT32(0, pos); // The TTL, known at the end.
+  NS_PUT16(4, pos);
+  memcpy(pos, addr, 4);
+  p->len += 16;
+  p->ancount++;
+}
+
+// Adds the address in 'w' as a record. 'required' is set if another
+// follows, so it may not be empty.
+static void text_parser_add(text_parser_t *p, const char *w, int len,
+                            int required) {
+  if (p->full || (len == 0 && !required)) {
+    return;
+  }
+  uint8_t addr[4];
+  if (parse_ipv4(w, w + len, addr) != len) {
+    DLOG("Bad address in response: %.*s", len, w);
+    p->error = 1;
+    return;
+  }
+  text_parser_put(p, addr);
+}
 
-const unsigned char* template = "{\"Status\": 0,\"TC\": false,\"RD\": true,\"RA\": true,\"AD\": false,\"CD\": false,\"Question\":[ {\"name\": \"%s.\",\"type\": 1}],\"Answer\":[ {\"name\": \"%s.\",\"type\": 1,\"TTL\": 99,\"data\": \"%s\"}]}";
+int text_parser_feed(text_parser_t *p, const char *in, size_t inlen) {
+  const char *s = in;
+  const char *e = in + inlen;
+  while (s < e && !p->error) {
+    if (p->in_ttl) {
+      // The TTL follows the ',' and applies to every address before it.
+      for (; s < e && !p->ttl_done; s++) {
+        if (*s >= '0' && *s <= '9' && p->ttl < 0x7fffffff / 10) {
+          p->ttl = p->ttl * 10 + (*s - '0');
+          p->has_ttl = 1;
+        } else {
+          p->ttl_done = 1;
+        }
+      }
+      break;
+    }
+    if (p->wordlen == 0 && !p->full) {
+      // Usually addresses arrive whole and are read in place.
+      uint8_t addr[4];
+      int r = parse_ipv4(s, e, addr);
+      if (r > 0 && s + r < e && (s[r] == ';' || s[r] == ',')) {
+        text_parser_put(p, addr);
+        s += r;
+        p->in_ttl = *s++ == ',';
+        continue;
+      }
+    }
+    const char *sep = s;
+    while (sep < e && *sep != ';' && *sep != ',') {
+      sep++;
+    }
+    if (!p->full) {
+      // Otherwise it is gathered until its end arrives.
+      if (p->wordlen + (sep - s) >= (int)sizeof(p->word)) {
+        DLOG("Bad address in response: %.*s%.*s", p->wordlen, p->word,
+             (int)(sep - s), s);
+        p->error = 1;
+        break;
+      }
+      memcpy(p->word + p->wordlen, s, sep - s);
+      p->wordlen += sep - s;
+      if (sep < e) {
+        text_parser_add(p, p->word, p->wordlen, *sep == ';');
+        p->wordlen = 0;
+      }
+    }
+    s = sep;
+    if (s < e) {
+      p->in_ttl = *s++ == ',';
+    }
+  }
+  return p->error ? -1 : 0;
+}
 
-int text_to_dns(uint16_t tx_id, char *in, uint8_t *out, int olen) {
-  // DLOG(in);
-  char* findPos = strstr(in, ":");
-  if (findPos < 0 || strlen(in) <= (findPos - in)) return -1;
-  else {
-    char buf[MAX_MSG_LENGTH] = "";
+int text_parser_finish(text_parser_t *p, uint32_t min_ttl, uint32_t max_ttl) {
+  if (!p->in_ttl) {
+    text_parser_add(p, p->word, p->wordlen, 0);
+  }
+  if (p->error) {
+    return -1;
+  }
+  uint32_t ttl = p->has_ttl ? p->ttl : DEFAULT_TTL;
+  if (ttl < min_ttl) { ttl = min_ttl; }
+  if (max_ttl && ttl > max_ttl) { ttl = max_ttl; }
+  int i;
+  for (i = 0; i < p->ancount; i++) {
+    uint8_t *pos = p->out + p->answers + i * 16 + 6;
+    NS_PUT32(ttl, pos);
+  }
+  uint8_t *pos = p->out + 6;
+  NS_PUT16(p->ancount, pos);
+  return p->len;
+}
 
-    findPos[0] = '\0';
-    char *name = in;
-    char *data = findPos + 1; // findPos + strlen(":");
-    snprintf(buf, sizeof(buf) - 1, template, name, name, data);
-    DLOG(buf);
-    return json_to_dns(tx_id, buf, out, olen);
+int text_to_dns(uint16_t tx_id, const char *name, const char *in, size_t inlen,
+                uint32_t min_ttl, uint32_t max_ttl, uint8_t *out, int olen) {
+  text_parser_t p;
+  if (text_parser_init(&p, tx_id, name, out, olen) ||
+      text_parser_feed(&p, in, inlen)) {
+    return -1;
   }
+  return text_parser_finish(&p, min_ttl, max_ttl);
 }
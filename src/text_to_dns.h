@@ -1,15 +1,56 @@
-// A simple TEXT -> DNS packet converter.
+// A simple DNSPod HTTPDNS TEXT -> DNS packet converter.
 #ifndef _TEXT_TO_DNS_H_
 #define _TEXT_TO_DNS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Converts a body piece by piece as it arrives, writing each A record to
+// the packet as soon as its address is complete, so the body itself is
+// never kept. The TTL comes last and is filled in by text_parser_finish.
+typedef struct {
+  uint8_t *out;
+  int olen;
+  int len;          // Bytes of 'out' written so far.
+  int answers;      // Offset of the first record.
+  uint16_t ancount;
+  char word[16];    // The address being read, e.g. "255.255.255.255".
+  int wordlen;
+  int in_ttl;       // Past the ',', reading the TTL.
+  int ttl_done;     // The TTL ended, the rest is ignored.
+  int has_ttl;
+  uint32_t ttl;
+  int full;         // Out of space, further addresses are dropped.
+  int error;
+} text_parser_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
-// Creates a DNS packet from a TEXT Format: [Domain]:[IP].
-// 'tx_id' is the ID to use in the packet, 'in' is the JSON representation.
+// Starts a packet with ID 'tx_id' answering 'name' in 'out', a buffer of
+// 'olen' bytes that must stay valid until text_parser_finish.
+// Returns 0 on success, -1 if the question does not fit.
+int text_parser_init(text_parser_t *p, uint16_t tx_id, const char *name,
+                     uint8_t *out, int olen);
+
+// Consumes the next 'inlen' bytes of the body. After a malformed address
+// the rest is skipped. Returns 0, or -1 once the body is known to be bad.
+int text_parser_feed(text_parser_t *p, const char *in, size_t inlen);
+
+// Ends the body, setting every record's TTL to the body's, clamped to
+// ['min_ttl', 'max_ttl']. A 'max_ttl' of zero means no upper bound.
+// Returns size of packet on success, -1 on failure.
+int text_parser_finish(text_parser_t *p, uint32_t min_ttl, uint32_t max_ttl);
+
+// Creates a DNS packet from a DNSPod response body of the form "ip;ip,ttl".
+// 'tx_id' is the ID to use in the packet, 'name' the queried domain and
+// 'in' the body of 'inlen' bytes.
+// Every address becomes an A record carrying the body's TTL, clamped to
+// ['min_ttl', 'max_ttl']. A 'max_ttl' of zero means no upper bound.
 // 'out' is a buffer to write the packet to. 'olen' is buffer length in bytes.
 // Returns size of packet on success, -1 on failure.
-int text_to_dns(uint16_t tx_id, char *in, uint8_t *out, int olen);
+int text_to_dns(uint16_t tx_id, const char *name, const char *in, size_t inlen,
+                uint32_t min_ttl, uint32_t max_ttl, uint8_t *out, int olen);
 #ifdef __cplusplus
 }
 #endif
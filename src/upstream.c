@@ -0,0 +1,123 @@
+#include <string.h>
+
+#include "logging.h"
+#include "upstream.h"
+
+// Weight of a new sample in the moving averages.
+#define EWMA_ALPHA 0.2
+
+// One selection in this many goes to the least recently used endpoint.
+#define PROBE_INTERVAL 64
+
+// Seconds charged per unit of error rate. A failure usually costs a client
+// the whole transfer timeout, so errors dominate small latency differences.
+#define ERROR_PENALTY 2.0
+
+// Bounds of upstream_hedge_delay. The upper one stays well below the
+// transfer timeout, and applies until there are measurements.
+#define HEDGE_MIN_DELAY 0.05
+#define HEDGE_MAX_DELAY 1.0
+
+void upstream_set_init(upstream_set_t *u, const char *const *urls, int num) {
+  memset(u, 0, sizeof(*u));
+  int i;
+  for (i = 0; i < num && i < MAX_UPSTREAMS; i++) {
+    u->list[i].url = urls[i];
+  }
+  u->num = i;
+}
+
+void upstream_set_update(upstream_set_t *u, const char *const *urls,
+                         int num) {
+  upstream_t old[MAX_UPSTREAMS];
+  int old_num = u->num;
+  memcpy(old, u->list, sizeof(old));
+  if (num > MAX_UPSTREAMS) {
+    num = MAX_UPSTREAMS;
+  }
+  int i, j;
+  for (i = 0; i < num; i++) {
+    memset(&u->list[i], 0, sizeof(u->list[i]));
+    for (j = 0; j < old_num; j++) {
+      if (old[j].url && !strcmp(old[j].url, urls[i])) {
+        u->list[i] = old[j];
+        break;
+      }
+    }
+    u->list[i].url = urls[i];
+  }
+  // Removed endpoints may still be named by a lookup in flight, and the
+  // strings they pointed at are about to go away.
+  for (; i < MAX_UPSTREAMS; i++) {
+    memset(&u->list[i], 0, sizeof(u->list[i]));
+    u->list[i].url = "(removed)";
+  }
+  u->num = num;
+}
+
+static double upstream_score(const upstream_t *up) {
+  return up->latency + up->errors * ERROR_PENALTY;
+}
+
+upstream_t *upstream_select(upstream_set_t *u, const upstream_t *exclude,
+                            ev_tstamp now) {
+  upstream_t *best = NULL;
+  upstream_t *oldest = NULL;
+  int i;
+  for (i = 0; i < u->num; i++) {
+    upstream_t *up = &u->list[i];
+    if (up == exclude) {
+      continue;
+    }
+    if (up->samples == 0) {
+      best = up;
+      break;
+    }
+    if (!best || upstream_score(up) < upstream_score(best)) {
+      best = up;
+    }
+    if (!oldest || up->last_used < oldest->last_used) {
+      oldest = up;
+    }
+  }
+  if (!best) {
+    best = (upstream_t *)exclude;
+  } else if (best->samples > 0 && ++u->selections % PROBE_INTERVAL == 0) {
+    best = oldest;
+  }
+  best->last_used = now;
+  return best;
+}
+
+ev_tstamp upstream_hedge_delay(const upstream_t *up) {
+  if (up->samples == 0 || up->latency == 0) {
+    return HEDGE_MAX_DELAY;
+  }
+  ev_tstamp delay = up->latency + 4 * up->latency_dev;
+  if (delay < HEDGE_MIN_DELAY) {
+    return HEDGE_MIN_DELAY;
+  }
+  return delay > HEDGE_MAX_DELAY ? HEDGE_MAX_DELAY : delay;
+}
+
+void upstream_report(upstream_t *up, int ok, double total_time) {
+  if (up->samples++ == 0) {
+    up->errors = ok ? 0 : 1;
+    up->latency = ok ? total_time : 0;
+    up->latency_dev = ok ? total_time / 2 : 0;
+    return;
+  }
+  up->errors += EWMA_ALPHA * ((ok ? 0 : 1) - up->errors);
+  if (ok && up->latency == 0) {
+    // Every earlier sample failed.
+    up->latency = total_time;
+    up->latency_dev = total_time / 2;
+  } else if (ok) {
+    double diff = total_time - up->latency;
+    up->latency += EWMA_ALPHA * diff;
+    up->latency_dev += EWMA_ALPHA * ((diff < 0 ? -diff : diff) -
+                                     up->latency_dev);
+  }
+  DLOG("Upstream %s: latency %.3lfs, errors %.2lf", up->url, up->latency,
+       up->errors);
+}
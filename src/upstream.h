@@ -0,0 +1,51 @@
+// Tracks the health of the configured HTTPDNS endpoints and picks one.
+#ifndef _UPSTREAM_H_
+#define _UPSTREAM_H_
+
+#include <ev.h>
+
+#include "options.h"
+
+typedef struct {
+  const char *url; // e.g. "http://119.29.29.29/d", the query is appended.
+  double latency;  // EWMA of total transfer time of successes, seconds.
+  double latency_dev; // EWMA of the deviation from 'latency'.
+  double errors;   // EWMA of the failure rate, 0 to 1.
+  unsigned int samples;
+  ev_tstamp last_used;
+} upstream_t;
+
+typedef struct {
+  upstream_t list[MAX_UPSTREAMS];
+  int num;
+  unsigned int selections;
+} upstream_set_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+void upstream_set_init(upstream_set_t *u, const char *const *urls, int num);
+
+// Replaces the endpoints with 'urls', keeping the estimates of those that
+// remain. The list stays in place, so lookups in flight keep valid pointers
+// into it, though one may now name another endpoint.
+void upstream_set_update(upstream_set_t *u, const char *const *urls, int num);
+
+// Returns the endpoint with the best expected latency, skipping 'exclude'
+// unless it is the only one. Endpoints without measurements are tried first
+// and now and then the least recently used one is probed to keep its
+// estimate current.
+upstream_t *upstream_select(upstream_set_t *u, const upstream_t *exclude,
+                            ev_tstamp now);
+
+// Returns how long a transfer to 'up' may take before it is unusually slow:
+// the latency estimate plus four deviations, within sane bounds.
+ev_tstamp upstream_hedge_delay(const upstream_t *up);
+
+// Records the outcome of a transfer. 'total_time' is ignored on failure.
+void upstream_report(upstream_t *up, int ok, double total_time);
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _UPSTREAM_H_